@@ -1,11 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <SDL2/SDL.h>
+#include "nbody.h"
 
 #define WIDTH   1200
 #define HEIGHT  800
 
-#define NUM_BODIES 3
+#define NUM_BODIES 3      // figure-8; any other --bodies count builds a disc
+#define TRAIL_BODIES 3
 #define TRAIL_BUF  5000
 #define MIN_DIST   1.5
 
@@ -16,13 +19,18 @@
 #define COL_YELLOW     0x00ffff00
 #define COL_LIGHTBLUE  0x00007fff
 #define COL_WHITE      0x00ffffff
+#define COL_GREY       0x00a0a0b0
 
-typedef struct {
-    double x, y;
-    double vx, vy;
-    double mass;
-    double r;
-} Planet;
+#define FIXED_DT        0.0002
+#define DISC_DT         0.001
+#define STEP_BUDGET     0.03     // seconds of physics per frame; past it the simulation runs slower than real time
+
+#define DISC_CENTRE_MASS 2000.0
+#define DISC_MASS        200.0
+#define DISC_INNER       60.0
+#define DISC_OUTER       380.0
+#define DISC_SOFTENING2  4.0
+#define DISC_SEED        0x2545F4914F6CDD1DULL
 
 typedef struct {
     int x[TRAIL_BUF];
@@ -76,75 +84,136 @@ static void trail_draw(SDL_Surface *surf, const Trail *t, Uint32 col)
     }
 }
 
-static void accelerations(const Planet b[], double ax[], double ay[])
+static void figure_eight(NBodySystem *sys)
 {
-    for (int i = 0; i < NUM_BODIES; ++i) ax[i] = ay[i] = 0.0;
-
-    for (int i = 0; i < NUM_BODIES; ++i) {
-        for (int j = i + 1; j < NUM_BODIES; ++j) {
-            double dx = b[j].x - b[i].x;
-            double dy = b[j].y - b[i].y;
-            double dist2 = dx*dx + dy*dy + EPSILON;
-            double dist  = sqrt(dist2);
-
-            double F  = (G * b[i].mass * b[j].mass) / dist2;
-            double fx = F * dx / dist;
-            double fy = F * dy / dist;
-
-            ax[i] +=  fx / b[i].mass;
-            ay[i] +=  fy / b[i].mass;
-            ax[j] -=  fx / b[j].mass;
-            ay[j] -=  fy / b[j].mass;
-        }
-    }
+    const double S  = 140.0;
+    const double VS = 140.0;
+    const double m  = 200.0;
+
+    nbody_add(sys, (-0.97000436)*S, ( 0.24308753)*S,  0.466203685*VS,  0.43236573*VS, m);
+    nbody_add(sys, 0.0,             0.0,             -0.93240737*VS,  -0.86473146*VS, m);
+    nbody_add(sys, ( 0.97000436)*S, (-0.24308753)*S,  0.466203685*VS,  0.43236573*VS, m);
 }
 
-static void step_leapfrog(Planet b[], double dt)
+static double disc_random(unsigned long long *state)
 {
-    static double ax[NUM_BODIES], ay[NUM_BODIES];
-    static int first = 1;
-
-    if (first) {
-        accelerations(b, ax, ay);
-        first = 0;
-    }
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
 
-    for (int i = 0; i < NUM_BODIES; ++i) {
-        b[i].vx += 0.5 * ax[i] * dt;
-        b[i].vy += 0.5 * ay[i] * dt;
-        b[i].x  +=      b[i].vx * dt;
-        b[i].y  +=      b[i].vy * dt;
+/* A heavy centre and n - 1 light bodies spread evenly over an annulus, each on the circular
+ * orbit set by the centre plus the disc mass inside its radius. */
+static void disc(NBodySystem *sys, int n)
+{
+    unsigned long long state = DISC_SEED;
+    double r0 = DISC_INNER * DISC_INNER, r1 = DISC_OUTER * DISC_OUTER;
+    double m = DISC_MASS / (n - 1);
+
+    nbody_add(sys, 0.0, 0.0, 0.0, 0.0, DISC_CENTRE_MASS);
+    for (int i = 1; i < n; ++i) {
+        double r2  = r0 + (r1 - r0) * disc_random(&state);
+        double r   = sqrt(r2);
+        double phi = 2.0 * M_PI * disc_random(&state);
+        double enclosed = DISC_CENTRE_MASS + DISC_MASS * (r2 - r0) / (r1 - r0);
+        double v   = sqrt(sys->gravity * enclosed * r2 / pow(r2 + sys->softening2, 1.5));
+        nbody_add(sys, r * cos(phi), r * sin(phi), -v * sin(phi), v * cos(phi), m);
     }
+}
 
-    accelerations(b, ax, ay);
+static int body_radius(int count, int i)
+{
+    if (count == NUM_BODIES)
+        return 15;
+    return i == 0 ? 12 : 1;
+}
 
-    for (int i = 0; i < NUM_BODIES; ++i) {
-        b[i].vx += 0.5 * ax[i] * dt;
-        b[i].vy += 0.5 * ay[i] * dt;
-    }
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--bodies N] [--integrator leapfrog|yoshida4|rk4]\n"
+                    "       [--solver auto|direct|barnes-hut] [--theta X] [--dt X]\n"
+                    RUN_OPTIONS_USAGE, prog);
 }
 
-static void recenter(Planet b[])
+int main(int argc, char *argv[])
 {
-    double cx = 0, cy = 0, M = 0;
-    for (int i = 0; i < NUM_BODIES; ++i) {
-        cx += b[i].x * b[i].mass;
-        cy += b[i].y * b[i].mass;
-        M  += b[i].mass;
+    int num_bodies = NUM_BODIES;
+    Integrator integrator = INTEGRATOR_LEAPFROG;
+    Solver solver = SOLVER_AUTO;
+    double theta = NBODY_THETA;
+    double dt = 0.0;
+    RunOptions run;
+    run_options_default(&run);
+
+    for (int a = 1; a < argc; ++a) {
+        int more = a + 1 < argc;
+        if (run_options_parse(&run, argc, argv, &a)) {
+            continue;
+        } else if (strcmp(argv[a], "--bodies") == 0 && more) {
+            num_bodies = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--integrator") == 0 && more) {
+            if (!nbody_parse_integrator(argv[++a], &integrator)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--solver") == 0 && more) {
+            if (!nbody_parse_solver(argv[++a], &solver)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--theta") == 0 && more) {
+            theta = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--dt") == 0 && more) {
+            dt = atof(argv[++a]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
     }
-    cx /= M;
-    cy /= M;
-
-    double dx = WIDTH / 2.0 - cx;
-    double dy = HEIGHT / 2.0 - cy;
-    for (int i = 0; i < NUM_BODIES; ++i) {
-        b[i].x += dx;
-        b[i].y += dy;
+    if (num_bodies < 2) {
+        fprintf(stderr, "--bodies needs at least 2 bodies\n");
+        return 1;
+    }
+
+    if (run.headless && run.replay) {
+        fprintf(stderr, "--headless and --replay do not combine\n");
+        return 1;
+    }
+
+    NBodySystem sys;
+    FILE *replay = NULL;
+    if (run.replay) {
+        replay = nbody_checkpoint_open(run.replay, &sys, &dt);
+        long long step;
+        double time;
+        if (!replay)
+            return 1;
+        if (!nbody_checkpoint_read(replay, &sys, &step, &time)) {
+            fprintf(stderr, "%s holds no checkpoints\n", run.replay);
+            return 1;
+        }
+        printf("Replaying %s: %d bodies, dt %g\n", run.replay, sys.count, dt);
+    } else {
+        if (num_bodies == NUM_BODIES) {
+            nbody_init(&sys, num_bodies, G, EPSILON);
+            figure_eight(&sys);
+        } else {
+            nbody_init(&sys, num_bodies, G, DISC_SOFTENING2);
+            disc(&sys, num_bodies);
+        }
+        sys.solver = solver;
+        sys.theta = theta;
+        if (dt <= 0.0)
+            dt = num_bodies == NUM_BODIES ? FIXED_DT : DISC_DT;
+    }
+
+    if (run.headless) {
+        int status = nbody_run_headless(&sys, integrator, dt, &run);
+        nbody_free(&sys);
+        return status;
     }
-}
 
-int main(void)
-{
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
         return 1;
@@ -164,27 +233,23 @@ int main(void)
         return 1;
     }
 
-    Planet bodies[NUM_BODIES];
-    const double S  = 140.0;
-    const double VS = 140.0;
-    const double m  = 200.0;
-    double cx = WIDTH / 2.0;
-    double cy = HEIGHT / 2.0;
-
-    bodies[0] = (Planet){ cx + (-0.97000436)*S, cy + ( 0.24308753)*S,
-                          0.466203685*VS,  0.43236573*VS,   m, 15 };
-    bodies[1] = (Planet){ cx,                 cy,
-                         -0.93240737*VS, -0.86473146*VS,   m, 15 };
-    bodies[2] = (Planet){ cx + ( 0.97000436)*S, cy + (-0.24308753)*S,
-                          0.466203685*VS,  0.43236573*VS,   m, 15 };
+    if (!replay)
+        printf("%d bodies, %s integrator, %s solver, dt %g\n", sys.count, integrator_names[integrator],
+               solver_names[nbody_effective_solver(&sys)], dt);
+    double e0 = nbody_energy(&sys);
 
-    Trail trails[NUM_BODIES] = {0};
+    static Trail trails[TRAIL_BODIES];
+    const Uint32 colours[TRAIL_BODIES] = { COL_YELLOW, COL_LIGHTBLUE, COL_WHITE };
+    int trail_count = sys.count < TRAIL_BODIES ? sys.count : TRAIL_BODIES;
 
     int running = 1;
+    int replaying = replay != NULL;
     SDL_Event ev;
-    const double FIXED_DT = 0.0002;
     double accumulator = 0.0;
     Uint32 prev = SDL_GetTicks();
+    Uint32 report = prev;
+    long long steps = 0;
+    double step_seconds = 0.0;
 
     while (running) {
         while (SDL_PollEvent(&ev))
@@ -196,30 +261,69 @@ int main(void)
         if (frame_dt > 0.05) frame_dt = 0.05;
         accumulator += frame_dt;
 
-        while (accumulator >= FIXED_DT) {
-            step_leapfrog(bodies, FIXED_DT);
-            accumulator -= FIXED_DT;
+        if (replaying && replay) {
+            /* One checkpoint per frame; the last one stays on screen */
+            long long step;
+            double time;
+            if (!nbody_checkpoint_read(replay, &sys, &step, &time)) {
+                printf("End of replay\n");
+                fclose(replay);
+                replay = NULL;
+            }
+        }
+
+        int frame_steps = 0;
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        double frame_seconds = 0.0;
+        while (!replaying && accumulator >= dt) {
+            nbody_step(&sys, integrator, dt);
+            accumulator -= dt;
+            ++frame_steps;
+            frame_seconds = (double)(SDL_GetPerformanceCounter() - t0) / SDL_GetPerformanceFrequency();
+            if (frame_seconds > STEP_BUDGET) {
+                accumulator = 0.0;
+                break;
+            }
+        }
+        step_seconds += frame_seconds;
+        steps += frame_steps;
+
+        if (now - report >= 1000 && steps > 0) {
+            double e = nbody_energy(&sys);
+            printf("%.1f us/step, %.1f force evaluations/step, energy drift %.3e\n",
+                   1e6 * step_seconds / steps, (double)sys.force_evaluations / steps,
+                   fabs((e - e0) / e0));
+            report = now;
+            steps = 0;
+            step_seconds = 0.0;
+            sys.force_evaluations = 0;
         }
 
-        recenter(bodies);
+        /* Keep the centre of mass in the middle of the window */
+        double cx, cy;
+        nbody_centre_of_mass(&sys, &cx, &cy);
+        double ox = WIDTH / 2.0 - cx;
+        double oy = HEIGHT / 2.0 - cy;
 
-        for (int i = 0; i < NUM_BODIES; ++i)
-            trail_push(&trails[i], (int)bodies[i].x, (int)bodies[i].y);
+        for (int i = 0; i < trail_count; ++i)
+            trail_push(&trails[i], (int)(sys.x[i] + ox), (int)(sys.y[i] + oy));
 
         SDL_FillRect(surf, NULL, COL_BLACK);
 
-        trail_draw(surf, &trails[0], COL_YELLOW);
-        trail_draw(surf, &trails[1], COL_LIGHTBLUE);
-        trail_draw(surf, &trails[2], COL_WHITE);
+        for (int i = 0; i < trail_count; ++i)
+            trail_draw(surf, &trails[i], colours[i]);
 
-        fill_circle(surf, (int)bodies[0].x, (int)bodies[0].y, (int)bodies[0].r, COL_YELLOW);
-        fill_circle(surf, (int)bodies[1].x, (int)bodies[1].y, (int)bodies[1].r, COL_LIGHTBLUE);
-        fill_circle(surf, (int)bodies[2].x, (int)bodies[2].y, (int)bodies[2].r, COL_WHITE);
+        for (int i = sys.count - 1; i >= 0; --i)
+            fill_circle(surf, (int)(sys.x[i] + ox), (int)(sys.y[i] + oy), body_radius(sys.count, i),
+                        i < trail_count ? colours[i] : COL_GREY);
 
         SDL_UpdateWindowSurface(win);
         SDL_Delay(16);
     }
 
+    if (replay)
+        fclose(replay);
+    nbody_free(&sys);
     SDL_DestroyWindow(win);
     SDL_Quit();
     return 0;
@@ -3,7 +3,7 @@
 SRC="3_body.c"
 OUT="3_body"
 
-CFLAGS="-Wall -O2"
+CFLAGS="-Wall -O2 -march=native -fno-math-errno"
 LDFLAGS="`sdl2-config --cflags --libs` -lm"
 
 echo "Compiling $SRC..."
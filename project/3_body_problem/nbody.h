@@ -0,0 +1,737 @@
+// Planar N-body core shared by 3_body.c and ../orbiting_planets/orbiting_planets.c: integrators,
+// diagnostics, checkpoint files and the headless fast-forward loop. Bodies are stored one array
+// per field; include from exactly one translation unit per program.
+#ifndef NBODY_H
+#define NBODY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+
+// Target bodies handled together by the direct-sum kernel, from the widest vector unit enabled
+#ifndef NBODY_LANES
+#if defined(__AVX512F__)
+#define NBODY_LANES 8
+#elif defined(__AVX__)
+#define NBODY_LANES 4
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define NBODY_LANES 2
+#else
+#define NBODY_LANES 1
+#endif
+#endif
+
+#define NBODY_DIRECT_MAX   512   // the automatic solver choice sums directly up to this many bodies
+#define NBODY_THETA        0.5   // Barnes-Hut opening angle
+#define QUADTREE_MAX_DEPTH 40
+
+typedef double nbody_vec __attribute__((vector_size(NBODY_LANES * sizeof(double))));
+typedef long long nbody_mask __attribute__((vector_size(NBODY_LANES * sizeof(long long))));
+
+typedef enum {
+    INTEGRATOR_LEAPFROG,
+    INTEGRATOR_YOSHIDA4,
+    INTEGRATOR_RK4
+} Integrator;
+
+typedef enum {
+    SOLVER_AUTO,
+    SOLVER_DIRECT,
+    SOLVER_BARNES_HUT
+} Solver;
+
+typedef struct {
+    double cx, cy, half;   // square cell
+    double mass, mx, my;   // total mass and centre of mass
+    int child[4];          // -1 when absent
+    int body;              // resident body of a leaf, -1 otherwise
+    int merged;            // leaf holding bodies closer than QUADTREE_MAX_DEPTH splits can separate
+} QuadNode;
+
+typedef struct {
+    QuadNode *nodes;
+    int count;
+    int capacity;
+    int *order;  // bodies in depth-first leaf order, so consecutive walks touch the same nodes;
+                 // bodies in merged leaves fill the tail
+    int merged;
+} QuadTree;
+
+typedef struct {
+    int count;
+    int capacity;  // padded to whole NBODY_LANES vectors; padding bodies have zero mass
+
+    double *x, *y, *vx, *vy, *mass;
+    double *ax, *ay, *pot;  // acceleration and potential per unit mass at x, y
+    int forces_valid;       // ax, ay, pot belong to the current positions
+
+    // RK4 stage scratch
+    double *tx, *ty, *kx, *ky, *kvx, *kvy, *sx, *sy, *svx, *svy, *tpot;
+
+    double gravity;  // gravitational constant
+    double softening2;  // Plummer softening squared, must be > 0
+    Solver solver;
+    double theta;
+    QuadTree tree;
+    long long force_evaluations;
+} NBodySystem;
+
+static const char *integrator_names[] = { "leapfrog", "yoshida4", "rk4" };
+static const char *solver_names[] = { "auto", "direct", "barnes-hut" };
+
+static double *nbody_array(int n)
+{
+    double *p = aligned_alloc(64, ((n * sizeof(double) + 63) / 64) * 64);
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %d bodies\n", n);
+        exit(EXIT_FAILURE);
+    }
+    memset(p, 0, n * sizeof(double));
+    return p;
+}
+
+void nbody_init(NBodySystem *s, int capacity, double gravity, double softening2)
+{
+    memset(s, 0, sizeof(*s));
+    s->capacity = (capacity + NBODY_LANES - 1) / NBODY_LANES * NBODY_LANES;
+    double **fields[] = { &s->x, &s->y, &s->vx, &s->vy, &s->mass, &s->ax, &s->ay, &s->pot,
+                          &s->tx, &s->ty, &s->kx, &s->ky, &s->kvx, &s->kvy,
+                          &s->sx, &s->sy, &s->svx, &s->svy, &s->tpot };
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f)
+        *fields[f] = nbody_array(s->capacity);
+    s->gravity = gravity;
+    s->softening2 = softening2;
+    s->theta = NBODY_THETA;
+}
+
+void nbody_free(NBodySystem *s)
+{
+    double *fields[] = { s->x, s->y, s->vx, s->vy, s->mass, s->ax, s->ay, s->pot,
+                         s->tx, s->ty, s->kx, s->ky, s->kvx, s->kvy,
+                         s->sx, s->sy, s->svx, s->svy, s->tpot };
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f)
+        free(fields[f]);
+    free(s->tree.nodes);
+    free(s->tree.order);
+    memset(s, 0, sizeof(*s));
+}
+
+int nbody_add(NBodySystem *s, double x, double y, double vx, double vy, double mass)
+{
+    if (s->count == s->capacity) {
+        fprintf(stderr, "N-body system is full (%d bodies)\n", s->capacity);
+        return -1;
+    }
+    int i = s->count++;
+    s->x[i] = x;
+    s->y[i] = y;
+    s->vx[i] = vx;
+    s->vy[i] = vy;
+    s->mass[i] = mass;
+    s->forces_valid = 0;
+    return i;
+}
+
+Solver nbody_effective_solver(const NBodySystem *s)
+{
+    if (s->solver != SOLVER_AUTO)
+        return s->solver;
+    return s->count <= NBODY_DIRECT_MAX ? SOLVER_DIRECT : SOLVER_BARNES_HUT;
+}
+
+/*
+ * Direct summation: NBODY_LANES targets at a time against every source. The self term has
+ * dx = dy = 0, so it adds no force, and a lane mask drops its -m/eps from the potential.
+ */
+static void nbody_direct(const NBodySystem *s, const double *x, const double *y,
+                         double *ax, double *ay, double *pot)
+{
+    const double eps2 = s->softening2;
+    for (int i = 0; i < s->count; i += NBODY_LANES) {
+        nbody_vec xi, yi;
+        memcpy(&xi, &x[i], sizeof(xi));
+        memcpy(&yi, &y[i], sizeof(yi));
+        nbody_vec sax = {0}, say = {0}, spot = {0};
+
+        for (int j = 0; j < s->count; ++j) {
+            nbody_vec dx = x[j] - xi;
+            nbody_vec dy = y[j] - yi;
+            nbody_vec d2 = dx*dx + dy*dy;
+            nbody_vec r2 = d2 + eps2;
+            nbody_vec inv;
+            for (int l = 0; l < NBODY_LANES; ++l)
+                inv[l] = 1.0 / sqrt(r2[l]);
+            nbody_vec m_inv = (nbody_vec)((nbody_mask)(s->mass[j] * inv) & (d2 > 0.0));
+            nbody_vec f = m_inv * inv * inv;
+            sax += f * dx;
+            say += f * dy;
+            spot -= m_inv;
+        }
+
+        for (int l = 0; l < NBODY_LANES; ++l) {
+            ax[i + l]  = s->gravity * sax[l];
+            ay[i + l]  = s->gravity * say[l];
+            pot[i + l] = s->gravity * spot[l];
+        }
+    }
+}
+
+static int quadtree_new_node(QuadTree *t, double cx, double cy, double half)
+{
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 1024;
+        t->nodes = realloc(t->nodes, t->capacity * sizeof(QuadNode));
+        if (!t->nodes) {
+            fprintf(stderr, "Unable to allocate %d quadtree nodes\n", t->capacity);
+            exit(EXIT_FAILURE);
+        }
+    }
+    QuadNode *n = &t->nodes[t->count];
+    memset(n, 0, sizeof(*n));
+    n->cx = cx;
+    n->cy = cy;
+    n->half = half;
+    n->child[0] = n->child[1] = n->child[2] = n->child[3] = -1;
+    n->body = -1;
+    return t->count++;
+}
+
+static int quadtree_child(QuadTree *t, int node, double x, double y)
+{
+    QuadNode *n = &t->nodes[node];
+    int q = (x >= n->cx) | ((y >= n->cy) << 1);
+    if (n->child[q] < 0) {
+        double h = n->half * 0.5;
+        int c = quadtree_new_node(t, n->cx + ((q & 1) ? h : -h), n->cy + ((q & 2) ? h : -h), h);
+        t->nodes[node].child[q] = c;  // the pool may have moved
+    }
+    return t->nodes[node].child[q];
+}
+
+// Rebuilds the tree over x, y; every node ends with its total mass and centre of mass
+static void quadtree_build(QuadTree *t, const NBodySystem *s, const double *x, const double *y)
+{
+    double lox = INFINITY, loy = INFINITY, hix = -INFINITY, hiy = -INFINITY;
+    for (int i = 0; i < s->count; ++i) {
+        lox = fmin(lox, x[i]);
+        hix = fmax(hix, x[i]);
+        loy = fmin(loy, y[i]);
+        hiy = fmax(hiy, y[i]);
+    }
+    if (!t->order)
+        t->order = malloc(s->capacity * sizeof(int));
+    if (!t->order) {
+        fprintf(stderr, "Unable to allocate the quadtree body order\n");
+        exit(EXIT_FAILURE);
+    }
+    t->count = 0;
+    t->merged = 0;
+    quadtree_new_node(t, 0.5 * (lox + hix), 0.5 * (loy + hiy),
+                      0.5 * fmax(hix - lox, hiy - loy) * 1.0001 + 1e-9);
+
+    for (int i = 0; i < s->count; ++i) {
+        double m = s->mass[i];
+        int node = 0;
+        for (int depth = 0;; ++depth) {
+            QuadNode *n = &t->nodes[node];
+            int empty = n->mass == 0.0 && n->body < 0 && !n->merged && n->child[0] < 0 &&
+                        n->child[1] < 0 && n->child[2] < 0 && n->child[3] < 0;
+            int leaf = n->body >= 0 || n->merged;
+            // mass-weighted sums; divided out once every body is in
+            n->mass += m;
+            n->mx += m * x[i];
+            n->my += m * y[i];
+            if (empty) {
+                n->body = i;
+                break;
+            }
+            if (n->merged) {
+                t->order[s->count - ++t->merged] = i;
+                break;
+            }
+            if (leaf) {
+                if (depth >= QUADTREE_MAX_DEPTH) {
+                    t->order[s->count - ++t->merged] = n->body;
+                    t->order[s->count - ++t->merged] = i;
+                    n->body = -1;
+                    n->merged = 1;
+                    break;
+                }
+                // push the resident one level down, then keep descending with this body
+                int r = n->body;
+                n->body = -1;
+                int child = quadtree_child(t, node, x[r], y[r]);
+                QuadNode *c = &t->nodes[child];
+                c->body = r;
+                c->mass = s->mass[r];
+                c->mx = s->mass[r] * x[r];
+                c->my = s->mass[r] * y[r];
+            }
+            node = quadtree_child(t, node, x[i], y[i]);
+        }
+    }
+
+    for (int k = 0; k < t->count; ++k) {
+        QuadNode *n = &t->nodes[k];
+        if (n->mass > 0.0) {
+            n->mx /= n->mass;
+            n->my /= n->mass;
+        }
+    }
+
+    int stack[3 * QUADTREE_MAX_DEPTH + 4];
+    int top = 0, ordered = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const QuadNode *n = &t->nodes[stack[--top]];
+        if (n->body >= 0)
+            t->order[ordered++] = n->body;
+        for (int c = 3; c >= 0; --c)
+            if (n->child[c] >= 0)
+                stack[top++] = n->child[c];
+    }
+}
+
+/*
+ * Barnes-Hut: a cell narrower than theta times its distance acts as one point mass at its
+ * centre of mass, otherwise its children are visited. O(N log N). A merged leaf still counts
+ * the body's own mass, which adds no force (dx = 0) but a -m/eps term to its potential.
+ */
+static void nbody_barnes_hut(NBodySystem *s, const double *x, const double *y,
+                             double *ax, double *ay, double *pot)
+{
+    QuadTree *t = &s->tree;
+    quadtree_build(t, s, x, y);
+
+    const double eps2 = s->softening2;
+    const double theta2 = s->theta * s->theta;
+    int stack[3 * QUADTREE_MAX_DEPTH + 4];
+    for (int k = 0; k < s->count; ++k) {
+        int i = t->order[k];
+        double sax = 0.0, say = 0.0, spot = 0.0;
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const QuadNode *n = &t->nodes[stack[--top]];
+            if (n->body == i || n->mass == 0.0)
+                continue;
+
+            double dx = n->mx - x[i];
+            double dy = n->my - y[i];
+            double d2 = dx*dx + dy*dy;
+            double width = 2.0 * n->half;
+            if (n->body >= 0 || n->merged || width * width < theta2 * d2) {
+                double inv = 1.0 / sqrt(d2 + eps2);
+                double m_inv = n->mass * inv;
+                double f = m_inv * inv * inv;
+                sax += f * dx;
+                say += f * dy;
+                spot -= m_inv;
+                continue;
+            }
+            for (int c = 0; c < 4; ++c)
+                if (n->child[c] >= 0)
+                    stack[top++] = n->child[c];
+        }
+        ax[i]  = s->gravity * sax;
+        ay[i]  = s->gravity * say;
+        pot[i] = s->gravity * spot;
+    }
+}
+
+// Acceleration and potential of every body as if they stood at x, y
+void nbody_forces(NBodySystem *s, const double *x, const double *y,
+                  double *ax, double *ay, double *pot)
+{
+    if (nbody_effective_solver(s) == SOLVER_DIRECT)
+        nbody_direct(s, x, y, ax, ay, pot);
+    else
+        nbody_barnes_hut(s, x, y, ax, ay, pot);
+    s->force_evaluations++;
+}
+
+static void nbody_update_forces(NBodySystem *s)
+{
+    if (!s->forces_valid) {
+        nbody_forces(s, s->x, s->y, s->ax, s->ay, s->pot);
+        s->forces_valid = 1;
+    }
+}
+
+// Kick-drift-kick; the closing force evaluation is reused by the next step
+static void nbody_leapfrog(NBodySystem *s, double dt)
+{
+    nbody_update_forces(s);
+    for (int i = 0; i < s->count; ++i) {
+        s->vx[i] += 0.5 * s->ax[i] * dt;
+        s->vy[i] += 0.5 * s->ay[i] * dt;
+        s->x[i]  += s->vx[i] * dt;
+        s->y[i]  += s->vy[i] * dt;
+    }
+    nbody_forces(s, s->x, s->y, s->ax, s->ay, s->pot);
+    for (int i = 0; i < s->count; ++i) {
+        s->vx[i] += 0.5 * s->ax[i] * dt;
+        s->vy[i] += 0.5 * s->ay[i] * dt;
+    }
+}
+
+// Yoshida's fourth-order composition of three leapfrog steps (Phys. Lett. A 150, 1990)
+static void nbody_yoshida4(NBodySystem *s, double dt)
+{
+    const double cbrt2 = cbrt(2.0);
+    const double w1 = 1.0 / (2.0 - cbrt2);
+    const double w0 = -cbrt2 / (2.0 - cbrt2);
+    nbody_leapfrog(s, w1 * dt);
+    nbody_leapfrog(s, w0 * dt);
+    nbody_leapfrog(s, w1 * dt);
+}
+
+// Classical RK4 on (x, v). Not symplectic: energy error grows secularly, but it is O(dt^4)
+static void nbody_rk4(NBodySystem *s, double dt)
+{
+    static const double c[4] = { 0.0, 0.5, 0.5, 1.0 };
+    static const double w[4] = { 1.0, 2.0, 2.0, 1.0 };
+    nbody_update_forces(s);
+    for (int i = 0; i < s->count; ++i) {
+        s->kx[i] = s->vx[i];
+        s->ky[i] = s->vy[i];
+        s->kvx[i] = s->ax[i];
+        s->kvy[i] = s->ay[i];
+        s->sx[i] = s->kx[i];
+        s->sy[i] = s->ky[i];
+        s->svx[i] = s->kvx[i];
+        s->svy[i] = s->kvy[i];
+    }
+    for (int k = 1; k < 4; ++k) {
+        double h = c[k] * dt;
+        for (int i = 0; i < s->count; ++i) {
+            s->tx[i] = s->x[i] + h * s->kx[i];
+            s->ty[i] = s->y[i] + h * s->ky[i];
+            s->kx[i] = s->vx[i] + h * s->kvx[i];
+            s->ky[i] = s->vy[i] + h * s->kvy[i];
+        }
+        nbody_forces(s, s->tx, s->ty, s->kvx, s->kvy, s->tpot);
+        for (int i = 0; i < s->count; ++i) {
+            s->sx[i]  += w[k] * s->kx[i];
+            s->sy[i]  += w[k] * s->ky[i];
+            s->svx[i] += w[k] * s->kvx[i];
+            s->svy[i] += w[k] * s->kvy[i];
+        }
+    }
+    for (int i = 0; i < s->count; ++i) {
+        s->x[i]  += dt / 6.0 * s->sx[i];
+        s->y[i]  += dt / 6.0 * s->sy[i];
+        s->vx[i] += dt / 6.0 * s->svx[i];
+        s->vy[i] += dt / 6.0 * s->svy[i];
+    }
+    s->forces_valid = 0;
+}
+
+void nbody_step(NBodySystem *s, Integrator integrator, double dt)
+{
+    switch (integrator) {
+    case INTEGRATOR_YOSHIDA4:
+        nbody_yoshida4(s, dt);
+        break;
+    case INTEGRATOR_RK4:
+        nbody_rk4(s, dt);
+        break;
+    default:
+        nbody_leapfrog(s, dt);
+        break;
+    }
+}
+
+// Kinetic plus softened potential energy; Barnes-Hut systems get the tree's approximate potential
+double nbody_energy(NBodySystem *s)
+{
+    nbody_update_forces(s);
+    double e = 0.0;
+    for (int i = 0; i < s->count; ++i)
+        e += s->mass[i] * (0.5 * (s->vx[i]*s->vx[i] + s->vy[i]*s->vy[i]) + 0.5 * s->pot[i]);
+    return e;
+}
+
+void nbody_centre_of_mass(const NBodySystem *s, double *cx, double *cy)
+{
+    double x = 0.0, y = 0.0, m = 0.0;
+    for (int i = 0; i < s->count; ++i) {
+        x += s->mass[i] * s->x[i];
+        y += s->mass[i] * s->y[i];
+        m += s->mass[i];
+    }
+    *cx = m > 0.0 ? x / m : 0.0;
+    *cy = m > 0.0 ? y / m : 0.0;
+}
+
+int nbody_parse_integrator(const char *name, Integrator *out)
+{
+    for (int k = 0; k < 3; ++k) {
+        if (strcmp(name, integrator_names[k]) == 0) {
+            *out = (Integrator)k;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int nbody_parse_solver(const char *name, Solver *out)
+{
+    for (int k = 0; k < 3; ++k) {
+        if (strcmp(name, solver_names[k]) == 0) {
+            *out = (Solver)k;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ---- Diagnostics ---- */
+
+typedef struct {
+    double energy;
+    double angular_momentum;  // about the origin, z component
+    double cx, cy;            // centre of mass
+    double px, py;            // total momentum
+    double mass;
+} NBodyDiagnostics;
+
+void nbody_diagnostics(NBodySystem *s, NBodyDiagnostics *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->energy = nbody_energy(s);
+    for (int i = 0; i < s->count; ++i) {
+        double m = s->mass[i];
+        d->angular_momentum += m * (s->x[i] * s->vy[i] - s->y[i] * s->vx[i]);
+        d->cx += m * s->x[i];
+        d->cy += m * s->y[i];
+        d->px += m * s->vx[i];
+        d->py += m * s->vy[i];
+        d->mass += m;
+    }
+    d->cx /= d->mass;
+    d->cy /= d->mass;
+}
+
+/* ---- Checkpoints ----
+ * Header: magic, body count, dt, G, softening², then every mass (double). Each record is the
+ * step number, the simulated time and x, y, vx, vy of every body as floats. Records are appended
+ * as the run goes and read back until end of file. Native byte order. */
+
+#define CHECKPOINT_MAGIC "NBODYCK1"
+
+typedef struct {
+    char magic[8];
+    int32_t count;
+    int32_t reserved;
+    double dt;
+    double gravity;
+    double softening2;
+} CheckpointHeader;
+
+FILE *nbody_checkpoint_create(const char *path, const NBodySystem *s, double dt)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot create checkpoint file %s\n", path);
+        return NULL;
+    }
+    CheckpointHeader h = { CHECKPOINT_MAGIC, s->count, 0, dt, s->gravity, s->softening2 };
+    if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(s->mass, sizeof(double), s->count, f) != (size_t)s->count) {
+        fprintf(stderr, "Cannot write checkpoint file %s\n", path);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int nbody_checkpoint_write(FILE *f, const NBodySystem *s, long long step, double time)
+{
+    static float buffer[4096];
+    int64_t n = step;
+    int ok = fwrite(&n, sizeof(n), 1, f) == 1 && fwrite(&time, sizeof(time), 1, f) == 1;
+    const double *fields[4] = { s->x, s->y, s->vx, s->vy };
+    for (int k = 0; k < 4 && ok; ++k) {
+        for (int i = 0; i < s->count && ok; i += 4096) {
+            int m = s->count - i < 4096 ? s->count - i : 4096;
+            for (int j = 0; j < m; ++j)
+                buffer[j] = (float)fields[k][i + j];
+            ok = fwrite(buffer, sizeof(float), m, f) == (size_t)m;
+        }
+    }
+    return ok;
+}
+
+// Opens a checkpoint file and sets up s (uninitialised on entry) from its header and masses
+FILE *nbody_checkpoint_open(const char *path, NBodySystem *s, double *dt)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open checkpoint file %s\n", path);
+        return NULL;
+    }
+    CheckpointHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.count <= 0) {
+        fprintf(stderr, "%s is not a checkpoint file\n", path);
+        fclose(f);
+        return NULL;
+    }
+    nbody_init(s, h.count, h.gravity, h.softening2);
+    s->count = h.count;
+    if (fread(s->mass, sizeof(double), s->count, f) != (size_t)s->count) {
+        fprintf(stderr, "%s is truncated\n", path);
+        nbody_free(s);
+        fclose(f);
+        return NULL;
+    }
+    *dt = h.dt;
+    return f;
+}
+
+// Reads the next record into s; returns 0 at end of file
+int nbody_checkpoint_read(FILE *f, NBodySystem *s, long long *step, double *time)
+{
+    static float buffer[4096];
+    int64_t n;
+    if (fread(&n, sizeof(n), 1, f) != 1 || fread(time, sizeof(*time), 1, f) != 1)
+        return 0;
+    *step = n;
+    double *fields[4] = { s->x, s->y, s->vx, s->vy };
+    for (int k = 0; k < 4; ++k) {
+        for (int i = 0; i < s->count; i += 4096) {
+            int m = s->count - i < 4096 ? s->count - i : 4096;
+            if (fread(buffer, sizeof(float), m, f) != (size_t)m)
+                return 0;
+            for (int j = 0; j < m; ++j)
+                fields[k][i + j] = buffer[j];
+        }
+    }
+    s->forces_valid = 0;
+    return 1;
+}
+
+/* ---- Headless fast-forward ---- */
+
+typedef struct {
+    int headless;
+    long long steps;
+    long long log_every;
+    const char *checkpoint;
+    long long checkpoint_every;
+    const char *replay;
+} RunOptions;
+
+#define RUN_OPTIONS_USAGE "       [--headless] [--steps N] [--log-every N] [--checkpoint FILE] [--checkpoint-every N]\n" \
+                          "       [--replay FILE]\n"
+
+void run_options_default(RunOptions *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->steps = 1000000;
+}
+
+// Consumes argv[*a] (and its value) when it is one of the run options
+int run_options_parse(RunOptions *o, int argc, char *argv[], int *a)
+{
+    int more = *a + 1 < argc;
+    const char *arg = argv[*a];
+    if (strcmp(arg, "--headless") == 0) {
+        o->headless = 1;
+    } else if (strcmp(arg, "--steps") == 0 && more) {
+        o->steps = atoll(argv[++*a]);
+    } else if (strcmp(arg, "--log-every") == 0 && more) {
+        o->log_every = atoll(argv[++*a]);
+    } else if (strcmp(arg, "--checkpoint") == 0 && more) {
+        o->checkpoint = argv[++*a];
+    } else if (strcmp(arg, "--checkpoint-every") == 0 && more) {
+        o->checkpoint_every = atoll(argv[++*a]);
+    } else if (strcmp(arg, "--replay") == 0 && more) {
+        o->replay = argv[++*a];
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static double run_clock(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void run_log(NBodySystem *s, const NBodyDiagnostics *d0, long long step, double time, double rate,
+                    double *worst)
+{
+    NBodyDiagnostics d;
+    nbody_diagnostics(s, &d);
+    // The centre of mass should move uniformly with the initial total momentum
+    double ex = d0->cx + d0->px / d0->mass * time;
+    double ey = d0->cy + d0->py / d0->mass * time;
+    double de = (d.energy - d0->energy) / fabs(d0->energy);
+    if (fabs(de) > *worst)
+        *worst = fabs(de);
+    printf("%12lld %12.4f %16.9e %11.3e %16.9e %11.3e %11.3e %11.0f\n", step, time, d.energy, de,
+           d.angular_momentum, d.angular_momentum - d0->angular_momentum, hypot(d.cx - ex, d.cy - ey), rate);
+    fflush(stdout);
+}
+
+/*
+ * Steps as fast as the CPU allows. Every log_every steps prints energy and its drift relative to the
+ * start, angular momentum and its change, and how far the centre of mass is from where the initial
+ * momentum carries it. Every checkpoint_every steps (and at the end) appends a checkpoint record.
+ */
+int nbody_run_headless(NBodySystem *s, Integrator integrator, double dt, const RunOptions *o)
+{
+    long long log_every = o->log_every > 0 ? o->log_every : (o->steps >= 100 ? o->steps / 100 : 1);
+    long long checkpoint_every = o->checkpoint_every > 0 ? o->checkpoint_every : log_every;
+
+    FILE *ck = NULL;
+    if (o->checkpoint) {
+        ck = nbody_checkpoint_create(o->checkpoint, s, dt);
+        if (!ck || !nbody_checkpoint_write(ck, s, 0, 0.0))
+            return 1;
+    }
+
+    NBodyDiagnostics d0;
+    nbody_diagnostics(s, &d0);
+    printf("# %d bodies, %s integrator, %s solver, dt %g, %lld steps\n", s->count, integrator_names[integrator],
+           solver_names[nbody_effective_solver(s)], dt, o->steps);
+    printf("# %10s %12s %16s %11s %16s %11s %11s %11s\n", "step", "time", "energy", "dE/|E0|",
+           "ang. mom.", "dL", "com drift", "steps/s");
+    double worst = 0.0;
+    run_log(s, &d0, 0, 0.0, 0.0, &worst);
+
+    double start = run_clock(), last = start;
+    long long last_step = 0;
+    for (long long step = 1; step <= o->steps; ++step) {
+        nbody_step(s, integrator, dt);
+        double time = step * dt;
+        if (ck && (step % checkpoint_every == 0 || step == o->steps) && !nbody_checkpoint_write(ck, s, step, time)) {
+            fprintf(stderr, "Cannot write checkpoint %s\n", o->checkpoint);
+            fclose(ck);
+            return 1;
+        }
+        if (step % log_every == 0 || step == o->steps) {
+            double now = run_clock();
+            run_log(s, &d0, step, time, (step - last_step) / (now - last), &worst);
+            last = now;
+            last_step = step;
+        }
+    }
+    double elapsed = run_clock() - start;
+    printf("# %lld steps in %.2f s (%.0f steps/s), largest logged |dE/E0| %.3e\n", o->steps, elapsed,
+           o->steps / elapsed, worst);
+    if (ck && fclose(ck) != 0) {
+        fprintf(stderr, "Cannot write checkpoint %s\n", o->checkpoint);
+        return 1;
+    }
+    return 0;
+}
+
+
+#endif
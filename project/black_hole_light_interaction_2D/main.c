@@ -3,7 +3,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -11,12 +14,27 @@
 #define WINDOW_WIDTH 1200
 #define WINDOW_HEIGHT 900
 
+#define SKY_TILE_SIZE 512            // texels per side of one upload
+#define SKY_TILE_UPLOADS_PER_FRAME 4 // tiles sent to the GPU per frame while the sky streams in
+#define SKY_MAX_LEVELS 16
+#define SKY_CACHE_MAGIC "SKYMIPS1"
+
+#define BACKGROUND_STAR_COUNT 200
+#define BACKGROUND_STAR_SEED 0x9E3779B9u
+
+#define DEFLECTION_TABLE_SIZE 1024       // texels per side of the deflection texture
+#define DEFLECTION_TABLE_EXTENT 2.0      // half-width it covers, in screen heights
+#define DEFLECTION_SOURCE_DISTANCE 0.5   // distance of the background plane behind the hole, in screen heights
+#define DEFLECTION_CURVE_SAMPLES 2048    // impact parameters integrated per rebuild
+#define DEFLECTION_START_DISTANCE 1000.0 // where rays start and end, in Schwarzschild radii
+#define DEFLECTION_STEP_FRACTION 0.005   // RK4 step as a fraction of r
+#define DEFLECTION_MAX_STEPS 200000
+
 int fbWidth = WINDOW_WIDTH;
 int fbHeight = WINDOW_HEIGHT;
 
 int currentTexture = 0;
 unsigned int bgTexture;
-unsigned int milkyWayTexture;
 
 const char *vertexShaderSource = "#version 330 core\n"
                                  "layout (location = 0) in vec2 aPos;\n"
@@ -53,105 +71,507 @@ const char *distortionFragmentShaderSource = "#version 330 core\n"
                                              "out vec4 FragColor;\n"
                                              "uniform vec2 blackHolePos;\n"
                                              "uniform float schwarzschildRadius;\n"
+                                             "uniform float aspect;\n"
+                                             "uniform float tableExtent;\n"
+                                             "uniform float sourceDistance;\n"
                                              "uniform sampler2D sceneTexture;\n"
+                                             "uniform sampler2D deflectionTexture;\n"
                                              "void main() {\n"
-                                             "   vec2 pos = TexCoord - blackHolePos;\n"
-                                             "   float r = length(pos);\n"
-                                             "   float rs = schwarzschildRadius;\n"
-                                             "   if (r < rs) {\n"
-                                             "       FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
-                                             "   } else if (r < rs * 1.5) {\n"
-                                             "       float intensity = 1.0 - (r - rs) / (0.5 * rs);\n"
-                                             "       FragColor = vec4(1.0, 0.8, 0.4, 1.0) * intensity;\n"
+                                             "   vec2 scale = vec2(aspect, 1.0);\n"
+                                             "   vec2 pos = (TexCoord - blackHolePos) * scale;\n"
+                                             "   vec2 source;\n"
+                                             "   float captured = 0.0;\n"
+                                             "   if (max(abs(pos.x), abs(pos.y)) < tableExtent) {\n"
+                                             "       vec3 entry = texture(deflectionTexture, pos / (2.0 * tableExtent) + 0.5).rgb;\n"
+                                             "       source = entry.rg;\n"
+                                             "       captured = entry.b;\n"
                                              "   } else {\n"
-                                             "       float deflection = rs / (r * r);\n"
-                                             "       vec2 distortedCoord = TexCoord - deflection * pos;\n"
-                                             "       distortedCoord = clamp(distortedCoord, 0.0, 1.0);\n"
-                                             "       FragColor = texture(sceneTexture, distortedCoord);\n"
+                                             "       float r = length(pos);\n"
+                                             "       source = pos * (1.0 - sourceDistance * 2.0 * schwarzschildRadius / (r * r));\n"
                                              "   }\n"
+                                             "   vec2 distortedCoord = clamp(blackHolePos + source / scale, 0.0, 1.0);\n"
+                                             "   FragColor = mix(texture(sceneTexture, distortedCoord), vec4(0.0, 0.0, 0.0, 1.0), captured);\n"
                                              "}\n";
 
 
-unsigned int loadMilkyWayTexture(const char *filename)
+/*
+ * Background sky loader. A worker thread decodes the image (or reads the mip cache written by an
+ * earlier launch) and publishes the mip levels coarsest first. The main thread uploads
+ * SKY_TILE_UPLOADS_PER_FRAME tiles per frame and moves GL_TEXTURE_BASE_LEVEL down as each level
+ * completes, so the sky appears blurred on the first frames and sharpens as the finer levels arrive.
+ */
+typedef struct
+{
+    char path[512];
+    char cachePath[512];
+    int maxSize; // GL_MAX_TEXTURE_SIZE, finer levels are dropped
+    pthread_t thread;
+
+    // Written by the worker before headerReady / levelReady are set
+    int width, height; // level 0 as uploaded
+    int levelCount;
+    unsigned char *levels[SKY_MAX_LEVELS]; // tightly packed RGB
+    atomic_int headerReady;
+    atomic_int levelReady[SKY_MAX_LEVELS];
+    atomic_int workerDone;
+    atomic_int failed;
+
+    // Main thread only
+    unsigned int texture;
+    int uploadLevel;
+    int uploadTile;
+    int displayLevel; // finest complete level, -1 until the first one is uploaded
+    int joined;
+} SkyLoader;
+
+SkyLoader milkyWay;
+
+int skyLevelWidth(const SkyLoader *sky, int level)
+{
+    return sky->width >> level > 0 ? sky->width >> level : 1;
+}
+
+int skyLevelHeight(const SkyLoader *sky, int level)
+{
+    return sky->height >> level > 0 ? sky->height >> level : 1;
+}
+
+// 2x2 box filter, clamping at odd edges
+unsigned char *downsampleRGB(const unsigned char *src, int width, int height, int *outWidth, int *outHeight)
+{
+    int w = width > 1 ? width / 2 : 1;
+    int h = height > 1 ? height / 2 : 1;
+    unsigned char *dst = malloc((size_t)w * h * 3);
+    if (!dst)
+        return NULL;
+    for (int y = 0; y < h; y++)
+    {
+        int y0 = 2 * y < height ? 2 * y : height - 1;
+        int y1 = 2 * y + 1 < height ? 2 * y + 1 : height - 1;
+        for (int x = 0; x < w; x++)
+        {
+            int x0 = 2 * x < width ? 2 * x : width - 1;
+            int x1 = 2 * x + 1 < width ? 2 * x + 1 : width - 1;
+            for (int c = 0; c < 3; c++)
+            {
+                int sum = src[((size_t)y0 * width + x0) * 3 + c] + src[((size_t)y0 * width + x1) * 3 + c] +
+                          src[((size_t)y1 * width + x0) * 3 + c] + src[((size_t)y1 * width + x1) * 3 + c];
+                dst[((size_t)y * w + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+    *outWidth = w;
+    *outHeight = h;
+    return dst;
+}
+
+/*
+ * Cache layout: magic, source size and mtime, width, height, level count, then the levels from the
+ * coarsest to level 0 so they can be published while the rest is still being read.
+ */
+typedef struct
+{
+    char magic[8];
+    long long sourceSize;
+    long long sourceTime;
+    int width, height, levelCount;
+} SkyCacheHeader;
+
+int skyCacheHeaderFor(const SkyLoader *sky, SkyCacheHeader *header)
+{
+    struct stat st;
+    if (stat(sky->path, &st) != 0)
+        return 0;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SKY_CACHE_MAGIC, sizeof(header->magic));
+    header->sourceSize = (long long)st.st_size;
+    header->sourceTime = (long long)st.st_mtime;
+    return 1;
+}
+
+int skyReadCache(SkyLoader *sky)
+{
+    SkyCacheHeader expected, header;
+    if (!skyCacheHeaderFor(sky, &expected))
+        return 0;
+    FILE *file = fopen(sky->cachePath, "rb");
+    if (!file)
+        return 0;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.sourceSize != expected.sourceSize || header.sourceTime != expected.sourceTime ||
+        header.width <= 0 || header.height <= 0 || header.width > sky->maxSize || header.height > sky->maxSize ||
+        header.levelCount <= 0 || header.levelCount > SKY_MAX_LEVELS)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    sky->width = header.width;
+    sky->height = header.height;
+    sky->levelCount = header.levelCount;
+    atomic_store(&sky->headerReady, 1);
+    for (int level = sky->levelCount - 1; level >= 0; level--)
+    {
+        size_t size = (size_t)skyLevelWidth(sky, level) * skyLevelHeight(sky, level) * 3;
+        sky->levels[level] = malloc(size);
+        if (!sky->levels[level] || fread(sky->levels[level], 1, size, file) != size)
+        {
+            // The header was already published, so there is no falling back to the image now
+            printf("Sky cache %s is truncated, removing it\n", sky->cachePath);
+            fclose(file);
+            remove(sky->cachePath);
+            atomic_store(&sky->failed, 1);
+            return 1;
+        }
+        atomic_store(&sky->levelReady[level], 1);
+    }
+    fclose(file);
+    return 1;
+}
+
+void skyWriteCache(const SkyLoader *sky)
+{
+    SkyCacheHeader header;
+    if (!skyCacheHeaderFor(sky, &header))
+        return;
+    header.width = sky->width;
+    header.height = sky->height;
+    header.levelCount = sky->levelCount;
+
+    char tempPath[sizeof(sky->cachePath) + 4];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", sky->cachePath);
+    FILE *file = fopen(tempPath, "wb");
+    if (!file)
+        return;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int level = sky->levelCount - 1; level >= 0 && ok; level--)
+    {
+        size_t size = (size_t)skyLevelWidth(sky, level) * skyLevelHeight(sky, level) * 3;
+        ok = fwrite(sky->levels[level], 1, size, file) == size;
+    }
+    if (fclose(file) != 0 || !ok || rename(tempPath, sky->cachePath) != 0)
+        remove(tempPath);
+}
+
+int skyDecodeImage(SkyLoader *sky)
 {
     int width, height, channels;
-    unsigned char *data = stbi_load(filename, &width, &height, &channels, 0);
+    unsigned char *data = stbi_load(sky->path, &width, &height, &channels, 3);
     if (!data)
     {
-        printf("Faild to upload image: %s\n", filename);
+        printf("Faild to upload image: %s\n", sky->path);
         return 0;
     }
+    // Levels the GPU cannot hold are reduced here and never stored
+    while (width > sky->maxSize || height > sky->maxSize)
+    {
+        unsigned char *smaller = downsampleRGB(data, width, height, &width, &height);
+        free(data);
+        if (!smaller)
+            return 0;
+        data = smaller;
+    }
+
+    int levelCount = 1;
+    while ((width >> levelCount) > 0 || (height >> levelCount) > 0)
+        levelCount++;
+    sky->width = width;
+    sky->height = height;
+    sky->levelCount = levelCount < SKY_MAX_LEVELS ? levelCount : SKY_MAX_LEVELS;
+    sky->levels[0] = data;
+    for (int level = 1; level < sky->levelCount; level++)
+    {
+        int w, h;
+        sky->levels[level] = downsampleRGB(sky->levels[level - 1], skyLevelWidth(sky, level - 1), skyLevelHeight(sky, level - 1), &w, &h);
+        if (!sky->levels[level])
+            return 0;
+    }
+
+    atomic_store(&sky->headerReady, 1);
+    for (int level = sky->levelCount - 1; level >= 0; level--)
+        atomic_store(&sky->levelReady[level], 1);
+    return 1;
+}
+
+void *skyLoaderWorker(void *arg)
+{
+    SkyLoader *sky = (SkyLoader *)arg;
+    double start = glfwGetTime();
+    if (skyReadCache(sky))
+    {
+        if (!atomic_load(&sky->failed))
+            printf("Sky %dx%d read from %s in %.2f s\n", sky->width, sky->height, sky->cachePath, glfwGetTime() - start);
+    }
+    else if (skyDecodeImage(sky))
+    {
+        printf("Sky %dx%d decoded in %.2f s\n", sky->width, sky->height, glfwGetTime() - start);
+        skyWriteCache(sky);
+    }
+    else
+    {
+        atomic_store(&sky->failed, 1);
+    }
+    atomic_store(&sky->workerDone, 1);
+    return NULL;
+}
+
+void startSkyLoader(SkyLoader *sky, const char *filename)
+{
+    memset(sky, 0, sizeof(*sky));
+    snprintf(sky->path, sizeof(sky->path), "%s", filename);
+    snprintf(sky->cachePath, sizeof(sky->cachePath), "%s.mips", filename);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &sky->maxSize);
+    sky->displayLevel = -1;
+    if (pthread_create(&sky->thread, NULL, skyLoaderWorker, sky) != 0)
+    {
+        printf("Failed to start the sky loader thread\n");
+        sky->joined = 1;
+        atomic_store(&sky->failed, 1);
+    }
+}
+
+void finishSkyLoader(SkyLoader *sky)
+{
+    if (!sky->joined)
+    {
+        pthread_join(sky->thread, NULL);
+        sky->joined = 1;
+    }
+    for (int level = 0; level < SKY_MAX_LEVELS; level++)
+    {
+        free(sky->levels[level]);
+        sky->levels[level] = NULL;
+    }
+}
+
+// Uploads the next few tiles. Returns the texture to draw the sky with, 0 while nothing is ready.
+unsigned int updateSkyLoader(SkyLoader *sky)
+{
+    if (sky->joined || !atomic_load(&sky->headerReady))
+    {
+        if (!sky->joined && atomic_load(&sky->workerDone))
+            finishSkyLoader(sky);
+        return sky->displayLevel >= 0 ? sky->texture : 0;
+    }
+
+    if (!sky->texture)
+    {
+        glGenTextures(1, &sky->texture);
+        glBindTexture(GL_TEXTURE_2D, sky->texture);
+        for (int level = 0; level < sky->levelCount; level++)
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGB8, skyLevelWidth(sky, level), skyLevelHeight(sky, level), 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, sky->levelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, sky->levelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        sky->uploadLevel = sky->levelCount - 1;
+        sky->uploadTile = 0;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, sky->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int budget = SKY_TILE_UPLOADS_PER_FRAME; budget > 0 && sky->uploadLevel >= 0 && atomic_load(&sky->levelReady[sky->uploadLevel]); budget--)
+    {
+        int level = sky->uploadLevel;
+        int width = skyLevelWidth(sky, level);
+        int height = skyLevelHeight(sky, level);
+        int tilesX = (width + SKY_TILE_SIZE - 1) / SKY_TILE_SIZE;
+        int tilesY = (height + SKY_TILE_SIZE - 1) / SKY_TILE_SIZE;
+        int x = sky->uploadTile % tilesX * SKY_TILE_SIZE;
+        int y = sky->uploadTile / tilesX * SKY_TILE_SIZE;
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+        glTexSubImage2D(GL_TEXTURE_2D, level, x, y, width - x < SKY_TILE_SIZE ? width - x : SKY_TILE_SIZE,
+                        height - y < SKY_TILE_SIZE ? height - y : SKY_TILE_SIZE, GL_RGB, GL_UNSIGNED_BYTE, sky->levels[level]);
+
+        if (++sky->uploadTile == tilesX * tilesY)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            sky->displayLevel = level;
+            sky->uploadLevel--;
+            sky->uploadTile = 0;
+        }
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    if (atomic_load(&sky->workerDone) && (sky->uploadLevel < 0 || atomic_load(&sky->failed)))
+        finishSkyLoader(sky);
+    return sky->displayLevel >= 0 ? sky->texture : 0;
+}
+
+unsigned int createBackgroundTexture()
+{
+    int width = 512, height = 512;
+    unsigned char *data = (unsigned char *)calloc(width * height, 3);
+    // Fixed xorshift seed so the star field is the same on every launch
+    unsigned int state = BACKGROUND_STAR_SEED;
+    for (int i = 0; i < BACKGROUND_STAR_COUNT; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int x = state % width;
+        int y = (state >> 9) % height;
+        int big = (state >> 18) % 5 == 0;
+        memset(&data[(y * width + x) * 3], 255, 3);
+        if (big && x + 1 < width)
+            memset(&data[(y * width + x + 1) * 3], 255, 3);
+        if (big && y + 1 < height)
+            memset(&data[((y + 1) * width + x) * 3], 255, 3);
+    }
 
     unsigned int texture;
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
-
-    GLenum format = (channels == 3) ? GL_RGB : GL_RGBA;
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    stbi_image_free(data);
+    free(data);
     return texture;
 }
 
-unsigned int createBackgroundTexture()
+/*
+ * Christoffel terms of the equatorial Schwarzschild geodesic, the same equations that
+ * black_hole_ray_interaction_2D integrates (geometric units, derivatives by affine parameter)
+ */
+void geodesicAccelerations(const double *y, double rs, double *dy)
 {
-    int width = 512, height = 512;
-    unsigned char *data = (unsigned char *)malloc(width * height * 3);
-    for (int y = 0; y < height; y++)
+    // y = r, phi, dt, dr, dphi
+    double r = y[0];
+    double f = 1.0 - rs / r;
+    dy[0] = y[3];
+    dy[1] = y[4];
+    dy[2] = -2.0 * (rs / (2.0 * r * r * f)) * y[2] * y[3];
+    dy[3] = -(rs * f / (2.0 * r * r)) * y[2] * y[2] + (rs / (2.0 * r * r * f)) * y[3] * y[3] + (r - rs) * y[4] * y[4];
+    dy[4] = -2.0 / r * y[3] * y[4];
+}
+
+/*
+ * Total bending angle of a light ray with impact parameter b (in Schwarzschild radii, above the
+ * critical 3*sqrt(3)/2). The ray comes in from DEFLECTION_START_DISTANCE along +x and is followed
+ * with RK4 steps proportional to r until it is back out at that distance.
+ */
+double photonDeflection(double b)
+{
+    const double rs = 1.0;
+    double x0 = -DEFLECTION_START_DISTANCE, y0 = b;
+    double y[5];
+    y[0] = sqrt(x0 * x0 + y0 * y0);
+    y[1] = atan2(y0, x0);
+    double vr = cos(y[1]);
+    double vphi = -sin(y[1]) / y[0];
+    double f = 1.0 - rs / y[0];
+    y[2] = sqrt(vr * vr + f * y[0] * y[0] * vphi * vphi) / f; // null condition
+    y[3] = vr;
+    y[4] = vphi;
+
+    double heading = y[1] + atan2(y[0] * y[4], y[3]);
+    double k[4][5], z[5];
+    static const double stage[4] = {0.0, 0.5, 0.5, 1.0};
+    for (int step = 0; step < DEFLECTION_MAX_STEPS; step++)
     {
-        for (int x = 0; x < width; x++)
+        if (y[0] <= rs * 1.01)
+            return INFINITY;
+        if (y[0] > DEFLECTION_START_DISTANCE && y[3] > 0.0)
+            break;
+        double h = DEFLECTION_STEP_FRACTION * y[0];
+        for (int s = 0; s < 4; s++)
         {
-            int index = (y * width + x) * 3;
-            data[index] = 0;
-            data[index + 1] = 0;
-            data[index + 2] = 0;
+            for (int i = 0; i < 5; i++)
+                z[i] = s == 0 ? y[i] : y[i] + stage[s] * h * k[s - 1][i];
+            geodesicAccelerations(z, rs, k[s]);
         }
+        for (int i = 0; i < 5; i++)
+            y[i] += h * (k[0][i] + 2.0 * k[1][i] + 2.0 * k[2][i] + k[3][i]) / 6.0;
+    }
+    return fabs(y[1] + atan2(y[0] * y[4], y[3]) - heading);
+}
+
+/*
+ * Fills the deflection texture for a hole of radius rs (in screen heights). Texel (i, j) covers the
+ * offset from the hole (x, y) in [-DEFLECTION_TABLE_EXTENT, DEFLECTION_TABLE_EXTENT]^2 and holds the
+ * offset at which that ray meets the background plane, DEFLECTION_SOURCE_DISTANCE behind the hole,
+ * plus 1 where the ray is captured. The bending curve is integrated at DEFLECTION_CURVE_SAMPLES
+ * impact parameters, packed towards the critical one where it changes fastest, and interpolated.
+ */
+void buildDeflectionTable(float *table, float rs)
+{
+    double b_crit = 1.5 * sqrt(3.0);
+    double b_max = DEFLECTION_TABLE_EXTENT * sqrt(2.0) / rs;
+    double *curve = malloc(DEFLECTION_CURVE_SAMPLES * sizeof(double));
+    for (int n = 0; n < DEFLECTION_CURVE_SAMPLES; n++)
+    {
+        double t = (n + 1.0) / DEFLECTION_CURVE_SAMPLES;
+        curve[n] = photonDeflection(b_crit + (b_max - b_crit) * t * t);
     }
-    srand((unsigned int)time(NULL));
-    int numStars = 200;
-    for (int i = 0; i < numStars; i++)
+
+    for (int j = 0; j < DEFLECTION_TABLE_SIZE; j++)
     {
-        int x = rand() % width;
-        int y = rand() % height;
-        int index = (y * width + x) * 3;
-        data[index] = 255;
-        data[index + 1] = 255;
-        data[index + 2] = 255;
-        if (rand() % 5 == 0)
+        for (int i = 0; i < DEFLECTION_TABLE_SIZE; i++)
         {
-            if (x + 1 < width)
-            {
-                int index2 = (y * width + x + 1) * 3;
-                data[index2] = 255;
-                data[index2 + 1] = 255;
-                data[index2 + 2] = 255;
-            }
-            if (y + 1 < height)
+            float *texel = &table[(j * DEFLECTION_TABLE_SIZE + i) * 3];
+            double x = ((i + 0.5) / DEFLECTION_TABLE_SIZE * 2.0 - 1.0) * DEFLECTION_TABLE_EXTENT;
+            double y = ((j + 0.5) / DEFLECTION_TABLE_SIZE * 2.0 - 1.0) * DEFLECTION_TABLE_EXTENT;
+            double r = sqrt(x * x + y * y);
+            double b = r / rs;
+            double t = sqrt(fmax(b - b_crit, 0.0) / (b_max - b_crit)) * DEFLECTION_CURVE_SAMPLES - 1.0;
+            int n = t < 0.0 ? 0 : (int)t;
+            if (n > DEFLECTION_CURVE_SAMPLES - 2)
+                n = DEFLECTION_CURVE_SAMPLES - 2;
+            double a = curve[n] + (curve[n + 1] - curve[n]) * fmax(t - n, 0.0);
+            if (b <= b_crit || !isfinite(a))
             {
-                int index3 = ((y + 1) * width + x) * 3;
-                data[index3] = 255;
-                data[index3 + 1] = 255;
-                data[index3 + 2] = 255;
+                texel[0] = 0.0f;
+                texel[1] = 0.0f;
+                texel[2] = 1.0f;
+                continue;
             }
+            // The ray leaves at angle a towards the hole and runs on to the background plane
+            double scale = (r - DEFLECTION_SOURCE_DISTANCE * a) / r;
+            texel[0] = (float)(x * scale);
+            texel[1] = (float)(y * scale);
+            texel[2] = 0.0f;
         }
     }
+    free(curve);
+}
 
+unsigned int createDeflectionTexture()
+{
     unsigned int texture;
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    free(data);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     return texture;
 }
 
+void updateDeflectionTexture(unsigned int texture, float rs)
+{
+    double start = glfwGetTime();
+    float *table = malloc(DEFLECTION_TABLE_SIZE * DEFLECTION_TABLE_SIZE * 3 * sizeof(float));
+    if (!table)
+    {
+        printf("Failed to allocate the deflection table\n");
+        return;
+    }
+    buildDeflectionTable(table, rs);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, DEFLECTION_TABLE_SIZE, DEFLECTION_TABLE_SIZE, 0, GL_RGB, GL_FLOAT, table);
+    free(table);
+    printf("Deflection texture for rs = %.4f built in %.3f s\n", rs, glfwGetTime() - start);
+}
+
 unsigned int compileShader(const char *source, GLenum type)
 {
     unsigned int shader = glCreateShader(type);
@@ -257,7 +677,7 @@ int main()
     glEnableVertexAttribArray(1);
 
     bgTexture = createBackgroundTexture();
-    milkyWayTexture = loadMilkyWayTexture("milky_way.jpg");
+    startSkyLoader(&milkyWay, "milky_way.jpg");
 
     unsigned int sceneShaderProgram = createShaderProgram(sceneFragmentShaderSource);
     unsigned int distortionShaderProgram = createShaderProgram(distortionFragmentShaderSource);
@@ -288,6 +708,18 @@ int main()
 
     int blackHolePosLoc = glGetUniformLocation(distortionShaderProgram, "blackHolePos");
     int schwarzschildRadiusLoc = glGetUniformLocation(distortionShaderProgram, "schwarzschildRadius");
+    int aspectLoc = glGetUniformLocation(distortionShaderProgram, "aspect");
+
+    glUseProgram(distortionShaderProgram);
+    glUniform1i(glGetUniformLocation(distortionShaderProgram, "sceneTexture"), 0);
+    glUniform1i(glGetUniformLocation(distortionShaderProgram, "deflectionTexture"), 1);
+    glUniform1f(glGetUniformLocation(distortionShaderProgram, "tableExtent"), (float)DEFLECTION_TABLE_EXTENT);
+    glUniform1f(glGetUniformLocation(distortionShaderProgram, "sourceDistance"), (float)DEFLECTION_SOURCE_DISTANCE);
+
+    // Rebuilt only when rs changes (Up/Down arrows)
+    unsigned int deflectionTexture = createDeflectionTexture();
+    float rs = 0.05f;
+    float deflectionRs = 0.0f;
 
     float star_x = 0.2f;
     float star_y = 0.1f;
@@ -295,6 +727,7 @@ int main()
     float move_speed = 0.005f;
 
     int togglePressed = 0;
+    int radiusPressed = 0;
 
     while (!glfwWindowShouldClose(window))
     {
@@ -317,6 +750,17 @@ int main()
         if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
             star_x += move_speed;
 
+        int radiusKey = glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS ? 1 : glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS ? -1 : 0;
+        if (radiusKey && !radiusPressed)
+            rs = fminf(fmaxf(radiusKey > 0 ? rs * 1.25f : rs / 1.25f, 0.005f), 0.25f);
+        radiusPressed = radiusKey;
+
+        if (rs != deflectionRs)
+        {
+            updateDeflectionTexture(deflectionTexture, rs);
+            deflectionRs = rs;
+        }
+
         star_x = fminf(fmaxf(star_x, 0.0f), 1.0f);
         star_y = fminf(fmaxf(star_y, 0.0f), 1.0f);
 
@@ -342,7 +786,9 @@ int main()
         glUniform1f(sceneStarRadiusLoc, star_radius);
         glUniform1i(useStarLoc, currentTexture == 0 ? 1 : 0);
 
-        glBindTexture(GL_TEXTURE_2D, currentTexture == 0 ? bgTexture : milkyWayTexture);
+        // The star field stands in until the first sky level is on the GPU
+        unsigned int skyTexture = updateSkyLoader(&milkyWay);
+        glBindTexture(GL_TEXTURE_2D, currentTexture == 0 || !skyTexture ? bgTexture : skyTexture);
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
@@ -354,9 +800,12 @@ int main()
 
         glUseProgram(distortionShaderProgram);
         glUniform2f(blackHolePosLoc, bh_x, bh_y);
-        float rs = 0.05f;
         glUniform1f(schwarzschildRadiusLoc, rs);
+        glUniform1f(aspectLoc, (float)fbWidth / (float)fbHeight);
 
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, deflectionTexture);
+        glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, fboTexture);
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
@@ -369,8 +818,10 @@ int main()
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
     glDeleteTextures(1, &bgTexture);
-    glDeleteTextures(1, &milkyWayTexture);
+    finishSkyLoader(&milkyWay);
+    glDeleteTextures(1, &milkyWay.texture);
     glDeleteTextures(1, &fboTexture);
+    glDeleteTextures(1, &deflectionTexture);
     glDeleteFramebuffers(1, &fbo);
     glDeleteProgram(sceneShaderProgram);
     glDeleteProgram(distortionShaderProgram);
@@ -13,6 +13,15 @@
  * - 'R': Reset the camera to its initial state.
  * - 'P': Pause or resume the physics simulation.
  * - 'G': Toggle the visibility of the spacetime grid.
+ * - 'L': Toggle between per-pixel integration and the precomputed deflection table.
+ * - 'T': Toggle the per-frame CPU timing report.
+ * - 'B': Switch gravity between direct summation and the Barnes-Hut octree.
+ * - 'A': Toggle progressive accumulation while the camera and scene are still.
+ *
+ * Options:
+ * - --bodies N: Simulate N bodies, the three scene bodies plus N - 3 cluster stars (default 3).
+ * - --gravity direct|barnes-hut: Gravity backend (default: direct up to 256 bodies).
+ * - --theta X: Barnes-Hut opening angle (default 0.5).
  * - 'ESC': Exit the application.
  */
 
@@ -27,21 +36,73 @@
 #include <math.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
+// Bodies whose gravity is summed together by the direct solver, picked from the widest vector unit enabled at compile time
+#ifndef GRAVITY_LANES
+#if defined(__AVX512F__)
+#define GRAVITY_LANES 8
+#elif defined(__AVX2__)
+#define GRAVITY_LANES 4
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define GRAVITY_LANES 2
+#else
+#define GRAVITY_LANES 1
+#endif
+#endif
+typedef double gravity_vec_t __attribute__((vector_size(GRAVITY_LANES * sizeof(double))));
+
 // SIMULATION AND PHYSICAL CONSTANTS
 static const double SPEED_OF_LIGHT = 299792458.0;
 static const double GRAVITATIONAL_CONSTANT = 6.67430e-11;
 static const float BLACK_HOLE_SCHWARZSCHILD_RADIUS = 1.269e10f;
 static float RAY_INTEGRATION_STEP = 5e7f; // Initial step size for ray integration
 static const double RAY_ESCAPE_RADIUS = 1e30;    // Radius at which rays are considered to have escaped
-static const int NUM_CELESTIAL_BODIES = 3;
+static const int NUM_CELESTIAL_BODIES = 3; // scene bodies; the cluster stars follow them in the N-body system
 static bool is_physics_paused = false;
 static bool is_grid_visible = true;
+static bool is_lookup_enabled = false;
+static bool is_frame_timing_enabled = false;
+static bool is_progressive_enabled = true;
+static double animation_time = 0.0; // drives the disk pattern, advances only while physics runs
+
+// RAYTRACED IMAGE RESOLUTION AND ACCUMULATION
+static const int RENDER_TEXTURE_DIVISOR = 7;  // low resolution to improve performance
+static const int MOVING_TEXTURE_DIVISOR = 14; // lower still while the camera is being dragged
+static const int PROGRESSIVE_MAX_SAMPLES = 64; // jittered samples averaged before the image is left alone
+static const double FRAME_TIMING_REPORT_INTERVAL = 1.0; // seconds between timing reports
+
+// N-BODY SOLVER
+#define OCTREE_MAX_DEPTH 24
+static const double GRAVITY_SOFTENING = 1e10;        // Plummer softening length, below the star radius
+static const int GRAVITY_DIRECT_MAX_BODIES = 256;    // larger systems default to Barnes-Hut
+static const double GRAVITY_DEFAULT_THETA = 0.5;     // Barnes-Hut opening angle
+static const double CLUSTER_INNER_RADIUS = 2.6e11;   // just outside the camera's largest orbit
+static const double CLUSTER_OUTER_RADIUS = 1.2e12;
+static const double CLUSTER_THICKNESS = 5e10;
+static const float CLUSTER_STAR_RADIUS = 1.5e10f;
+static const uint64_t CLUSTER_SEED = 0x9e3779b97f4a7c15ull;
+
+// RAYTRACER UNIFORM BLOCK LAYOUT (must match the Bodies block in the raytracer shader)
+#define RAYTRACER_MAX_BODIES 16
+static const GLuint RAYTRACER_BODIES_BINDING = 0;
+
+// DEFLECTION TABLE LAYOUT (distances in Schwarzschild radii)
+#define DEFLECTION_NUM_RADII 32    // camera distances, spaced logarithmically
+#define DEFLECTION_NUM_ANGLES 256  // angles between the ray and the outward radial direction
+#define DEFLECTION_NUM_SAMPLES 128 // points along each path, evenly spaced in swept angle
+static const float DEFLECTION_MIN_RADIUS = 1.1f;
+static const float DEFLECTION_MAX_RADIUS = 40.0f;
+static const float DEFLECTION_MAX_SWEEP = 4.0f * M_PI; // rays still orbiting after this count as captured
+static const double DEFLECTION_ESCAPE_RADIUS = 1000.0;
+static const int DEFLECTION_MAX_STEPS = 200000;
+static const unsigned int DEFLECTION_CACHE_VERSION = 2;
+static const char *DEFLECTION_CACHE_FILE = "deflection_table.bin";
 
 // STRUCTURE DEFINITIONS
 /**
@@ -103,6 +164,115 @@ typedef struct
     vector3_t velocity;
 } celestial_body_t;
 
+/**
+ * @enum gravity_solver_t
+ * @brief Backends that compute the gravitational acceleration of every body.
+ */
+typedef enum
+{
+    GRAVITY_SOLVER_DIRECT,
+    GRAVITY_SOLVER_BARNES_HUT
+} gravity_solver_t;
+
+/**
+ * @struct octree_node_t
+ * @brief A cube of the Barnes-Hut octree: a leaf holding one body, a leaf of merged bodies at
+ * the depth limit, or an internal node with up to eight children.
+ */
+typedef struct
+{
+    double center[3];
+    double half_size;
+    double mass;
+    double com[3]; // centre of mass
+    int child[8];  // -1 where the octant is empty
+    int body;      // body index for a single-body leaf, -1 otherwise
+    bool is_merged;
+} octree_node_t;
+
+/**
+ * @struct octree_t
+ * @brief Node pool of the octree, rebuilt every step and reused between steps.
+ */
+typedef struct
+{
+    octree_node_t *nodes;
+    int count, capacity;
+} octree_t;
+
+/**
+ * @struct nbody_system_t
+ * @brief Bodies of the gravity simulation, one double array per field, padded to whole GRAVITY_LANES vectors.
+ */
+typedef struct
+{
+    int count, padded;
+    double *x, *y, *z;
+    double *vx, *vy, *vz;
+    double *ax, *ay, *az;
+    double *mass;
+    float *radius;
+    vector4_t *color;
+    octree_t octree;
+} nbody_system_t;
+
+/**
+ * @struct raytracer_bodies_block_t
+ * @brief CPU copy of the raytracer's std140 Bodies uniform block.
+ */
+typedef struct
+{
+    vector4_t position_and_radius[RAYTRACER_MAX_BODIES];
+    vector4_t color[RAYTRACER_MAX_BODIES];
+} raytracer_bodies_block_t;
+
+/**
+ * @struct raytracer_uniforms_t
+ * @brief Uniform locations of the raytracer program that change every frame, resolved once after linking.
+ */
+typedef struct
+{
+    GLint cam_pos, cam_right, cam_up, cam_forward;
+    GLint aspect;
+    GLint moving;
+    GLint resolution;
+    GLint time;
+    GLint lookup;
+    GLint jitter;
+} raytracer_uniforms_t;
+
+/**
+ * @struct progressive_state_t
+ * @brief Everything the raytraced image depends on, as of the samples accumulated so far.
+ * Any difference on the next frame starts the accumulation over.
+ */
+typedef struct
+{
+    int sample_count;
+    vector3_t cam_pos, cam_target;
+    int window_width, window_height;
+    float time;
+    bool lookup;
+    raytracer_bodies_block_t bodies;
+} progressive_state_t;
+
+/**
+ * @struct frame_timing_t
+ * @brief CPU time spent in each part of the frame, summed over the current report interval.
+ */
+typedef struct
+{
+    double physics;
+    double grid_mesh;
+    double grid_draw;
+    double raytrace;
+    double present;
+    double swap;
+    double total;
+    int frames;
+    double interval_start;
+} frame_timing_t;
+
 /**
  * @struct renderer_engine_t
  * @brief Encapsulates all OpenGL and GLFW objects required for rendering.
@@ -112,6 +282,12 @@ typedef struct
     GLFWwindow *window;
     GLuint fullscreen_quad_vao;
     GLuint render_texture;
+    GLuint render_framebuffer;
+    GLuint bodies_uniform_buffer;
+    raytracer_uniforms_t raytracer_uniforms;
+    progressive_state_t progressive;
+    GLint grid_view_projection_location;
+    GLuint deflection_path_texture, deflection_outcome_texture;
     GLuint raytracer_shader_program;
     GLuint grid_shader_program;
     GLuint texture_quad_shader_program;
@@ -155,6 +331,9 @@ static celestial_body_t celestial_bodies[] = {
 };
 
 static renderer_engine_t renderer_engine;
+static nbody_system_t nbody_system;
+static gravity_solver_t gravity_solver = GRAVITY_SOLVER_DIRECT;
+static double gravity_theta = GRAVITY_DEFAULT_THETA;
 
 // MATH UTILITY FUNCTIONS
 
@@ -375,49 +554,403 @@ void camera_reset(camera_t *cam)
 // PHYSICS SIMULATION
 
 /**
- * @brief Updates the positions and velocities of all celestial bodies based on
- * gravitational forces.
- * @param delta_time The time elapsed since the last update.
+ * @brief Allocates an empty N-body system with room for `capacity` bodies. Every array is padded
+ * to whole GRAVITY_LANES vectors; padding bodies have zero mass and so pull on nothing.
  */
-void simulation_update_physics(double delta_time)
+void nbody_system_init(nbody_system_t *system, int capacity)
 {
-    if (is_physics_paused)
-        return;
+    memset(system, 0, sizeof(*system));
+    system->padded = (capacity + GRAVITY_LANES - 1) / GRAVITY_LANES * GRAVITY_LANES;
+    // aligned_alloc wants a whole number of alignment units
+    size_t bytes = ((size_t)system->padded * sizeof(double) + 63) / 64 * 64;
+    double **fields[] = {&system->x, &system->y, &system->z, &system->vx, &system->vy, &system->vz,
+                         &system->ax, &system->ay, &system->az, &system->mass};
+    for (int f = 0; f < 10; f++)
+    {
+        *fields[f] = aligned_alloc(64, bytes);
+        if (!*fields[f])
+        {
+            printf("Unable to allocate state for %d bodies\n", capacity);
+            exit(EXIT_FAILURE);
+        }
+        memset(*fields[f], 0, bytes);
+    }
+    system->radius = calloc(system->padded, sizeof(float));
+    system->color = calloc(system->padded, sizeof(vector4_t));
+    if (!system->radius || !system->color)
+    {
+        printf("Unable to allocate state for %d bodies\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+}
 
-    // N-body simulation using Newton's law of universal gravitation.
-    for (int i = 0; i < NUM_CELESTIAL_BODIES; ++i)
+void nbody_system_free(nbody_system_t *system)
+{
+    double *fields[] = {system->x, system->y, system->z, system->vx, system->vy, system->vz,
+                        system->ax, system->ay, system->az, system->mass};
+    for (int f = 0; f < 10; f++)
+    {
+        free(fields[f]);
+    }
+    free(system->radius);
+    free(system->color);
+    free(system->octree.nodes);
+    memset(system, 0, sizeof(*system));
+}
+
+/**
+ * @brief Appends one body. The caller sizes the system, so this never reallocates.
+ */
+void nbody_system_add(nbody_system_t *system, const celestial_body_t *body)
+{
+    int i = system->count++;
+    system->x[i] = body->position_and_radius.x;
+    system->y[i] = body->position_and_radius.y;
+    system->z[i] = body->position_and_radius.z;
+    system->vx[i] = body->velocity.x;
+    system->vy[i] = body->velocity.y;
+    system->vz[i] = body->velocity.z;
+    system->mass[i] = body->mass;
+    system->radius[i] = body->position_and_radius.w;
+    system->color[i] = body->color;
+}
+
+/**
+ * @brief Adds `count` solar-mass stars on circular orbits around the black hole, spread over a thick
+ * disk in the orbital plane of the two scene stars. Placement is seeded, so every run is the same.
+ */
+void nbody_system_add_cluster(nbody_system_t *system, int count)
+{
+    const double black_hole_mass = celestial_bodies[2].mass;
+    uint64_t state = CLUSTER_SEED;
+    for (int k = 0; k < count; ++k)
     {
-        for (int j = 0; j < NUM_CELESTIAL_BODIES; ++j)
+        double u[4];
+        for (int n = 0; n < 4; ++n)
         {
-            if (i == j)
-                continue;
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            u[n] = (state >> 11) * 0x1.0p-53;
+        }
+        // uniform in area between the inner and outer radius
+        double r = sqrt(CLUSTER_INNER_RADIUS * CLUSTER_INNER_RADIUS +
+                        u[0] * (CLUSTER_OUTER_RADIUS * CLUSTER_OUTER_RADIUS - CLUSTER_INNER_RADIUS * CLUSTER_INNER_RADIUS));
+        double phi = 2.0 * M_PI * u[1];
+        double height = (u[2] - 0.5) * 2.0 * CLUSTER_THICKNESS;
+        double speed = sqrt(GRAVITATIONAL_CONSTANT * black_hole_mass / r);
+
+        celestial_body_t star = {
+            {(float)(r * cos(phi)), (float)height, (float)(r * sin(phi)), CLUSTER_STAR_RADIUS},
+            {1.0f, 0.6f + 0.4f * (float)u[3], 0.3f + 0.7f * (float)u[3], 1.0f}, // orange to blue-white
+            1.98892e30f,
+            {(float)(-speed * sin(phi)), 0.0f, (float)(speed * cos(phi))}};
+        nbody_system_add(system, &star);
+    }
+}
+
+/**
+ * @brief Returns 1 / (r^2 + eps^2)^(3/2) for every lane of a softened squared distance.
+ */
+static inline gravity_vec_t gravity_inverse_cube(gravity_vec_t r2)
+{
+    gravity_vec_t result;
+    for (int l = 0; l < GRAVITY_LANES; ++l)
+    {
+        double inv_r = 1.0 / sqrt(r2[l]);
+        result[l] = inv_r * inv_r * inv_r;
+    }
+    return result;
+}
+
+/**
+ * @brief Direct summation: GRAVITY_LANES target bodies at a time against every source body.
+ * Softening keeps the self term at zero distance finite (and zero, since dx = 0), so the
+ * inner loop needs no branches. O(N^2), but the fastest choice for small N.
+ */
+void gravity_direct_sum(nbody_system_t *system)
+{
+    const double eps2 = GRAVITY_SOFTENING * GRAVITY_SOFTENING;
+    for (int i = 0; i < system->count; i += GRAVITY_LANES)
+    {
+        gravity_vec_t xi, yi, zi;
+        memcpy(&xi, &system->x[i], sizeof(xi));
+        memcpy(&yi, &system->y[i], sizeof(yi));
+        memcpy(&zi, &system->z[i], sizeof(zi));
+        gravity_vec_t ax = {0}, ay = {0}, az = {0};
+
+        for (int j = 0; j < system->count; ++j)
+        {
+            gravity_vec_t dx = system->x[j] - xi;
+            gravity_vec_t dy = system->y[j] - yi;
+            gravity_vec_t dz = system->z[j] - zi;
+            gravity_vec_t s = system->mass[j] * gravity_inverse_cube(dx * dx + dy * dy + dz * dz + eps2);
+            ax += s * dx;
+            ay += s * dy;
+            az += s * dz;
+        }
+        ax *= GRAVITATIONAL_CONSTANT;
+        ay *= GRAVITATIONAL_CONSTANT;
+        az *= GRAVITATIONAL_CONSTANT;
+        memcpy(&system->ax[i], &ax, sizeof(ax));
+        memcpy(&system->ay[i], &ay, sizeof(ay));
+        memcpy(&system->az[i], &az, sizeof(az));
+    }
+}
+
+/**
+ * @brief Returns a fresh node index, growing the node pool when it is full.
+ */
+int octree_new_node(octree_t *tree, double cx, double cy, double cz, double half_size)
+{
+    if (tree->count == tree->capacity)
+    {
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 1024;
+        tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(octree_node_t));
+        if (!tree->nodes)
+        {
+            printf("Unable to allocate %d octree nodes\n", tree->capacity);
+            exit(EXIT_FAILURE);
+        }
+    }
+    octree_node_t *node = &tree->nodes[tree->count];
+    memset(node, 0, sizeof(*node));
+    node->center[0] = cx;
+    node->center[1] = cy;
+    node->center[2] = cz;
+    node->half_size = half_size;
+    node->body = -1;
+    for (int c = 0; c < 8; ++c)
+    {
+        node->child[c] = -1;
+    }
+    return tree->count++;
+}
 
-            // Calculate distance and direction between bodies
-            float dx = celestial_bodies[j].position_and_radius.x - celestial_bodies[i].position_and_radius.x;
-            float dy = celestial_bodies[j].position_and_radius.y - celestial_bodies[i].position_and_radius.y;
-            float dz = celestial_bodies[j].position_and_radius.z - celestial_bodies[i].position_and_radius.z;
-            float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+/**
+ * @brief Returns the child octant of `node` that contains the point, creating it if needed.
+ */
+int octree_child(octree_t *tree, int node, double x, double y, double z)
+{
+    octree_node_t *n = &tree->nodes[node];
+    int octant = (x >= n->center[0]) | ((y >= n->center[1]) << 1) | ((z >= n->center[2]) << 2);
+    if (n->child[octant] < 0)
+    {
+        double h = n->half_size * 0.5;
+        int child = octree_new_node(tree, n->center[0] + ((octant & 1) ? h : -h),
+                                    n->center[1] + ((octant & 2) ? h : -h),
+                                    n->center[2] + ((octant & 4) ? h : -h), h);
+        tree->nodes[node].child[octant] = child; // the pool may have moved
+    }
+    return tree->nodes[node].child[octant];
+}
 
-            // Avoid division by zero and collision
-            if (distance > (celestial_bodies[i].position_and_radius.w + celestial_bodies[j].position_and_radius.w))
+/**
+ * @brief Rebuilds the octree over the current positions. Each node keeps its total mass and
+ * centre of mass. Bodies closer than OCTREE_MAX_DEPTH subdivisions allow share one leaf.
+ */
+void octree_build(octree_t *tree, const nbody_system_t *system)
+{
+    double lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    const double *pos[3] = {system->x, system->y, system->z};
+    for (int i = 0; i < system->count; ++i)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = fmin(lo[a], pos[a][i]);
+            hi[a] = fmax(hi[a], pos[a][i]);
+        }
+    }
+    double half_size = 0.5 * fmax(hi[0] - lo[0], fmax(hi[1] - lo[1], hi[2] - lo[2])) * 1.0001 + 1.0;
+
+    tree->count = 0;
+    octree_new_node(tree, 0.5 * (lo[0] + hi[0]), 0.5 * (lo[1] + hi[1]), 0.5 * (lo[2] + hi[2]), half_size);
+
+    for (int i = 0; i < system->count; ++i)
+    {
+        double x = system->x[i], y = system->y[i], z = system->z[i], m = system->mass[i];
+        int node = 0;
+        for (int depth = 0;; ++depth)
+        {
+            octree_node_t *n = &tree->nodes[node];
+            bool is_leaf = n->mass == 0.0 || n->body >= 0 || n->is_merged;
+            bool is_empty = n->mass == 0.0 && !n->is_merged;
+            // mass-weighted position sums; divided out once the tree is complete
+            n->mass += m;
+            n->com[0] += m * x;
+            n->com[1] += m * y;
+            n->com[2] += m * z;
+            if (is_empty)
+            {
+                n->body = i;
+                break;
+            }
+            if (is_leaf)
             {
-                vector3_t direction = {dx / distance, dy / distance, dz / distance};
-                double gravitational_force = (GRAVITATIONAL_CONSTANT * celestial_bodies[i].mass * celestial_bodies[j].mass) / (distance * distance);
-                double acceleration = gravitational_force / celestial_bodies[i].mass;
-
-                // Update velocity based on acceleration
-                celestial_bodies[i].velocity.x += direction.x * acceleration * delta_time;
-                celestial_bodies[i].velocity.y += direction.y * acceleration * delta_time;
-                celestial_bodies[i].velocity.z += direction.z * acceleration * delta_time;
+                if (depth >= OCTREE_MAX_DEPTH)
+                {
+                    n->body = -1;
+                    n->is_merged = true;
+                    break;
+                }
+                // push the resident body one level down, then keep descending with this one
+                int resident = n->body;
+                n->body = -1;
+                int child = octree_child(tree, node, system->x[resident], system->y[resident], system->z[resident]);
+                octree_node_t *c = &tree->nodes[child];
+                double rm = system->mass[resident];
+                c->body = resident;
+                c->mass = rm;
+                c->com[0] = rm * system->x[resident];
+                c->com[1] = rm * system->y[resident];
+                c->com[2] = rm * system->z[resident];
             }
+            node = octree_child(tree, node, x, y, z);
         }
     }
-    // Update positions based on new velocities
-    for (int i = 0; i < NUM_CELESTIAL_BODIES; i++)
+
+    for (int k = 0; k < tree->count; ++k)
     {
-        celestial_bodies[i].position_and_radius.x += celestial_bodies[i].velocity.x * delta_time;
-        celestial_bodies[i].position_and_radius.y += celestial_bodies[i].velocity.y * delta_time;
-        celestial_bodies[i].position_and_radius.z += celestial_bodies[i].velocity.z * delta_time;
+        octree_node_t *n = &tree->nodes[k];
+        if (n->mass > 0.0)
+        {
+            n->com[0] /= n->mass;
+            n->com[1] /= n->mass;
+            n->com[2] /= n->mass;
+        }
+    }
+}
+
+/**
+ * @brief Barnes-Hut: a node whose width seen from the body is below `theta` acts as one point mass
+ * at its centre of mass; otherwise its children are visited. O(N log N), for thousands of bodies.
+ * Nodes on the body's own path down the tree contain it, so they are always opened, and a merged
+ * leaf holding it acts without the body's own mass. Stack entries carry that flag in bit 0.
+ */
+void gravity_barnes_hut(nbody_system_t *system)
+{
+    octree_t *tree = &system->octree;
+    octree_build(tree, system);
+
+    const double eps2 = GRAVITY_SOFTENING * GRAVITY_SOFTENING;
+    const double theta2 = gravity_theta * gravity_theta;
+    int stack[8 * (OCTREE_MAX_DEPTH + 1)];
+    for (int i = 0; i < system->count; ++i)
+    {
+        double x = system->x[i], y = system->y[i], z = system->z[i];
+        double ax = 0.0, ay = 0.0, az = 0.0;
+        int top = 0;
+        stack[top++] = 0 << 1 | 1; // the root is on every path
+        while (top > 0)
+        {
+            int entry = stack[--top];
+            bool on_path = entry & 1;
+            const octree_node_t *n = &tree->nodes[entry >> 1];
+            if (n->body == i || n->mass == 0.0)
+                continue;
+
+            double mass = n->mass, cx = n->com[0], cy = n->com[1], cz = n->com[2];
+            if (on_path && n->is_merged)
+            {
+                double mi = system->mass[i];
+                mass -= mi;
+                if (mass <= 0.0)
+                    continue;
+                cx = (n->mass * cx - mi * x) / mass;
+                cy = (n->mass * cy - mi * y) / mass;
+                cz = (n->mass * cz - mi * z) / mass;
+            }
+            double dx = cx - x, dy = cy - y, dz = cz - z;
+            double d2 = dx * dx + dy * dy + dz * dz;
+            double width = 2.0 * n->half_size;
+            if (n->body >= 0 || n->is_merged || (!on_path && width * width < theta2 * d2))
+            {
+                double inv_r = 1.0 / sqrt(d2 + eps2);
+                double s = mass * inv_r * inv_r * inv_r;
+                ax += s * dx;
+                ay += s * dy;
+                az += s * dz;
+                continue;
+            }
+            int own = on_path ? (x >= n->center[0]) | ((y >= n->center[1]) << 1) | ((z >= n->center[2]) << 2) : -1;
+            for (int c = 0; c < 8; ++c)
+            {
+                if (n->child[c] >= 0)
+                    stack[top++] = n->child[c] << 1 | (c == own);
+            }
+        }
+        system->ax[i] = GRAVITATIONAL_CONSTANT * ax;
+        system->ay[i] = GRAVITATIONAL_CONSTANT * ay;
+        system->az[i] = GRAVITATIONAL_CONSTANT * az;
+    }
+}
+
+/**
+ * @brief Fills the acceleration arrays with the selected gravity backend.
+ */
+void gravity_compute_accelerations(nbody_system_t *system)
+{
+    switch (gravity_solver)
+    {
+    case GRAVITY_SOLVER_BARNES_HUT:
+        gravity_barnes_hut(system);
+        break;
+    case GRAVITY_SOLVER_DIRECT:
+    default:
+        gravity_direct_sum(system);
+        break;
+    }
+}
+
+/**
+ * @brief Builds the simulated system: the scene bodies first, in their original order so the
+ * renderer and grid keep finding them, followed by `num_bodies - NUM_CELESTIAL_BODIES` cluster stars.
+ */
+void simulation_initialize(int num_bodies)
+{
+    nbody_system_init(&nbody_system, num_bodies);
+    for (int i = 0; i < NUM_CELESTIAL_BODIES; ++i)
+    {
+        nbody_system_add(&nbody_system, &celestial_bodies[i]);
+    }
+    nbody_system_add_cluster(&nbody_system, num_bodies - NUM_CELESTIAL_BODIES);
+    gravity_compute_accelerations(&nbody_system); // the first half kick needs a(t0)
+}
+
+/**
+ * @brief Advances the system with kick-drift-kick leapfrog (velocity Verlet) and copies the scene
+ * bodies back into celestial_bodies for the grid.
+ */
+void simulation_update_physics(double delta_time)
+{
+    if (is_physics_paused)
+        return;
+
+    nbody_system_t *s = &nbody_system;
+    double half_dt = 0.5 * delta_time;
+    for (int i = 0; i < s->count; ++i)
+    {
+        s->vx[i] += s->ax[i] * half_dt;
+        s->vy[i] += s->ay[i] * half_dt;
+        s->vz[i] += s->az[i] * half_dt;
+        s->x[i] += s->vx[i] * delta_time;
+        s->y[i] += s->vy[i] * delta_time;
+        s->z[i] += s->vz[i] * delta_time;
+    }
+    gravity_compute_accelerations(s);
+    for (int i = 0; i < s->count; ++i)
+    {
+        s->vx[i] += s->ax[i] * half_dt;
+        s->vy[i] += s->ay[i] * half_dt;
+        s->vz[i] += s->az[i] * half_dt;
+    }
+
+    for (int i = 0; i < NUM_CELESTIAL_BODIES; ++i)
+    {
+        celestial_bodies[i].position_and_radius.x = (float)s->x[i];
+        celestial_bodies[i].position_and_radius.y = (float)s->y[i];
+        celestial_bodies[i].position_and_radius.z = (float)s->z[i];
+        celestial_bodies[i].velocity = (vector3_t){(float)s->vx[i], (float)s->vy[i], (float)s->vz[i]};
     }
 }
 
@@ -514,8 +1047,7 @@ void grid_render(renderer_engine_t *engine, matrix4_t view_projection_matrix)
     if (!is_grid_visible) return;
 
     glUseProgram(engine->grid_shader_program);
-    glUniformMatrix4fv(glGetUniformLocation(engine->grid_shader_program, "viewProj"),
-                       1, GL_FALSE, view_projection_matrix.elements);
+    glUniformMatrix4fv(engine->grid_view_projection_location, 1, GL_FALSE, view_projection_matrix.elements);
     glBindVertexArray(engine->grid_vao);
     glDisable(GL_DEPTH_TEST);
     glEnable(GL_BLEND);
@@ -527,6 +1059,212 @@ void grid_render(renderer_engine_t *engine, matrix4_t view_projection_matrix)
 }
 
 
+// DEFLECTION TABLE
+
+/**
+ * @struct deflection_table_t
+ * @brief Precomputed light paths around the black hole. A ray stays in the plane through the hole
+ * spanned by its start point and direction, so its path depends only on the start distance and
+ * the angle between the ray and the outward radial direction. Distances are in Schwarzschild radii.
+ */
+typedef struct
+{
+    float *path;    // rs / r at evenly spaced swept angles; 0 once escaped, 1 once captured
+    float *outcome; // per ray: escape direction angle, captured flag, swept angle at the end
+} deflection_table_t;
+
+/**
+ * @struct deflection_table_header_t
+ * @brief Header of the on-disk cache, compared against the compiled-in layout before loading.
+ */
+typedef struct
+{
+    char magic[4];
+    unsigned int version;
+    int num_radii, num_angles, num_samples;
+    float min_radius, max_radius, max_sweep;
+} deflection_table_header_t;
+
+/**
+ * @brief Right-hand side of the geodesic equations used by the raytracer shader, restricted to
+ * the equatorial plane of the ray. y holds r, phi, dr, dphi; r is in Schwarzschild radii.
+ */
+void deflection_rhs(const double *y, double energy, double *dy)
+{
+    double r = y[0], dr = y[2], dphi = y[3];
+    double f = 1.0 - 1.0 / r;
+    double dt_dl = energy / f;
+    dy[0] = dr;
+    dy[1] = dphi;
+    dy[2] = -(1.0 / (2.0 * r * r)) * f * dt_dl * dt_dl + (1.0 / (2.0 * r * r * f)) * dr * dr + (r - 1.0) * dphi * dphi;
+    dy[3] = -2.0 * dr * dphi / r;
+}
+
+/**
+ * @brief Integrates one ray from radius r0 at angle alpha to the outward radial direction and
+ * fills its row of the table. Initial conditions match initRay in the raytracer shader.
+ */
+void deflection_trace_ray(double r0, double alpha, float *path, float *outcome)
+{
+    double y[4] = {r0, 0.0, cos(alpha), sin(alpha) / r0};
+    double f0 = 1.0 - 1.0 / r0;
+    double energy = sqrt(y[2] * y[2] + f0 * r0 * r0 * y[3] * y[3]); // null condition
+    double sample_spacing = DEFLECTION_MAX_SWEEP / DEFLECTION_NUM_SAMPLES;
+    int sample = 0;
+    float fill = 1.0f; // what the samples past the end of the path hold
+
+    outcome[0] = 0.0f;
+    outcome[1] = 1.0f;
+    outcome[2] = DEFLECTION_MAX_SWEEP;
+    for (int step = 0; step < DEFLECTION_MAX_STEPS; ++step)
+    {
+        double r = y[0];
+        if (r < 1.01)
+        {
+            outcome[2] = (float)y[1];
+            break;
+        }
+        if (r > DEFLECTION_ESCAPE_RADIUS && y[2] > 0.0)
+        {
+            outcome[0] = (float)(y[1] + atan2(r * y[3], y[2]));
+            outcome[1] = 0.0f;
+            outcome[2] = (float)y[1];
+            fill = 0.0f;
+            break;
+        }
+
+        // RK4 with a step proportional to the distance from the horizon
+        double h = fmax(0.01 * (r - 1.0), 1e-4);
+        double k1[4], k2[4], k3[4], k4[4], tmp[4];
+        deflection_rhs(y, energy, k1);
+        for (int i = 0; i < 4; ++i) tmp[i] = y[i] + 0.5 * h * k1[i];
+        deflection_rhs(tmp, energy, k2);
+        for (int i = 0; i < 4; ++i) tmp[i] = y[i] + 0.5 * h * k2[i];
+        deflection_rhs(tmp, energy, k3);
+        for (int i = 0; i < 4; ++i) tmp[i] = y[i] + h * k3[i];
+        deflection_rhs(tmp, energy, k4);
+
+        double previous_phi = y[1], previous_u = 1.0 / y[0];
+        for (int i = 0; i < 4; ++i) y[i] += h / 6.0 * (k1[i] + 2.0 * k2[i] + 2.0 * k3[i] + k4[i]);
+
+        // Record 1 / r at every sample angle passed during this step
+        while (sample < DEFLECTION_NUM_SAMPLES && (sample + 0.5) * sample_spacing <= y[1])
+        {
+            double t = ((sample + 0.5) * sample_spacing - previous_phi) / (y[1] - previous_phi);
+            path[sample++] = (float)fmin(1.0, previous_u + t * (1.0 / y[0] - previous_u));
+        }
+        if (sample == DEFLECTION_NUM_SAMPLES)
+            break; // still orbiting after the full sweep, counted as captured
+    }
+    while (sample < DEFLECTION_NUM_SAMPLES)
+        path[sample++] = fill;
+}
+
+/**
+ * @brief Fills the table by tracing one ray per (distance, angle) cell.
+ */
+void deflection_table_build(deflection_table_t *table)
+{
+    for (int i = 0; i < DEFLECTION_NUM_RADII; ++i)
+    {
+        // Distances are spaced logarithmically; cells sit at texel centres
+        double r0 = DEFLECTION_MIN_RADIUS * pow(DEFLECTION_MAX_RADIUS / DEFLECTION_MIN_RADIUS, (i + 0.5) / DEFLECTION_NUM_RADII);
+        for (int j = 0; j < DEFLECTION_NUM_ANGLES; ++j)
+        {
+            double alpha = M_PI * (j + 0.5) / DEFLECTION_NUM_ANGLES;
+            size_t cell = (size_t)i * DEFLECTION_NUM_ANGLES + j;
+            deflection_trace_ray(r0, alpha, &table->path[cell * DEFLECTION_NUM_SAMPLES], &table->outcome[cell * 3]);
+        }
+    }
+}
+
+/**
+ * @brief Returns the header describing the table layout this build expects.
+ */
+deflection_table_header_t deflection_table_header()
+{
+    deflection_table_header_t header = {{'D', 'E', 'F', 'L'}, DEFLECTION_CACHE_VERSION,
+                                        DEFLECTION_NUM_RADII, DEFLECTION_NUM_ANGLES, DEFLECTION_NUM_SAMPLES,
+                                        DEFLECTION_MIN_RADIUS, DEFLECTION_MAX_RADIUS, DEFLECTION_MAX_SWEEP};
+    return header;
+}
+
+/**
+ * @brief Loads the table from the cache file.
+ * @return True if the file exists and matches the expected layout.
+ */
+bool deflection_table_load(deflection_table_t *table, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) return false;
+
+    deflection_table_header_t expected = deflection_table_header();
+    deflection_table_header_t header;
+    size_t cells = (size_t)DEFLECTION_NUM_RADII * DEFLECTION_NUM_ANGLES;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(&header, &expected, sizeof(header)) == 0 &&
+              fread(table->path, sizeof(float), cells * DEFLECTION_NUM_SAMPLES, file) == cells * DEFLECTION_NUM_SAMPLES &&
+              fread(table->outcome, sizeof(float), cells * 3, file) == cells * 3;
+    fclose(file);
+    return ok;
+}
+
+/**
+ * @brief Writes the table to the cache file so later runs can skip building it.
+ */
+void deflection_table_save(const deflection_table_t *table, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        printf("[WARN] Unable to write deflection table cache %s\n", filename);
+        return;
+    }
+    deflection_table_header_t header = deflection_table_header();
+    size_t cells = (size_t)DEFLECTION_NUM_RADII * DEFLECTION_NUM_ANGLES;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(table->path, sizeof(float), cells * DEFLECTION_NUM_SAMPLES, file);
+    fwrite(table->outcome, sizeof(float), cells * 3, file);
+    fclose(file);
+}
+
+/**
+ * @brief Allocates the table and fills it from the cache, building and caching it if needed.
+ * @return True on success, false if the table could not be allocated.
+ */
+bool deflection_table_init(deflection_table_t *table)
+{
+    size_t cells = (size_t)DEFLECTION_NUM_RADII * DEFLECTION_NUM_ANGLES;
+    table->path = malloc(cells * DEFLECTION_NUM_SAMPLES * sizeof(float));
+    table->outcome = malloc(cells * 3 * sizeof(float));
+    if (!table->path || !table->outcome)
+    {
+        printf("Failed to allocate the deflection table\n");
+        return false;
+    }
+
+    if (deflection_table_load(table, DEFLECTION_CACHE_FILE))
+    {
+        printf("[INFO] Loaded deflection table from %s\n", DEFLECTION_CACHE_FILE);
+        return true;
+    }
+    clock_t start = clock();
+    deflection_table_build(table);
+    printf("[INFO] Built deflection table in %.2f s\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+    deflection_table_save(table, DEFLECTION_CACHE_FILE);
+    return true;
+}
+
+/**
+ * @brief Frees the CPU copy of the table once it has been uploaded.
+ */
+void deflection_table_free(deflection_table_t *table)
+{
+    free(table->path);
+    free(table->outcome);
+    table->path = NULL;
+    table->outcome = NULL;
+}
+
 // OPENGL SHADER UTILITIES
 
 /**
@@ -620,16 +1358,189 @@ void engine_init_fullscreen_quad(renderer_engine_t *engine)
 }
 
 /**
- * @brief Initializes the texture used as a render target for the ray tracer.
+ * @brief (Re)allocates the storage of the raytracer's render texture. It holds the running average
+ * of the accumulated samples, so it uses half floats to keep small per-sample weights.
+ */
+void engine_resize_render_texture(renderer_engine_t *engine, int width, int height)
+{
+    engine->render_texture_width = width;
+    engine->render_texture_height = height;
+    glBindTexture(GL_TEXTURE_2D, engine->render_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/**
+ * @brief Initializes the texture used as a render target for the ray tracer and the framebuffer
+ * it is attached to. Resizing reallocates the texture storage but keeps both objects.
+ * @return True if the framebuffer is complete.
  */
-void engine_init_render_texture(renderer_engine_t *engine)
+bool engine_init_render_texture(renderer_engine_t *engine)
 {
     glGenTextures(1, &engine->render_texture);
     glBindTexture(GL_TEXTURE_2D, engine->render_texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, engine->render_texture_width, engine->render_texture_height,
-                 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    engine_resize_render_texture(engine, engine->render_texture_width, engine->render_texture_height);
+
+    glGenFramebuffers(1, &engine->render_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, engine->render_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, engine->render_texture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        printf("Render framebuffer is incomplete (status 0x%x)\n", status);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Number of simulated bodies the raytracer draws; the rest only contribute gravity.
+ */
+int engine_rendered_body_count()
+{
+    return nbody_system.count < RAYTRACER_MAX_BODIES ? nbody_system.count : RAYTRACER_MAX_BODIES;
+}
+
+/**
+ * @brief Resolves uniform locations once after linking, sets the uniforms that never change
+ * (sampler units, field of view, disk and table ranges) and creates the uniform buffer that
+ * carries the celestial bodies.
+ * @return True if the raytracer exposes the Bodies block.
+ */
+bool engine_init_uniforms(renderer_engine_t *engine)
+{
+    GLuint program = engine->raytracer_shader_program;
+    raytracer_uniforms_t *u = &engine->raytracer_uniforms;
+    u->cam_pos = glGetUniformLocation(program, "camPos");
+    u->cam_right = glGetUniformLocation(program, "camRight");
+    u->cam_up = glGetUniformLocation(program, "camUp");
+    u->cam_forward = glGetUniformLocation(program, "camForward");
+    u->aspect = glGetUniformLocation(program, "aspect");
+    u->moving = glGetUniformLocation(program, "moving");
+    u->resolution = glGetUniformLocation(program, "resolution");
+    u->time = glGetUniformLocation(program, "time");
+    u->lookup = glGetUniformLocation(program, "lookup");
+    u->jitter = glGetUniformLocation(program, "jitter");
+
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "tanHalfFov"), tanf(M_PI / 6.0f));
+    glUniform1f(glGetUniformLocation(program, "disk_r1"), BLACK_HOLE_SCHWARZSCHILD_RADIUS * 2.2f);
+    glUniform1f(glGetUniformLocation(program, "disk_r2"), BLACK_HOLE_SCHWARZSCHILD_RADIUS * 5.2f);
+    glUniform1i(glGetUniformLocation(program, "numObjects"), engine_rendered_body_count());
+    glUniform3f(glGetUniformLocation(program, "tableRange"), DEFLECTION_MIN_RADIUS, DEFLECTION_MAX_RADIUS, DEFLECTION_MAX_SWEEP);
+    glUniform1i(glGetUniformLocation(program, "pathTable"), 1);
+    glUniform1i(glGetUniformLocation(program, "outcomeTable"), 2);
+
+    glUseProgram(engine->texture_quad_shader_program);
+    glUniform1i(glGetUniformLocation(engine->texture_quad_shader_program, "screenTexture"), 0);
+    glUseProgram(0);
+
+    engine->grid_view_projection_location = glGetUniformLocation(engine->grid_shader_program, "viewProj");
+
+    GLuint block_index = glGetUniformBlockIndex(program, "Bodies");
+    if (block_index == GL_INVALID_INDEX)
+    {
+        printf("Raytracer shader has no Bodies uniform block\n");
+        return false;
+    }
+    glUniformBlockBinding(program, block_index, RAYTRACER_BODIES_BINDING);
+
+    glGenBuffers(1, &engine->bodies_uniform_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, engine->bodies_uniform_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(raytracer_bodies_block_t), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, RAYTRACER_BODIES_BINDING, engine->bodies_uniform_buffer);
+    return true;
+}
+
+/**
+ * @brief Copies the first RAYTRACER_MAX_BODIES simulated bodies (the scene bodies, then cluster
+ * stars) into a Bodies block.
+ */
+void engine_fill_bodies_block(raytracer_bodies_block_t *block)
+{
+    memset(block, 0, sizeof(*block));
+    for (int i = 0; i < engine_rendered_body_count(); ++i)
+    {
+        block->position_and_radius[i] = (vector4_t){(float)nbody_system.x[i], (float)nbody_system.y[i],
+                                                    (float)nbody_system.z[i], nbody_system.radius[i]};
+        block->color[i] = nbody_system.color[i];
+    }
+}
+
+/**
+ * @brief Uploads a Bodies block to the uniform buffer with a single call.
+ */
+void engine_upload_bodies(renderer_engine_t *engine, const raytracer_bodies_block_t *block)
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, engine->bodies_uniform_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(*block), block);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+/**
+ * @brief Compares the inputs of the raytraced image with those of the accumulated samples and
+ * records the new ones. Uploads the bodies only when they moved.
+ * @return True if the accumulated samples no longer match the scene.
+ */
+bool engine_update_progressive_state(renderer_engine_t *engine, const camera_t *cam)
+{
+    progressive_state_t *p = &engine->progressive;
+    vector3_t pos = camera_get_position(cam);
+    raytracer_bodies_block_t bodies;
+    engine_fill_bodies_block(&bodies);
+
+    bool bodies_changed = p->sample_count == 0 || memcmp(&bodies, &p->bodies, sizeof(bodies)) != 0;
+    if (bodies_changed)
+    {
+        engine_upload_bodies(engine, &bodies);
+        p->bodies = bodies;
+    }
+    bool changed = bodies_changed || !is_progressive_enabled ||
+                   pos.x != p->cam_pos.x || pos.y != p->cam_pos.y || pos.z != p->cam_pos.z ||
+                   cam->target.x != p->cam_target.x || cam->target.y != p->cam_target.y || cam->target.z != p->cam_target.z ||
+                   engine->window_width != p->window_width || engine->window_height != p->window_height ||
+                   (float)animation_time != p->time || is_lookup_enabled != p->lookup;
+    p->cam_pos = pos;
+    p->cam_target = cam->target;
+    p->window_width = engine->window_width;
+    p->window_height = engine->window_height;
+    p->time = (float)animation_time;
+    p->lookup = is_lookup_enabled;
+    return changed;
+}
+
+/**
+ * @brief Uploads the deflection table: paths as a 3D texture (sample, angle, distance) and
+ * outcomes as a 2D texture (angle, distance), both linearly interpolated.
+ */
+void engine_init_deflection_textures(renderer_engine_t *engine, const deflection_table_t *table)
+{
+    glGenTextures(1, &engine->deflection_path_texture);
+    glBindTexture(GL_TEXTURE_3D, engine->deflection_path_texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, DEFLECTION_NUM_SAMPLES, DEFLECTION_NUM_ANGLES, DEFLECTION_NUM_RADII,
+                 0, GL_RED, GL_FLOAT, table->path);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    glGenTextures(1, &engine->deflection_outcome_texture);
+    glBindTexture(GL_TEXTURE_2D, engine->deflection_outcome_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, DEFLECTION_NUM_ANGLES, DEFLECTION_NUM_RADII,
+                 0, GL_RGB, GL_FLOAT, table->outcome);
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -638,10 +1549,31 @@ void engine_init_render_texture(renderer_engine_t *engine)
  */
 void engine_render_raytraced_scene_to_texture(renderer_engine_t *engine, camera_t *cam)
 {
-    GLuint framebuffer;
-    glGenFramebuffers(1, &framebuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, engine->render_texture, 0);
+    progressive_state_t *p = &engine->progressive;
+    int divisor = cam->is_moving ? MOVING_TEXTURE_DIVISOR : RENDER_TEXTURE_DIVISOR;
+    int width = engine->window_width / divisor > 1 ? engine->window_width / divisor : 1;
+    int height = engine->window_height / divisor > 1 ? engine->window_height / divisor : 1;
+    if (width != engine->render_texture_width || height != engine->render_texture_height)
+    {
+        engine_resize_render_texture(engine, width, height);
+        p->sample_count = 0;
+    }
+    if (engine_update_progressive_state(engine, cam))
+    {
+        p->sample_count = 0;
+    }
+    if (p->sample_count >= PROGRESSIVE_MAX_SAMPLES)
+    {
+        return; // converged: the texture already holds the final image
+    }
+
+    // The first sample goes through the pixel centre, later ones follow the R2 sequence over the
+    // pixel. Blending with weight 1/n keeps the texture equal to the mean of the n samples.
+    int n = p->sample_count++;
+    float jitter_x = n == 0 ? 0.5f : fmodf(0.5f + n * 0.7548776662f, 1.0f);
+    float jitter_y = n == 0 ? 0.5f : fmodf(0.5f + n * 0.5698402910f, 1.0f);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, engine->render_framebuffer);
 
     glViewport(0, 0, engine->render_texture_width, engine->render_texture_height);
     glUseProgram(engine->raytracer_shader_program);
@@ -652,39 +1584,35 @@ void engine_render_raytraced_scene_to_texture(renderer_engine_t *engine, camera_
     vector3_t right = vector3_normalize(vector3_cross(fwd, global_up));
     vector3_t up = vector3_cross(right, fwd);
 
-    glUniform3f(glGetUniformLocation(engine->raytracer_shader_program, "camPos"), pos.x, pos.y, pos.z);
-    glUniform3f(glGetUniformLocation(engine->raytracer_shader_program, "camRight"), right.x, right.y, right.z);
-    glUniform3f(glGetUniformLocation(engine->raytracer_shader_program, "camUp"), up.x, up.y, up.z);
-    glUniform3f(glGetUniformLocation(engine->raytracer_shader_program, "camForward"), fwd.x, fwd.y, fwd.z);
-    glUniform1f(glGetUniformLocation(engine->raytracer_shader_program, "tanHalfFov"), tanf(M_PI / 6.0f));
-    glUniform1f(glGetUniformLocation(engine->raytracer_shader_program, "aspect"), (float)engine->window_width / (float)engine->window_height);
-    glUniform1i(glGetUniformLocation(engine->raytracer_shader_program, "moving"), cam->is_moving ? 1 : 0);
-    glUniform2f(glGetUniformLocation(engine->raytracer_shader_program, "resolution"),
-                (float)engine->render_texture_width, (float)engine->render_texture_height);
-    glUniform1f(glGetUniformLocation(engine->raytracer_shader_program, "time"), (float)glfwGetTime());
-
-    float disk_inner_radius = BLACK_HOLE_SCHWARZSCHILD_RADIUS * 2.2f;
-    float disk_outer_radius = BLACK_HOLE_SCHWARZSCHILD_RADIUS * 5.2f;
-    glUniform1f(glGetUniformLocation(engine->raytracer_shader_program, "disk_r1"), disk_inner_radius);
-    glUniform1f(glGetUniformLocation(engine->raytracer_shader_program, "disk_r2"), disk_outer_radius);
-
-    glUniform1i(glGetUniformLocation(engine->raytracer_shader_program, "numObjects"), NUM_CELESTIAL_BODIES);
-    for (int i = 0; i < NUM_CELESTIAL_BODIES; ++i)
-    {
-        char uniform_name[64];
-        snprintf(uniform_name, sizeof(uniform_name), "objPosRadius[%d]", i);
-        glUniform4fv(glGetUniformLocation(engine->raytracer_shader_program, uniform_name), 1, &celestial_bodies[i].position_and_radius.x);
-        snprintf(uniform_name, sizeof(uniform_name), "objColor[%d]", i);
-        glUniform4fv(glGetUniformLocation(engine->raytracer_shader_program, uniform_name), 1, &celestial_bodies[i].color.x);
-        snprintf(uniform_name, sizeof(uniform_name), "objMass[%d]", i);
-        glUniform1f(glGetUniformLocation(engine->raytracer_shader_program, uniform_name), celestial_bodies[i].mass);
-    }
-    
+    const raytracer_uniforms_t *u = &engine->raytracer_uniforms;
+    glUniform3f(u->cam_pos, pos.x, pos.y, pos.z);
+    glUniform3f(u->cam_right, right.x, right.y, right.z);
+    glUniform3f(u->cam_up, up.x, up.y, up.z);
+    glUniform3f(u->cam_forward, fwd.x, fwd.y, fwd.z);
+    glUniform1f(u->aspect, (float)engine->window_width / (float)engine->window_height);
+    glUniform1i(u->moving, cam->is_moving ? 1 : 0);
+    glUniform2f(u->resolution, (float)engine->render_texture_width, (float)engine->render_texture_height);
+    glUniform1f(u->time, (float)animation_time);
+    glUniform1i(u->lookup, is_lookup_enabled ? 1 : 0);
+    glUniform2f(u->jitter, jitter_x, jitter_y);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, engine->deflection_path_texture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, engine->deflection_outcome_texture);
+    glActiveTexture(GL_TEXTURE0);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+    glBlendColor(0.0f, 0.0f, 0.0f, 1.0f / (float)(n + 1));
+    glDisable(GL_DEPTH_TEST);
+
     glBindVertexArray(engine->fullscreen_quad_vao);
     glDrawArrays(GL_TRIANGLES, 0, 6);
 
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDeleteFramebuffers(1, &framebuffer);
 }
 
 /**
@@ -697,10 +1625,9 @@ void engine_render_texture_to_screen(renderer_engine_t *engine)
     glUseProgram(engine->texture_quad_shader_program);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, engine->render_texture);
-    glUniform1i(glGetUniformLocation(engine->texture_quad_shader_program, "screenTexture"), 0);
 
     glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); // the raytracer writes premultiplied colour
     glDisable(GL_DEPTH_TEST);
     
     glBindVertexArray(engine->fullscreen_quad_vao);
@@ -773,6 +1700,22 @@ void callback_key(GLFWwindow *window, int key, int scancode, int action, int mod
             is_grid_visible = !is_grid_visible;
             printf("[INFO] Grid %s\n", is_grid_visible ? "visible" : "hidden");
             break;
+        case GLFW_KEY_L:
+            is_lookup_enabled = !is_lookup_enabled;
+            printf("[INFO] Ray paths %s\n", is_lookup_enabled ? "read from the deflection table" : "integrated per pixel");
+            break;
+        case GLFW_KEY_T:
+            is_frame_timing_enabled = !is_frame_timing_enabled;
+            printf("[INFO] Frame timing %s\n", is_frame_timing_enabled ? "enabled" : "disabled");
+            break;
+        case GLFW_KEY_B:
+            gravity_solver = gravity_solver == GRAVITY_SOLVER_DIRECT ? GRAVITY_SOLVER_BARNES_HUT : GRAVITY_SOLVER_DIRECT;
+            printf("[INFO] Gravity: %s\n", gravity_solver == GRAVITY_SOLVER_DIRECT ? "direct summation" : "Barnes-Hut octree");
+            break;
+        case GLFW_KEY_A:
+            is_progressive_enabled = !is_progressive_enabled;
+            printf("[INFO] Progressive accumulation %s\n", is_progressive_enabled ? "enabled" : "disabled");
+            break;
         }
     }
 }
@@ -782,13 +1725,38 @@ void callback_framebuffer_size(GLFWwindow *window, int width, int height)
     glViewport(0, 0, width, height);
     renderer_engine.window_width = width;
     renderer_engine.window_height = height;
+    // the render texture follows on the next frame, at the divisor for the camera's state
+}
 
-    renderer_engine.render_texture_width = width;
-    renderer_engine.render_texture_height = height;
-    glBindTexture(GL_TEXTURE_2D, renderer_engine.render_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, renderer_engine.render_texture_width, renderer_engine.render_texture_height,
-                 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glBindTexture(GL_TEXTURE_2D, 0);
+// FRAME TIMING
+
+/**
+ * @brief Adds one frame's phase times (from consecutive glfwGetTime stamps) and prints the
+ * per-frame averages once every FRAME_TIMING_REPORT_INTERVAL seconds. Swap includes waiting
+ * for v-sync and for the GPU, so the other columns are the CPU cost of issuing each phase.
+ */
+void frame_timing_record(frame_timing_t *timing, const double stamps[7])
+{
+    timing->physics += stamps[1] - stamps[0];
+    timing->grid_mesh += stamps[2] - stamps[1];
+    timing->grid_draw += stamps[3] - stamps[2];
+    timing->raytrace += stamps[4] - stamps[3];
+    timing->present += stamps[5] - stamps[4];
+    timing->swap += stamps[6] - stamps[5];
+    timing->total += stamps[6] - stamps[0];
+    timing->frames++;
+
+    if (stamps[6] - timing->interval_start < FRAME_TIMING_REPORT_INTERVAL) return;
+
+    if (is_frame_timing_enabled)
+    {
+        double scale = 1000.0 / timing->frames;
+        printf("[INFO] Frame %.2f ms: physics %.3f, grid mesh %.3f, grid draw %.3f, raytrace %.3f, present %.3f, swap %.2f (%d frames)\n",
+               timing->total * scale, timing->physics * scale, timing->grid_mesh * scale, timing->grid_draw * scale,
+               timing->raytrace * scale, timing->present * scale, timing->swap * scale, timing->frames);
+    }
+    memset(timing, 0, sizeof(*timing));
+    timing->interval_start = stamps[6];
 }
 
 // APPLICATION LIFECYCLE
@@ -823,8 +1791,8 @@ bool engine_initialize(renderer_engine_t *engine)
     glfwGetFramebufferSize(engine->window, &engine->window_width, &engine->window_height);
     glViewport(0, 0, engine->window_width, engine->window_height);
 
-    engine->render_texture_width = engine->window_width / 7; // low resolution to improve performance
-    engine->render_texture_height = engine->window_height / 7;
+    engine->render_texture_width = engine->window_width / RENDER_TEXTURE_DIVISOR;
+    engine->render_texture_height = engine->window_height / RENDER_TEXTURE_DIVISOR;
 
     glfwSwapInterval(1); // v-sync
 
@@ -838,6 +1806,10 @@ bool engine_initialize(renderer_engine_t *engine)
     printf("R: Reset Camera\n");
     printf("P: Pause/Resume Physics\n");
     printf("G: Toggle Spacetime Grid\n");
+    printf("L: Toggle Deflection Table Lookup\n");
+    printf("T: Toggle Frame Timing Report\n");
+    printf("B: Toggle Direct/Barnes-Hut Gravity\n");
+    printf("A: Toggle Progressive Accumulation\n");
     printf("ESC: Exit\n");
     printf("----------------\n");
 
@@ -851,7 +1823,18 @@ bool engine_initialize(renderer_engine_t *engine)
     }
 
     engine_init_fullscreen_quad(engine);
-    engine_init_render_texture(engine);
+    if (!engine_init_render_texture(engine) || !engine_init_uniforms(engine))
+    {
+        return false;
+    }
+
+    deflection_table_t deflection_table;
+    if (!deflection_table_init(&deflection_table))
+    {
+        return false;
+    }
+    engine_init_deflection_textures(engine, &deflection_table);
+    deflection_table_free(&deflection_table);
 
     glfwSetMouseButtonCallback(engine->window, callback_mouse_button);
     glfwSetCursorPosCallback(engine->window, callback_cursor_position);
@@ -871,6 +1854,10 @@ void engine_cleanup(renderer_engine_t *engine)
 {
     if (engine->fullscreen_quad_vao) glDeleteVertexArrays(1, &engine->fullscreen_quad_vao);
     if (engine->render_texture) glDeleteTextures(1, &engine->render_texture);
+    if (engine->render_framebuffer) glDeleteFramebuffers(1, &engine->render_framebuffer);
+    if (engine->bodies_uniform_buffer) glDeleteBuffers(1, &engine->bodies_uniform_buffer);
+    if (engine->deflection_path_texture) glDeleteTextures(1, &engine->deflection_path_texture);
+    if (engine->deflection_outcome_texture) glDeleteTextures(1, &engine->deflection_outcome_texture);
     if (engine->raytracer_shader_program) glDeleteProgram(engine->raytracer_shader_program);
     if (engine->grid_shader_program) glDeleteProgram(engine->grid_shader_program);
     if (engine->texture_quad_shader_program) glDeleteProgram(engine->texture_quad_shader_program);
@@ -888,8 +1875,52 @@ void engine_cleanup(renderer_engine_t *engine)
 /**
  * @brief Main entry point of the application.
  */
-int main()
+int main(int argc, char *argv[])
 {
+    int num_bodies = NUM_CELESTIAL_BODIES;
+    int solver_given = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--bodies") == 0 && i + 1 < argc)
+        {
+            num_bodies = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gravity") == 0 && i + 1 < argc && strcmp(argv[i + 1], "direct") == 0)
+        {
+            gravity_solver = GRAVITY_SOLVER_DIRECT;
+            solver_given = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--gravity") == 0 && i + 1 < argc && strcmp(argv[i + 1], "barnes-hut") == 0)
+        {
+            gravity_solver = GRAVITY_SOLVER_BARNES_HUT;
+            solver_given = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc)
+        {
+            gravity_theta = atof(argv[++i]);
+        }
+        else
+        {
+            printf("Usage: %s [--bodies N] [--gravity direct|barnes-hut] [--theta X]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_bodies < NUM_CELESTIAL_BODIES || gravity_theta <= 0.0)
+    {
+        printf("Need at least %d bodies and a positive opening angle\n", NUM_CELESTIAL_BODIES);
+        return EXIT_FAILURE;
+    }
+    if (!solver_given)
+    {
+        gravity_solver = num_bodies <= GRAVITY_DIRECT_MAX_BODIES ? GRAVITY_SOLVER_DIRECT : GRAVITY_SOLVER_BARNES_HUT;
+    }
+
+    simulation_initialize(num_bodies);
+    printf("[INFO] %d bodies, gravity: %s\n", num_bodies,
+           gravity_solver == GRAVITY_SOLVER_DIRECT ? "direct summation" : "Barnes-Hut octree");
+
     camera_reset(&camera);
 
     if (!engine_initialize(&renderer_engine))
@@ -900,18 +1931,24 @@ int main()
     grid_generate_mesh(&renderer_engine);
 
     double last_time = glfwGetTime();
+    frame_timing_t frame_timing = {.interval_start = last_time};
 
     while (!glfwWindowShouldClose(renderer_engine.window))
     {
         double current_time = glfwGetTime();
         double delta_time = current_time - last_time;
         last_time = current_time;
+        double stamps[7];
+        stamps[0] = current_time;
 
         simulation_update_physics(delta_time * 500.0); // speed up simulation time
+        stamps[1] = glfwGetTime();
         if (!is_physics_paused)
         {
+            animation_time += delta_time;
             grid_generate_mesh(&renderer_engine);
         }
+        stamps[2] = glfwGetTime();
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -921,14 +1958,20 @@ int main()
         matrix4_t view_projection_matrix = matrix4_multiply(projection_matrix, view_matrix);
 
         grid_render(&renderer_engine, view_projection_matrix);
+        stamps[3] = glfwGetTime();
         engine_render_raytraced_scene_to_texture(&renderer_engine, &camera);
+        stamps[4] = glfwGetTime();
         engine_render_texture_to_screen(&renderer_engine);
+        stamps[5] = glfwGetTime();
 
         glfwSwapBuffers(renderer_engine.window);
         glfwPollEvents();
+        stamps[6] = glfwGetTime();
+        frame_timing_record(&frame_timing, stamps);
     }
 
     engine_cleanup(&renderer_engine);
+    nbody_system_free(&nbody_system);
     return EXIT_SUCCESS;
 }
 
@@ -984,15 +2027,22 @@ const char *raytracer_fragment_shader_source =
     "uniform float disk_r1;\n"
     "uniform float disk_r2;\n"
     "uniform int numObjects;\n"
-    "uniform vec4 objPosRadius[16];\n"
-    "uniform vec4 objColor[16];\n"
-    "uniform float objMass[16];\n"
+    "layout(std140) uniform Bodies {\n"
+    "    vec4 objPosRadius[16];\n"
+    "    vec4 objColor[16];\n"
+    "};\n"
     "uniform vec2 resolution;\n"
     "uniform float time;\n"
+    "uniform bool lookup;\n"
+    "uniform vec2 jitter; // sample position inside the pixel, (0.5, 0.5) is the centre\n"
+    "uniform vec3 tableRange;\n"
+    "uniform sampler3D pathTable;\n"
+    "uniform sampler2D outcomeTable;\n"
     "\n"
     "const float blackhole = 1.269e10;\n"
     "float D_LAMBDA = 5e7;\n"
     "const float ESCAPE_R = 1e30;\n"
+    "const int TABLE_SAMPLES = 128;\n"
     "\n"
     "struct Ray {\n"
     "    float x, y, z, r, theta, phi;\n"
@@ -1031,8 +2081,8 @@ const char *raytracer_fragment_shader_source =
     "\n"
     "    ray.L = ray.r * ray.r * sin(ray.theta) * ray.dphi;\n"
     "    float f = 1.0 - blackhole / ray.r;\n"
-    "    float dt_dL = sqrt((ray.dr*ray.dr)/f + ray.r*ray.r*(ray.dtheta*ray.dtheta + sin(ray.theta)*sin(ray.theta)*ray.dphi*ray.dphi));\n"
-    "    ray.E = f * dt_dL;\n"
+    "    // Null condition: E^2 = dr^2 + f r^2 (dtheta^2 + sin^2 theta dphi^2)\n"
+    "    ray.E = sqrt(ray.dr*ray.dr + f*ray.r*ray.r*(ray.dtheta*ray.dtheta + sin(ray.theta)*sin(ray.theta)*ray.dphi*ray.dphi));\n"
     "\n"
     "    return ray;\n"
     "}\n"
@@ -1065,7 +2115,7 @@ const char *raytracer_fragment_shader_source =
     "    d1 = vec3(dr, dtheta, dphi);\n"
     "    d2.x = -(blackhole / (2.0 * r*r)) * f * dt_dL * dt_dL\n"
     "         + (blackhole / (2.0 * r*r * f)) * dr * dr\n"
-    "         + r * (dtheta*dtheta + sin(theta)*sin(theta)*dphi*dphi);\n"
+    "         + (r - blackhole) * (dtheta*dtheta + sin(theta)*sin(theta)*dphi*dphi);\n"
     "    d2.y = -2.0*dr*dtheta/r + sin(theta)*cos(theta)*dphi*dphi;\n"
     "    d2.z = -2.0*dr*dphi/r - 2.0*cos(theta)/(sin(theta)) * dtheta * dphi;\n"
     "}\n"
@@ -1086,6 +2136,31 @@ const char *raytracer_fragment_shader_source =
     "    ray.z = ray.r * cos(ray.theta);\n"
     "}\n"
     "\n"
+    "// First point where the segment a-b enters an object, as a fraction of the segment\n"
+    "bool segmentHitsObject(vec3 a, vec3 b, out float hitT) {\n"
+    "    vec3 ab = b - a;\n"
+    "    float len = length(ab);\n"
+    "    hitT = 2.0;\n"
+    "    if (len <= 0.0) return false;\n"
+    "    vec3 d = ab / len;\n"
+    "    for (int i = 0; i < numObjects; ++i) {\n"
+    "        vec3 oc = a - objPosRadius[i].xyz;\n"
+    "        float radius = objPosRadius[i].w;\n"
+    "        float b2 = dot(oc, d);\n"
+    "        float c = dot(oc, oc) - radius * radius;\n"
+    "        float disc = b2 * b2 - c;\n"
+    "        if (disc < 0.0) continue;\n"
+    "        float t = max(-b2 - sqrt(disc), 0.0) / len;\n"
+    "        if (t <= 1.0 && t < hitT && (c <= 0.0 || b2 < 0.0)) {\n"
+    "            hitT = t;\n"
+    "            hitObjectColor = objColor[i];\n"
+    "            hitCenter = objPosRadius[i].xyz;\n"
+    "            hitRadius = radius;\n"
+    "        }\n"
+    "    }\n"
+    "    return hitT <= 1.0;\n"
+    "}\n"
+    "\n"
     "bool crossesEquatorialPlane(vec3 oldPos, vec3 newPos) {\n"
     "    bool crossed = (oldPos.y * newPos.y < 0.0);\n"
     "    float r = length(vec2(newPos.x, newPos.z));\n"
@@ -1093,10 +2168,10 @@ const char *raytracer_fragment_shader_source =
     "}\n"
     "\n"
     "void main() {\n"
-    "    vec2 pix = gl_FragCoord.xy;\n"
+    "    vec2 pix = floor(gl_FragCoord.xy) + jitter;\n"
     "\n"
-    "    float u = (2.0 * (pix.x + 0.5) / resolution.x - 1.0) * aspect * tanHalfFov;\n"
-    "    float v = (1.0 - 2.0 * (pix.y + 0.5) / resolution.y) * tanHalfFov;\n"
+    "    float u = (2.0 * pix.x / resolution.x - 1.0) * aspect * tanHalfFov;\n"
+    "    float v = (1.0 - 2.0 * pix.y / resolution.y) * tanHalfFov;\n"
     "    vec3 dir = normalize(u * camRight - v * camUp + camForward);\n"
     "    Ray ray = initRay(camPos, dir);\n"
     "\n"
@@ -1108,6 +2183,58 @@ const char *raytracer_fragment_shader_source =
     "    bool hitObject = false;\n"
     "\n"
     "    int steps = moving ? 25000 : 26000;\n"
+    "    float r0 = length(camPos) / blackhole;\n"
+    "    if (lookup && r0 > tableRange.x && r0 < tableRange.y) {\n"
+    "        // The ray stays in the plane through the hole spanned by camPos and dir\n"
+    "        vec3 e1 = camPos / length(camPos);\n"
+    "        float cosAlpha = clamp(dot(dir, e1), -1.0, 1.0);\n"
+    "        vec3 perp = dir - cosAlpha * e1;\n"
+    "        vec3 other = abs(e1.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);\n"
+    "        vec3 e2 = length(perp) > 1e-6 ? normalize(perp) : normalize(cross(e1, other));\n"
+    "        vec2 cell = vec2(acos(cosAlpha) / 3.14159265, log(r0 / tableRange.x) / log(tableRange.y / tableRange.x));\n"
+    "        vec3 outcome = texture(outcomeTable, cell).rgb;\n"
+    "        float spacing = tableRange.z / float(TABLE_SAMPLES);\n"
+    "        bool escaped = outcome.g < 0.5;\n"
+    "        float hitT;\n"
+    "\n"
+    "        // March the stored path sample by sample instead of integrating it\n"
+    "        for (int k = 0; k < TABLE_SAMPLES; ++k) {\n"
+    "            float phi = (float(k) + 0.5) * spacing;\n"
+    "            if (phi > outcome.b) break;\n"
+    "            float invR = texture(pathTable, vec3((float(k) + 0.5) / float(TABLE_SAMPLES), cell)).r;\n"
+    "            if (invR >= 0.999) { hitBlackHole = true; break; }\n"
+    "            if (invR < 1e-4) break;\n"
+    "            vec3 newPos = (blackhole / invR) * (cos(phi) * e1 + sin(phi) * e2);\n"
+    "            if (prevPos.y * newPos.y < 0.0) {\n"
+    "                vec3 hit = mix(prevPos, newPos, prevPos.y / (prevPos.y - newPos.y));\n"
+    "                float hitR = length(vec2(hit.x, hit.z));\n"
+    "                if (hitR >= disk_r1 && hitR <= disk_r2) { ray.x = hit.x; ray.y = hit.y; ray.z = hit.z; hitDisk = true; break; }\n"
+    "            }\n"
+    "            if (segmentHitsObject(prevPos, newPos, hitT)) {\n"
+    "                vec3 hit = mix(prevPos, newPos, hitT);\n"
+    "                ray.x = hit.x; ray.y = hit.y; ray.z = hit.z; hitObject = true; break;\n"
+    "            }\n"
+    "            prevPos = newPos;\n"
+    "        }\n"
+    "        if (!hitDisk && !hitObject && !hitBlackHole) {\n"
+    "            if (!escaped) {\n"
+    "                hitBlackHole = true;\n"
+    "            } else {\n"
+    "                // Past the last sample the ray runs straight along its escape direction\n"
+    "                dir = cos(outcome.r) * e1 + sin(outcome.r) * e2;\n"
+    "                vec3 farPos = prevPos + dir * blackhole * 1000.0;\n"
+    "                vec3 hit = mix(prevPos, farPos, prevPos.y / (prevPos.y - farPos.y));\n"
+    "                float hitR = length(vec2(hit.x, hit.z));\n"
+    "                if (prevPos.y * farPos.y < 0.0 && hitR >= disk_r1 && hitR <= disk_r2) {\n"
+    "                    ray.x = hit.x; ray.y = hit.y; ray.z = hit.z; hitDisk = true;\n"
+    "                } else if (segmentHitsObject(prevPos, farPos, hitT)) {\n"
+    "                    hit = mix(prevPos, farPos, hitT);\n"
+    "                    ray.x = hit.x; ray.y = hit.y; ray.z = hit.z; hitObject = true;\n"
+    "                }\n"
+    "            }\n"
+    "        }\n"
+    "        steps = 0;\n"
+    "    }\n"
     "\n"
     "    for (int i = 0; i < steps; ++i) {\n"
     "        if (intercept(ray, blackhole)) { hitBlackHole = true; break; }\n"
@@ -1157,5 +2284,5 @@ const char *raytracer_fragment_shader_source =
     "        color = getStarColor(dir);\n"
     "    }\n"
     "\n"
-    "    FragColor = color;\n"
+    "    FragColor = vec4(color.rgb * color.a, color.a);\n"
     "}\n";
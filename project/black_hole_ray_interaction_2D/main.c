@@ -3,6 +3,11 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define NUM_PHOTONS 100
 #define TIME_STEP 0.3
@@ -10,6 +15,12 @@
 #define STEPS_PER_FRAME 5
 #define PHOTON_SPHERE_FACTOR 1.5
 #define EVENT_HORIZON_FACTOR 1.0
+#define RK45_MAX_ATTEMPTS 64
+#define DEFAULT_TOLERANCE 1e-6
+#define ENSEMBLE_CHUNK 256            // photons claimed by a worker at a time
+#define ENSEMBLE_STEP_FRACTION 0.005  // ensemble step size as a fraction of r
+#define ENSEMBLE_MAX_STEPS 200000     // photons still orbiting after this many steps count as captured
+#define ENSEMBLE_DEFAULT_DISTANCE 500.0
 
 typedef struct {
     double x, y, z;
@@ -27,6 +38,7 @@ typedef struct {
     double energy;
     double angular_momentum;
     double x, y;
+    double step_size;      // last step the adaptive integrator settled on
     
     Vector3 trail[MAX_TRAIL_POINTS];
     int trail_head;
@@ -42,23 +54,97 @@ typedef struct {
     int num_active;
 } PhotonArray;
 
+typedef enum {
+    INTEGRATOR_RK4,
+    INTEGRATOR_RK45
+} Integrator;
+
+// Photons of a batch run: geodesic state in one array per field, and the outcome of each photon
+typedef struct {
+    int count;
+    double *r, *phi;
+    double *dt_dtau, *dr_dtau, *dphi_dtau;
+    double *impact_parameter;
+    double *escape_angle;  // direction of travel when leaving, in (-pi, pi]
+    double *deflection;    // total turn of the direction of travel, may exceed pi for looping photons
+    unsigned char *captured;
+} PhotonEnsemble;
+
+typedef struct {
+    PhotonEnsemble *ensemble;
+    const BlackHole *bh;
+    double escape_radius;
+    int num_chunks;
+    atomic_int next_chunk;
+    atomic_llong evaluations;
+} EnsembleJob;
+
 void initializeBlackHole(BlackHole *bh, double mass, double center_x, double center_y);
+void initialGeodesicState(double x0, double y0, double vx, double vy, const BlackHole *bh,
+                         double *r, double *phi, double *dt_dtau, double *dr_dtau, double *dphi_dtau);
 void initializePhoton(Photon *photon, double x0, double y0, double vx, double vy, const BlackHole *bh);
 void computeConservedQuantities(Photon *photon, const BlackHole *bh);
+void schwarzschildAccelerations(double r, double rs, double dt_dtau, double dr_dtau, double dphi_dtau,
+                                double *dt_dtau_dot, double *dr_dtau_dot, double *dphi_dtau_dot);
 void geodesicDerivatives(const Photon *photon, const BlackHole *bh, 
                         double *dt_dtau_dot, double *dr_dtau_dot, 
                         double *dtheta_dtau_dot, double *dphi_dtau_dot);
 void rungeKutta4Step(Photon *photon, const BlackHole *bh, double h);
+int dormandPrinceStep(Photon *photon, const BlackHole *bh, double h, double tolerance);
 void updateCartesianCoordinates(Photon *photon, const BlackHole *bh);
 void addToTrail(Photon *photon);
 int checkPhotonStatus(Photon *photon, const BlackHole *bh);
 
+int runEnsemble(int count, double b_min, double b_max, double distance, int num_threads, const char *output);
+void *ensembleWorker(void *arg);
+long integrateEnsemblePhoton(PhotonEnsemble *ensemble, int i, const BlackHole *bh, double escape_radius);
+double nowSeconds(void);
+
 void drawBlackHole(const BlackHole *bh);
 void drawPhoton(const Photon *photon);
 void drawPhotonTrail(const Photon *photon);
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 
-int main(void) {
+int main(int argc, char *argv[]) {
+    Integrator integrator = INTEGRATOR_RK4;
+    double tolerance = DEFAULT_TOLERANCE;
+    int ensemble = 0;
+    double b_min = 0.0, b_max = 10.0;
+    double distance = ENSEMBLE_DEFAULT_DISTANCE;
+    int num_threads = 0;
+    const char *output = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+            integrator = strcmp(argv[++i], "rk45") == 0 ? INTEGRATOR_RK45 : INTEGRATOR_RK4;
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc) {
+            ensemble = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--b-min") == 0 && i + 1 < argc) {
+            b_min = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--b-max") == 0 && i + 1 < argc) {
+            b_max = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--distance") == 0 && i + 1 < argc) {
+            distance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            printf("Usage: %s [--integrator rk4|rk45] [--tolerance X]\n"
+                   "       %s --ensemble N [--b-min B] [--b-max B] [--distance D] [--threads N] [--output FILE]\n",
+                   argv[0], argv[0]);
+            return -1;
+        }
+    }
+    if (tolerance <= 0) {
+        printf("Tolerance must be positive\n");
+        return -1;
+    }
+    if (ensemble > 0) {
+        return runEnsemble(ensemble, b_min, b_max, distance, num_threads, output);
+    }
+
     if (!glfwInit())
         return -1;
 
@@ -104,6 +190,11 @@ int main(void) {
     printf("Black hole mass: %.2f, Schwarzschild radius: %.2f\n", 
            blackhole.mass/scale, blackhole.rs/scale);
     printf("Photon sphere radius: %.2f\n", blackhole.rs * PHOTON_SPHERE_FACTOR/scale);
+    printf("Integrator: %s (K to switch)\n", integrator == INTEGRATOR_RK45 ? "adaptive RK45" : "RK4");
+
+    long evaluations = 0;
+    int reported = 0;
+    int k_was_down = 0;
 
     while (!glfwWindowShouldClose(window)) {
         glClearColor(0.05f, 0.05f, 0.1f, 1.0f);
@@ -119,7 +210,16 @@ int main(void) {
                 initializePhoton(&photons.photons[i], x_start, y_start, 1.0, 0.0, &blackhole);
             }
             photons.num_active = NUM_PHOTONS;
+            evaluations = 0;
+            reported = 0;
+        }
+
+        int k_down = glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS;
+        if (k_down && !k_was_down) {
+            integrator = integrator == INTEGRATOR_RK4 ? INTEGRATOR_RK45 : INTEGRATOR_RK4;
+            printf("Integrator: %s\n", integrator == INTEGRATOR_RK45 ? "adaptive RK45" : "RK4");
         }
+        k_was_down = k_down;
 
         drawBlackHole(&blackhole);
 
@@ -127,10 +227,27 @@ int main(void) {
         for (int i = 0; i < NUM_PHOTONS; i++) {
             Photon *p = &photons.photons[i];
             
-            if (p->active) {
+            if (p->active && integrator == INTEGRATOR_RK45) {
+                // Cover the same interval as the fixed steps, in as many steps as the tolerance needs
+                double remaining = STEPS_PER_FRAME * TIME_STEP;
+                for (int attempt = 0; remaining > 0.0 && attempt < RK45_MAX_ATTEMPTS; attempt++) {
+                    double h = fmin(p->step_size, remaining);
+                    evaluations += 7;
+                    if (dormandPrinceStep(p, &blackhole, h, tolerance)) {
+                        remaining -= h;
+                        updateCartesianCoordinates(p, &blackhole);
+                        addToTrail(p);
+
+                        if (!checkPhotonStatus(p, &blackhole)) {
+                            break;
+                        }
+                    }
+                }
+            } else if (p->active) {
                 for (int step = 0; step < STEPS_PER_FRAME; step++) {
                     if (p->active) {
                         rungeKutta4Step(p, &blackhole, TIME_STEP);
+                        evaluations += 4;
                         updateCartesianCoordinates(p, &blackhole);
                         
                         if (step % 2 == 0) {
@@ -142,10 +259,10 @@ int main(void) {
                         }
                     }
                 }
-                
-                if (p->active) {
-                    photons.num_active++;
-                }
+            }
+
+            if (p->active) {
+                photons.num_active++;
             }
             
             drawPhotonTrail(p);
@@ -154,6 +271,11 @@ int main(void) {
             }
         }
 
+        if (photons.num_active == 0 && !reported) {
+            printf("All photons settled after %ld derivative evaluations\n", evaluations);
+            reported = 1;
+        }
+
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
@@ -171,17 +293,14 @@ void initializeBlackHole(BlackHole *bh, double mass, double center_x, double cen
     bh->position.z = 0.0;
 }
 
-void initializePhoton(Photon *photon, double x0, double y0, double vx, double vy, const BlackHole *bh) {
+// Polar position and geodesic velocities of a photon leaving (x0, y0) in direction (vx, vy)
+void initialGeodesicState(double x0, double y0, double vx, double vy, const BlackHole *bh,
+                         double *r, double *phi, double *dt_dtau, double *dr_dtau, double *dphi_dtau) {
     double dx = x0 - bh->position.x;
     double dy = y0 - bh->position.y;
     
-    photon->r = sqrt(dx*dx + dy*dy);
-    photon->phi = atan2(dy, dx);
-    photon->theta = M_PI/2.0;  // equatorial plane
-    photon->t = 0.0;
-    
-    photon->x = x0;
-    photon->y = y0;
+    *r = sqrt(dx*dx + dy*dy);
+    *phi = atan2(dy, dx);
     
     double v_mag = sqrt(vx*vx + vy*vy);
     if (v_mag > 0) {
@@ -189,21 +308,30 @@ void initializePhoton(Photon *photon, double x0, double y0, double vx, double vy
         vy /= v_mag;
     }
     
-    double r = photon->r;
-    double cos_phi = cos(photon->phi);
-    double sin_phi = sin(photon->phi);
+    double cos_phi = cos(*phi);
+    double sin_phi = sin(*phi);
     
     double vr = vx * cos_phi + vy * sin_phi;
-    double vphi = (-vx * sin_phi + vy * cos_phi) / r;
+    double vphi = (-vx * sin_phi + vy * cos_phi) / *r;
     
-    double f = 1.0 - bh->rs/r;
+    // Null condition -f t'^2 + r'^2/f + r^2 phi'^2 = 0 fixes E = f t'
+    double f = 1.0 - bh->rs / *r;
+    double energy = sqrt(vr*vr + f * *r * *r * vphi*vphi);
     
-    photon->energy = sqrt(f + vr*vr/f + r*r*vphi*vphi);
-    
-    photon->dt_dtau = photon->energy / f;
-    photon->dr_dtau = vr;
+    *dt_dtau = energy / f;
+    *dr_dtau = vr;
+    *dphi_dtau = vphi;
+}
+
+void initializePhoton(Photon *photon, double x0, double y0, double vx, double vy, const BlackHole *bh) {
+    initialGeodesicState(x0, y0, vx, vy, bh, &photon->r, &photon->phi,
+                         &photon->dt_dtau, &photon->dr_dtau, &photon->dphi_dtau);
+    photon->theta = M_PI/2.0;  // equatorial plane
+    photon->t = 0.0;
     photon->dtheta_dtau = 0.0;
-    photon->dphi_dtau = vphi;
+    
+    photon->x = x0;
+    photon->y = y0;
     
     computeConservedQuantities(photon, bh);
     
@@ -213,6 +341,7 @@ void initializePhoton(Photon *photon, double x0, double y0, double vx, double vy
         photon->trail[i] = (Vector3){x0, y0, 0.0};
     }
     
+    photon->step_size = TIME_STEP;
     photon->active = 1;
     photon->escaped = 0;
     photon->captured = 0;
@@ -226,25 +355,16 @@ void computeConservedQuantities(Photon *photon, const BlackHole *bh) {
     photon->angular_momentum = r * r * photon->dphi_dtau;
 }
 
-void geodesicDerivatives(const Photon *photon, const BlackHole *bh,
-                        double *dt_dtau_dot, double *dr_dtau_dot, 
-                        double *dtheta_dtau_dot, double *dphi_dtau_dot) {
-    
-    double r = photon->r;
-    double rs = bh->rs;
-    
+void schwarzschildAccelerations(double r, double rs, double dt_dtau, double dr_dtau, double dphi_dtau,
+                                double *dt_dtau_dot, double *dr_dtau_dot, double *dphi_dtau_dot) {
     if (r <= rs * 1.001) {
         *dt_dtau_dot = 0.0;
         *dr_dtau_dot = 0.0;
-        *dtheta_dtau_dot = 0.0;
         *dphi_dtau_dot = 0.0;
         return;
     }
     
     double f = 1.0 - rs/r;
-    double dt_dtau = photon->dt_dtau;
-    double dr_dtau = photon->dr_dtau;
-    double dphi_dtau = photon->dphi_dtau;
     
     // Christoffel symbols for Schwarzschild metric
     double Gamma_t_tr = rs / (2.0 * r * r * f);
@@ -261,11 +381,17 @@ void geodesicDerivatives(const Photon *photon, const BlackHole *bh,
                    - Gamma_r_rr * dr_dtau * dr_dtau
                    - Gamma_r_phiphi * dphi_dtau * dphi_dtau;
     
-    *dtheta_dtau_dot = 0.0;  // Motion confined to equatorial plane
-    
     *dphi_dtau_dot = -2.0 * Gamma_phi_rphi * dr_dtau * dphi_dtau;
 }
 
+void geodesicDerivatives(const Photon *photon, const BlackHole *bh,
+                        double *dt_dtau_dot, double *dr_dtau_dot, 
+                        double *dtheta_dtau_dot, double *dphi_dtau_dot) {
+    schwarzschildAccelerations(photon->r, bh->rs, photon->dt_dtau, photon->dr_dtau, photon->dphi_dtau,
+                               dt_dtau_dot, dr_dtau_dot, dphi_dtau_dot);
+    *dtheta_dtau_dot = 0.0;  // Motion confined to equatorial plane
+}
+
 void rungeKutta4Step(Photon *photon, const BlackHole *bh, double h) {
     double t0 = photon->t;
     double r0 = photon->r;
@@ -350,6 +476,98 @@ void rungeKutta4Step(Photon *photon, const BlackHole *bh, double h) {
     photon->dphi_dtau += h * (k1_dphi_dtau + 2*k2_dphi_dtau + 2*k3_dphi_dtau + k4_dphi_dtau) / 6.0;
 }
 
+// Dormand-Prince 5(4) tableau; the last row is also the 5th-order weights
+static const double DP_A[7][6] = {
+    {0},
+    {1.0/5.0},
+    {3.0/40.0, 9.0/40.0},
+    {44.0/45.0, -56.0/15.0, 32.0/9.0},
+    {19372.0/6561.0, -25360.0/2187.0, 64448.0/6561.0, -212.0/729.0},
+    {9017.0/3168.0, -355.0/33.0, 46732.0/5247.0, 49.0/176.0, -5103.0/18656.0},
+    {35.0/384.0, 0.0, 500.0/1113.0, 125.0/192.0, -2187.0/6784.0, 11.0/84.0}
+};
+// 5th-order minus 4th-order weights, for the error estimate
+static const double DP_E[7] = {71.0/57600.0, 0.0, -71.0/16695.0, 71.0/1920.0, -17253.0/339200.0, 22.0/525.0, -1.0/40.0};
+
+static void photonFields(const Photon *photon, double *y) {
+    y[0] = photon->t;
+    y[1] = photon->r;
+    y[2] = photon->theta;
+    y[3] = photon->phi;
+    y[4] = photon->dt_dtau;
+    y[5] = photon->dr_dtau;
+    y[6] = photon->dtheta_dtau;
+    y[7] = photon->dphi_dtau;
+}
+
+static void setPhotonFields(Photon *photon, const double *y) {
+    photon->t = y[0];
+    photon->r = y[1];
+    photon->theta = y[2];
+    photon->phi = y[3];
+    photon->dt_dtau = y[4];
+    photon->dr_dtau = y[5];
+    photon->dtheta_dtau = y[6];
+    photon->dphi_dtau = y[7];
+}
+
+static void photonDerivatives(const Photon *photon, const BlackHole *bh, double *k) {
+    k[0] = photon->dt_dtau;
+    k[1] = photon->dr_dtau;
+    k[2] = photon->dtheta_dtau;
+    k[3] = photon->dphi_dtau;
+    geodesicDerivatives(photon, bh, &k[4], &k[5], &k[6], &k[7]);
+}
+
+/*
+ * One Dormand-Prince attempt of size h. If the embedded error estimate is within
+ * tolerance the photon is advanced and 1 is returned; otherwise it is left alone
+ * and 0 is returned. Either way photon->step_size is updated for the next try.
+ */
+int dormandPrinceStep(Photon *photon, const BlackHole *bh, double h, double tolerance) {
+    double y[8], k[7][8];
+    photonFields(photon, y);
+    photonDerivatives(photon, bh, k[0]);
+
+    Photon temp = *photon;
+    double z[8];
+    for (int stage = 1; stage < 7; stage++) {
+        for (int f = 0; f < 8; f++) {
+            z[f] = y[f];
+            for (int j = 0; j < stage; j++) {
+                z[f] += h * DP_A[stage][j] * k[j][f];
+            }
+        }
+        setPhotonFields(&temp, z);
+        photonDerivatives(&temp, bh, k[stage]);
+    }
+
+    // t grows without bound, so it is left out of the error norm
+    double error = 0.0;
+    for (int f = 1; f < 8; f++) {
+        double e = 0.0;
+        for (int j = 0; j < 7; j++) {
+            e += DP_E[j] * k[j][f];
+        }
+        double scale = tolerance * (1.0 + fmax(fabs(y[f]), fabs(z[f])));
+        error = fmax(error, fabs(h * e) / scale);
+    }
+
+    double factor = error > 0.0 ? 0.9 * pow(error, -0.2) : 5.0;
+    factor = fmin(5.0, fmax(0.2, factor));
+
+    // Steps that have shrunk to nothing are taken anyway rather than stalling the photon
+    int accept = error <= 1.0 || h <= TIME_STEP * 1e-6;
+    if (accept) {
+        setPhotonFields(photon, z);
+        // A step cut short by the caller says nothing about how large the next one could be
+        photon->step_size = h < photon->step_size ? fmax(photon->step_size, h * factor) : h * factor;
+    } else {
+        photon->step_size = h * factor;
+    }
+    return accept;
+}
+
 void updateCartesianCoordinates(Photon *photon, const BlackHole *bh) {
     photon->x = bh->position.x + photon->r * cos(photon->phi);
     photon->y = bh->position.y + photon->r * sin(photon->phi);
@@ -379,6 +597,187 @@ int checkPhotonStatus(Photon *photon, const BlackHole *bh) {
     return 1;
 }
 
+double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Batch mode: photons start `distance` Schwarzschild radii to the left of the hole travelling
+ * in +x, with impact parameters evenly spread over [b_min, b_max] (also in rs). They are
+ * integrated on num_threads workers without a window, and each photon's outcome is written
+ * to `output` as CSV (or only summarised when output is NULL).
+ */
+int runEnsemble(int count, double b_min, double b_max, double distance, int num_threads, const char *output) {
+    if (distance <= 1.0 || b_max < b_min) {
+        printf("Need a distance above 1 rs and b-max >= b-min\n");
+        return -1;
+    }
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    BlackHole bh;
+    initializeBlackHole(&bh, 1.0, 0.0, 0.0);
+
+    PhotonEnsemble ensemble;
+    ensemble.count = count;
+    double **fields[] = {&ensemble.r, &ensemble.phi, &ensemble.dt_dtau, &ensemble.dr_dtau, &ensemble.dphi_dtau,
+                         &ensemble.impact_parameter, &ensemble.escape_angle, &ensemble.deflection};
+    for (int f = 0; f < 8; f++) {
+        *fields[f] = malloc(count * sizeof(double));
+        if (!*fields[f]) {
+            printf("Unable to allocate state for %d photons\n", count);
+            return -1;
+        }
+    }
+    ensemble.captured = calloc(count, 1);
+    if (!ensemble.captured) {
+        printf("Unable to allocate state for %d photons\n", count);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        double b = count > 1 ? b_min + (b_max - b_min) * i / (count - 1) : b_min;
+        ensemble.impact_parameter[i] = b;
+        initialGeodesicState(-distance * bh.rs, b * bh.rs, 1.0, 0.0, &bh, &ensemble.r[i], &ensemble.phi[i],
+                             &ensemble.dt_dtau[i], &ensemble.dr_dtau[i], &ensemble.dphi_dtau[i]);
+    }
+
+    EnsembleJob job;
+    job.ensemble = &ensemble;
+    job.bh = &bh;
+    job.escape_radius = distance * bh.rs;
+    job.num_chunks = (count + ENSEMBLE_CHUNK - 1) / ENSEMBLE_CHUNK;
+    atomic_store(&job.next_chunk, 0);
+    atomic_store(&job.evaluations, 0);
+    if (num_threads > job.num_chunks)
+        num_threads = job.num_chunks;
+
+    double start = nowSeconds();
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    for (int t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, ensembleWorker, &job);
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+    double seconds = nowSeconds() - start;
+
+    // The shadow edge lies between the widest captured photon and the next one out
+    int num_captured = 0;
+    double edge_in = -1.0, edge_out = -1.0;
+    for (int i = 0; i < count; i++) {
+        double b = fabs(ensemble.impact_parameter[i]);
+        if (ensemble.captured[i]) {
+            num_captured++;
+            edge_in = fmax(edge_in, b);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        double b = fabs(ensemble.impact_parameter[i]);
+        if (!ensemble.captured[i] && b > edge_in && (edge_out < 0.0 || b < edge_out))
+            edge_out = b;
+    }
+
+    long long evaluations = atomic_load(&job.evaluations);
+    printf("Integrated %d photons in %.2f s on %d threads (%.0f photons/s, %.1f M derivative evaluations)\n",
+           count, seconds, num_threads, count / seconds, evaluations / 1e6);
+    printf("Captured %d, escaped %d\n", num_captured, count - num_captured);
+    if (edge_in >= 0.0 && edge_out >= 0.0) {
+        printf("Shadow edge between b = %.5f and %.5f rs (critical impact parameter 3*sqrt(3)/2 = %.5f rs)\n",
+               edge_in, edge_out, 1.5 * sqrt(3.0));
+    }
+
+    int status = 0;
+    if (output) {
+        FILE *file = fopen(output, "w");
+        if (!file) {
+            printf("Unable to write %s\n", output);
+            status = -1;
+        } else {
+            fprintf(file, "impact_parameter,captured,escape_angle,deflection\n");
+            for (int i = 0; i < count; i++) {
+                if (ensemble.captured[i])
+                    fprintf(file, "%.9g,1,,\n", ensemble.impact_parameter[i]);
+                else
+                    fprintf(file, "%.9g,0,%.9g,%.9g\n", ensemble.impact_parameter[i],
+                            ensemble.escape_angle[i], ensemble.deflection[i]);
+            }
+            fclose(file);
+            printf("Wrote %s\n", output);
+        }
+    }
+
+    for (int f = 0; f < 8; f++)
+        free(*fields[f]);
+    free(ensemble.captured);
+    return status;
+}
+
+void *ensembleWorker(void *arg) {
+    EnsembleJob *job = arg;
+    long long evaluations = 0;
+    for (int chunk = atomic_fetch_add(&job->next_chunk, 1); chunk < job->num_chunks;
+         chunk = atomic_fetch_add(&job->next_chunk, 1)) {
+        int end = (chunk + 1) * ENSEMBLE_CHUNK;
+        if (end > job->ensemble->count)
+            end = job->ensemble->count;
+        for (int i = chunk * ENSEMBLE_CHUNK; i < end; i++)
+            evaluations += integrateEnsemblePhoton(job->ensemble, i, job->bh, job->escape_radius);
+    }
+    atomic_fetch_add(&job->evaluations, evaluations);
+    return NULL;
+}
+
+/*
+ * Follows photon i with RK4 steps of ENSEMBLE_STEP_FRACTION * r (long strides far out, fine ones
+ * near the photon sphere) until it falls to 1.01 rs or heads out past escape_radius, and records
+ * the outcome. Returns the number of derivative evaluations.
+ */
+long integrateEnsemblePhoton(PhotonEnsemble *ensemble, int i, const BlackHole *bh, double escape_radius) {
+    double y[5] = {ensemble->r[i], ensemble->phi[i], ensemble->dt_dtau[i], ensemble->dr_dtau[i], ensemble->dphi_dtau[i]};
+    // Direction of travel, continuous because dphi keeps its sign (angular momentum is conserved)
+    double heading = y[1] + atan2(y[0] * y[4], y[3]);
+    double k[4][5], z[5];
+    static const double stage[4] = {0.0, 0.5, 0.5, 1.0};
+    long steps = 0;
+
+    ensemble->captured[i] = 1;
+    for (; steps < ENSEMBLE_MAX_STEPS; steps++) {
+        if (y[0] <= bh->rs * 1.01)
+            break;
+        if (y[0] > escape_radius && y[3] > 0.0) {
+            ensemble->captured[i] = 0;
+            break;
+        }
+
+        double h = ENSEMBLE_STEP_FRACTION * y[0];
+        for (int s = 0; s < 4; s++) {
+            for (int f = 0; f < 5; f++)
+                z[f] = s == 0 ? y[f] : y[f] + stage[s] * h * k[s - 1][f];
+            k[s][0] = z[3];
+            k[s][1] = z[4];
+            schwarzschildAccelerations(z[0], bh->rs, z[2], z[3], z[4], &k[s][2], &k[s][3], &k[s][4]);
+        }
+        for (int f = 0; f < 5; f++)
+            y[f] += h * (k[0][f] + 2.0 * k[1][f] + 2.0 * k[2][f] + k[3][f]) / 6.0;
+    }
+
+    ensemble->r[i] = y[0];
+    ensemble->phi[i] = y[1];
+    ensemble->dt_dtau[i] = y[2];
+    ensemble->dr_dtau[i] = y[3];
+    ensemble->dphi_dtau[i] = y[4];
+    if (!ensemble->captured[i]) {
+        double final_heading = y[1] + atan2(y[0] * y[4], y[3]);
+        ensemble->escape_angle[i] = atan2(sin(final_heading), cos(final_heading));
+        ensemble->deflection[i] = fabs(final_heading - heading);
+    }
+    return 4 * steps;
+}
+
 void drawBlackHole(const BlackHole *bh) {
     double rs = bh->rs;
     
@@ -0,0 +1,671 @@
+// Ray state and geodesic integrators shared by the interactive simulator (main.c) and the
+// headless renderer (render.c). Include from exactly one translation unit per program.
+#ifndef GEODESIC_H
+#define GEODESIC_H
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define C_SPEED 1.0
+#define TIME_STEP 0.05
+#define RAY_CHUNK 256
+#define RK45_MAX_ATTEMPTS 64
+#define DEFAULT_TOLERANCE 1e-6
+
+// Rays advanced together by the integrator, picked from the widest vector unit enabled at compile time
+#ifndef RAY_LANES
+#if defined(__AVX512F__)
+#define RAY_LANES 8
+#elif defined(__AVX2__)
+#define RAY_LANES 4
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define RAY_LANES 2
+#else
+#define RAY_LANES 1
+#endif
+#endif
+
+typedef struct
+{
+    double x, y, z;
+} Vector3;
+
+typedef struct
+{
+    Vector3 position;
+    double schwarzschild_radius;
+    double mass;
+} BlackHole;
+
+typedef struct
+{
+    float r, g, b, a;
+} Color;
+
+typedef struct
+{
+    Vector3 position;
+    Vector3 direction;
+    Color color;
+    int active;
+    int absorbed;  // flag to indicate if ray was absorbed
+    int fade_timer; // timer for fading out trail after absorption
+} Ray;
+
+// Geodesic state of every ray, one array per field so RAY_LANES rays load as one vector
+typedef struct
+{
+    double *r, *theta, *phi;
+    double *dr, *dtheta, *dphi;
+    double *energy;
+    double *angular_momentum;
+    double *step_size; // last step the adaptive integrator settled on
+} RayStates;
+
+typedef struct
+{
+    double r, theta, phi;
+    double dr, dtheta, dphi;
+    double energy;
+    double angular_momentum;
+} State;
+
+RayStates allocRayStates(int num_rays)
+{
+    // Pad to whole chunks so the last vector group never reads past the end
+    size_t padded = ((size_t)num_rays + RAY_CHUNK - 1) / RAY_CHUNK * RAY_CHUNK;
+    size_t bytes = padded * sizeof(double);
+    RayStates states;
+    double **fields[] = {&states.r, &states.theta, &states.phi, &states.dr, &states.dtheta, &states.dphi,
+                         &states.energy, &states.angular_momentum, &states.step_size};
+    for (int f = 0; f < 9; f++)
+    {
+        *fields[f] = aligned_alloc(64, bytes);
+        if (!*fields[f])
+        {
+            printf("Unable to allocate state for %d rays\n", num_rays);
+            exit(EXIT_FAILURE);
+        }
+        memset(*fields[f], 0, bytes);
+    }
+    return states;
+}
+void freeRayStates(RayStates *states)
+{
+    free(states->r);
+    free(states->theta);
+    free(states->phi);
+    free(states->dr);
+    free(states->dtheta);
+    free(states->dphi);
+    free(states->energy);
+    free(states->angular_momentum);
+    free(states->step_size);
+}
+void loadRayState(const RayStates *states, int i, State *s)
+{
+    s->r = states->r[i];
+    s->theta = states->theta[i];
+    s->phi = states->phi[i];
+    s->dr = states->dr[i];
+    s->dtheta = states->dtheta[i];
+    s->dphi = states->dphi[i];
+    s->energy = states->energy[i];
+    s->angular_momentum = states->angular_momentum[i];
+}
+void storeRayState(RayStates *states, int i, const State *s)
+{
+    states->r[i] = s->r;
+    states->theta[i] = s->theta;
+    states->phi[i] = s->phi;
+    states->dr[i] = s->dr;
+    states->dtheta[i] = s->dtheta;
+    states->dphi[i] = s->dphi;
+    states->energy[i] = s->energy;
+    states->angular_momentum[i] = s->angular_momentum;
+}
+void updatePolarCoordinates(const Ray *ray, const BlackHole *bh, State *s)
+{
+    double dx = ray->position.x - bh->position.x;
+    double dy = ray->position.y - bh->position.y;
+    double dz = ray->position.z - bh->position.z;
+
+    s->r = sqrt(dx * dx + dy * dy + dz * dz);
+
+    if (s->r == 0)
+    {
+        s->theta = 0.0;
+        s->phi = 0.0;
+    }
+    else
+    {
+        s->theta = acos(dz / s->r);
+        s->phi = atan2(dy, dx);
+    }
+}
+double calculateTimeDilation(double r, double rs)
+{
+    if (r <= rs)
+        return 0.0;
+    return sqrt(1.0 - rs / r);
+}
+void initRayPhysics(Ray *rays, RayStates *states, int num_rays, const BlackHole *bh)
+{
+    for (int i = 0; i < num_rays; i++)
+    {
+        Ray *r = &rays[i];
+        State s;
+        updatePolarCoordinates(r, bh, &s);
+
+        double vx = r->direction.x * C_SPEED;
+        double vy = r->direction.y * C_SPEED;
+        double vz = r->direction.z * C_SPEED;
+
+        double sin_theta = sin(s.theta);
+        double cos_theta = cos(s.theta);
+        double sin_phi = sin(s.phi);
+        double cos_phi = cos(s.phi);
+
+        s.dr = sin_theta * cos_phi * vx + sin_theta * sin_phi * vy + cos_theta * vz;
+        s.dtheta = (cos_theta * cos_phi * vx + cos_theta * sin_phi * vy - sin_theta * vz) / s.r;
+        s.dphi = (-sin_phi * vx + cos_phi * vy) / (s.r * sin_theta);
+
+        // Calculate conserved quantities
+        double A = 1.0 - bh->schwarzschild_radius / s.r;
+        s.energy = A * (1.0 + s.dr * s.dr / A); // simplified energy
+        s.angular_momentum = s.r * s.r * sin_theta * sin_theta * s.dphi;
+        storeRayState(states, i, &s);
+        states->step_size[i] = TIME_STEP;
+
+        r->active = 1;
+        r->absorbed = 0;  // Reset absorption flag
+        r->fade_timer = 0; // Reset fade timer
+    }
+}
+
+void geodesic_derivatives(const State *s, double rs, State *ds)
+{
+    double r = s->r;
+    double theta = s->theta;
+    double sin_theta = sin(theta);
+    double cos_theta = cos(theta);
+
+    if (r < rs * 1.01)
+    {
+        *ds = (State){0};
+        return;
+    }
+
+    double sin2_theta = sin_theta * sin_theta;
+
+    ds->r = s->dr;
+    ds->theta = s->dtheta;
+    ds->phi = s->dphi;
+
+    // Schwarzschild null geodesic in the affine parameter. Substituting the null condition for the
+    // energy leaves the photon sphere at 1.5 rs as the only scale in the radial equation.
+    double orbital = s->dtheta * s->dtheta + sin2_theta * s->dphi * s->dphi;
+    ds->dr = (r - 1.5 * rs) * orbital;
+
+    // Angular equations
+    if (sin_theta > 1e-10)
+    {
+        ds->dtheta = -2.0 * s->dr * s->dtheta / r + sin_theta * cos_theta * s->dphi * s->dphi;
+        ds->dphi = -2.0 * s->dr * s->dphi / r - 2.0 * cos_theta / sin_theta * s->dtheta * s->dphi;
+    }
+    else
+    {
+        ds->dtheta = 0;
+        ds->dphi = 0;
+    }
+
+    ds->energy = 0;           // Energy is conserved
+    ds->angular_momentum = 0; // Angular momentum is conserved
+}
+
+void rk4_step(State *s, double h, double rs)
+{
+    State k1, k2, k3, k4, temp;
+
+    geodesic_derivatives(s, rs, &k1);
+
+    temp.r = s->r + 0.5 * h * k1.r;
+    temp.theta = s->theta + 0.5 * h * k1.theta;
+    temp.phi = s->phi + 0.5 * h * k1.phi;
+    temp.dr = s->dr + 0.5 * h * k1.dr;
+    temp.dtheta = s->dtheta + 0.5 * h * k1.dtheta;
+    temp.dphi = s->dphi + 0.5 * h * k1.dphi;
+    temp.energy = s->energy;
+    temp.angular_momentum = s->angular_momentum;
+    geodesic_derivatives(&temp, rs, &k2);
+
+    temp.r = s->r + 0.5 * h * k2.r;
+    temp.theta = s->theta + 0.5 * h * k2.theta;
+    temp.phi = s->phi + 0.5 * h * k2.phi;
+    temp.dr = s->dr + 0.5 * h * k2.dr;
+    temp.dtheta = s->dtheta + 0.5 * h * k2.dtheta;
+    temp.dphi = s->dphi + 0.5 * h * k2.dphi;
+    temp.energy = s->energy;
+    temp.angular_momentum = s->angular_momentum;
+    geodesic_derivatives(&temp, rs, &k3);
+
+    temp.r = s->r + h * k3.r;
+    temp.theta = s->theta + h * k3.theta;
+    temp.phi = s->phi + h * k3.phi;
+    temp.dr = s->dr + h * k3.dr;
+    temp.dtheta = s->dtheta + h * k3.dtheta;
+    temp.dphi = s->dphi + h * k3.dphi;
+    temp.energy = s->energy;
+    temp.angular_momentum = s->angular_momentum;
+    geodesic_derivatives(&temp, rs, &k4);
+
+    s->r += h * (k1.r + 2 * k2.r + 2 * k3.r + k4.r) / 6.0;
+    s->theta += h * (k1.theta + 2 * k2.theta + 2 * k3.theta + k4.theta) / 6.0;
+    s->phi += h * (k1.phi + 2 * k2.phi + 2 * k3.phi + k4.phi) / 6.0;
+    s->dr += h * (k1.dr + 2 * k2.dr + 2 * k3.dr + k4.dr) / 6.0;
+    s->dtheta += h * (k1.dtheta + 2 * k2.dtheta + 2 * k3.dtheta + k4.dtheta) / 6.0;
+    s->dphi += h * (k1.dphi + 2 * k2.dphi + 2 * k3.dphi + k4.dphi) / 6.0;
+}
+
+// Dormand-Prince 5(4): stage nodes are implied by the rows of DP_A, the last row is the 5th-order
+// solution (so its derivative is the next step's first stage) and DP_E is the 5th minus 4th order weights
+static const double DP_A[7][6] = {
+    {0},
+    {1.0 / 5.0},
+    {3.0 / 40.0, 9.0 / 40.0},
+    {44.0 / 45.0, -56.0 / 15.0, 32.0 / 9.0},
+    {19372.0 / 6561.0, -25360.0 / 2187.0, 64448.0 / 6561.0, -212.0 / 729.0},
+    {9017.0 / 3168.0, -355.0 / 33.0, 46732.0 / 5247.0, 49.0 / 176.0, -5103.0 / 18656.0},
+    {35.0 / 384.0, 0.0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0}};
+static const double DP_E[7] = {71.0 / 57600.0, 0.0, -71.0 / 16695.0, 71.0 / 1920.0, -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0};
+
+static inline void stateFields(const State *s, double *y)
+{
+    y[0] = s->r;
+    y[1] = s->theta;
+    y[2] = s->phi;
+    y[3] = s->dr;
+    y[4] = s->dtheta;
+    y[5] = s->dphi;
+}
+
+static inline void setStateFields(State *s, const double *y)
+{
+    s->r = y[0];
+    s->theta = y[1];
+    s->phi = y[2];
+    s->dr = y[3];
+    s->dtheta = y[4];
+    s->dphi = y[5];
+}
+
+// Step size factor from an error norm, kept within [0.2, 5] so one bad estimate can't collapse or blow up h
+static inline double rk45_factor(double error)
+{
+    if (error <= 0.0)
+        return 5.0;
+    double factor = 0.9 * pow(error, -0.2);
+    return factor < 0.2 ? 0.2 : factor > 5.0 ? 5.0 : factor;
+}
+
+/*
+ * One Dormand-Prince attempt of size h from s, whose derivative is k1. Writes the
+ * 5th-order result and its derivative, and returns the largest component error
+ * relative to tolerance * (1 + |y|); the step is acceptable when that is <= 1.
+ */
+double rk45_try(const State *s, const State *k1, double h, double rs, double tolerance, State *out, State *k7)
+{
+    double y[6], k[7][6];
+    stateFields(s, y);
+    stateFields(k1, k[0]);
+
+    State temp = *s;
+    State d;
+    for (int stage = 1; stage < 7; stage++)
+    {
+        double z[6];
+        for (int f = 0; f < 6; f++)
+        {
+            z[f] = y[f];
+            for (int j = 0; j < stage; j++)
+                z[f] += h * DP_A[stage][j] * k[j][f];
+        }
+        setStateFields(&temp, z);
+        geodesic_derivatives(&temp, rs, &d);
+        stateFields(&d, k[stage]);
+    }
+    *out = temp;
+    *k7 = d;
+
+    double z[6];
+    stateFields(out, z);
+    double error = 0.0;
+    for (int f = 0; f < 6; f++)
+    {
+        double e = 0.0;
+        for (int j = 0; j < 7; j++)
+            e += DP_E[j] * k[j][f];
+        double scale = tolerance * (1.0 + fmax(fabs(y[f]), fabs(z[f])));
+        error = fmax(error, fabs(h * e) / scale);
+    }
+    return error;
+}
+
+/*
+ * Advances s by interval with as many Dormand-Prince steps as the tolerance needs,
+ * starting from and updating the ray's own step_size. Gives up after
+ * RK45_MAX_ATTEMPTS attempts, leaving the rest of the interval for the next frame.
+ * Returns the number of derivative evaluations.
+ */
+int rk45_advance(State *s, double interval, double *step_size, double rs, double tolerance)
+{
+    State k1, next, k7;
+    geodesic_derivatives(s, rs, &k1);
+    int evaluations = 1;
+    double remaining = interval;
+    double h = *step_size;
+
+    for (int attempt = 0; remaining > 0.0 && attempt < RK45_MAX_ATTEMPTS; attempt++)
+    {
+        double step = fmin(h, remaining);
+        double error = rk45_try(s, &k1, step, rs, tolerance, &next, &k7);
+        evaluations += 6;
+
+        // Steps that have shrunk to nothing are taken anyway rather than stalling the ray
+        int accept = error <= 1.0 || step <= interval * 1e-6;
+        if (accept)
+        {
+            *s = next;
+            k1 = k7;
+            remaining -= step;
+        }
+
+        // A step cut short by the end of the interval says nothing about how large h could be
+        double proposal = step * rk45_factor(error);
+        h = accept && step < h ? fmax(h, proposal) : proposal;
+    }
+    *step_size = h;
+    return evaluations;
+}
+
+#if RAY_LANES > 1
+_Static_assert(RAY_CHUNK % RAY_LANES == 0, "chunks must hold whole vectors");
+
+typedef double vdouble __attribute__((vector_size(RAY_LANES * sizeof(double))));
+typedef long long vmask __attribute__((vector_size(RAY_LANES * sizeof(long long))));
+
+static inline vdouble loadLanes(const double *p)
+{
+    vdouble v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void storeLanes(double *p, vdouble v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+// Keeps a where the mask is set and b elsewhere
+static inline vdouble selectLanes(vmask m, vdouble a, vdouble b)
+{
+    return (vdouble)(((vmask)a & m) | ((vmask)b & ~m));
+}
+
+static inline vdouble negateLanes(vdouble v, vmask m)
+{
+    return (vdouble)((vmask)v ^ (m & LLONG_MIN));
+}
+
+/*
+ * sin and cos of every lane. The argument is reduced by multiples of pi/2 in
+ * three parts (Cody-Waite) and the Cephes minimax polynomials on [-pi/4, pi/4]
+ * are evaluated, so the result stays within a couple of ulps of libm.
+ */
+static inline void sincosLanes(vdouble x, vdouble *s, vdouble *c)
+{
+    const double round_bias = 6755399441055744.0; // 1.5 * 2^52 rounds to the nearest integer
+    vdouble n = (x * M_2_PI + round_bias) - round_bias;
+    vdouble y = ((x - n * 1.57079625129699707031e0) - n * 7.54978941586159635336e-8) - n * 5.39030285815811905290e-15;
+    vdouble z = y * y;
+
+    vdouble ps = y + y * z * (((((1.58962301576546568060e-10 * z - 2.50507477628578072866e-8) * z + 2.75573136213857245213e-6) * z - 1.98412698295895385996e-4) * z + 8.33333333332211858878e-3) * z - 1.66666666666666307295e-1);
+    vdouble pc = 1.0 - 0.5 * z + z * z * (((((-1.13585365213876817300e-11 * z + 2.08757008419747316778e-9) * z - 2.75573141792967388112e-7) * z + 2.48015872888517045348e-5) * z - 1.38888888888730564116e-3) * z + 4.16666666666665929218e-2);
+
+    // Quadrant q: odd quadrants swap sin and cos, quadrants 2 and 3 negate sin, 1 and 2 negate cos
+    vmask q = __builtin_convertvector(n, vmask);
+    vmask swap = -(q & 1);
+    *s = negateLanes(selectLanes(swap, pc, ps), -((q >> 1) & 1));
+    *c = negateLanes(selectLanes(swap, ps, pc), -(((q + 1) >> 1) & 1));
+}
+
+// geodesic_derivatives for RAY_LANES rays; s and ds hold r, theta, phi, dr, dtheta, dphi
+static inline void geodesic_derivatives_lanes(const vdouble *s, double rs, vdouble *ds)
+{
+    vdouble r = s[0];
+    vdouble sin_theta, cos_theta;
+    sincosLanes(s[1], &sin_theta, &cos_theta);
+
+    // Lanes inside 1.01 rs and lanes on the polar axis get zero derivatives, as in the scalar version
+    vmask outside = (vmask)(r >= rs * 1.01);
+    vmask off_axis = outside & (vmask)(sin_theta > 1e-10);
+
+    vdouble sin2_theta = sin_theta * sin_theta;
+    vdouble orbital = s[4] * s[4] + sin2_theta * s[5] * s[5];
+    vdouble zero = {0};
+
+    ds[0] = selectLanes(outside, s[3], zero);
+    ds[1] = selectLanes(outside, s[4], zero);
+    ds[2] = selectLanes(outside, s[5], zero);
+    ds[3] = selectLanes(outside, (r - 1.5 * rs) * orbital, zero);
+    ds[4] = selectLanes(off_axis, -2.0 * s[3] * s[4] / r + sin_theta * cos_theta * s[5] * s[5], zero);
+    ds[5] = selectLanes(off_axis, -2.0 * s[3] * s[5] / r - 2.0 * cos_theta / sin_theta * s[4] * s[5], zero);
+}
+
+// Advances rays base .. base + RAY_LANES - 1 by h; lanes whose step flag is clear keep their state
+void rk4_step_lanes(RayStates *states, int base, const double *h_lanes, const long long *step_lanes, double rs)
+{
+    double *fields[6] = {states->r + base, states->theta + base, states->phi + base,
+                         states->dr + base, states->dtheta + base, states->dphi + base};
+    vdouble s[6], k1[6], k2[6], k3[6], k4[6], temp[6];
+    vdouble h = loadLanes(h_lanes);
+    vmask step;
+    memcpy(&step, step_lanes, sizeof(step));
+
+    for (int f = 0; f < 6; f++)
+        s[f] = loadLanes(fields[f]);
+
+    geodesic_derivatives_lanes(s, rs, k1);
+    for (int f = 0; f < 6; f++)
+        temp[f] = s[f] + 0.5 * h * k1[f];
+    geodesic_derivatives_lanes(temp, rs, k2);
+    for (int f = 0; f < 6; f++)
+        temp[f] = s[f] + 0.5 * h * k2[f];
+    geodesic_derivatives_lanes(temp, rs, k3);
+    for (int f = 0; f < 6; f++)
+        temp[f] = s[f] + h * k3[f];
+    geodesic_derivatives_lanes(temp, rs, k4);
+
+    for (int f = 0; f < 6; f++)
+        storeLanes(fields[f], selectLanes(step, s[f] + h * (k1[f] + 2 * k2[f] + 2 * k3[f] + k4[f]) / 6.0, s[f]));
+}
+
+// Position relative to the hole and coordinate velocity of rays base .. base + RAY_LANES - 1
+void polarToCartesianLanes(const RayStates *states, int base, double offset[3][RAY_LANES], double velocity[3][RAY_LANES])
+{
+    vdouble r = loadLanes(states->r + base);
+    vdouble dr = loadLanes(states->dr + base);
+    vdouble dtheta = loadLanes(states->dtheta + base);
+    vdouble dphi = loadLanes(states->dphi + base);
+    vdouble sin_theta, cos_theta, sin_phi, cos_phi;
+    sincosLanes(loadLanes(states->theta + base), &sin_theta, &cos_theta);
+    sincosLanes(loadLanes(states->phi + base), &sin_phi, &cos_phi);
+
+    storeLanes(offset[0], r * sin_theta * cos_phi);
+    storeLanes(offset[1], r * sin_theta * sin_phi);
+    storeLanes(offset[2], r * cos_theta);
+    storeLanes(velocity[0], dr * sin_theta * cos_phi + r * cos_theta * cos_phi * dtheta - r * sin_theta * sin_phi * dphi);
+    storeLanes(velocity[1], dr * sin_theta * sin_phi + r * cos_theta * sin_phi * dtheta + r * sin_theta * cos_phi * dphi);
+    storeLanes(velocity[2], dr * cos_theta - r * sin_theta * dtheta);
+}
+
+static inline vdouble absLanes(vdouble v)
+{
+    return (vdouble)((vmask)v & LLONG_MAX);
+}
+
+static inline vdouble maxLanes(vdouble a, vdouble b)
+{
+    return selectLanes((vmask)(a > b), a, b);
+}
+
+// rk45_advance for rays base .. base + RAY_LANES - 1; lanes keep stepping until each has covered its interval
+long rk45_advance_lanes(RayStates *states, int base, const double *interval, const long long *step_lanes, double rs, double tolerance)
+{
+    double *fields[6] = {states->r + base, states->theta + base, states->phi + base,
+                         states->dr + base, states->dtheta + base, states->dphi + base};
+    vdouble s[6], k[7][6], z[6];
+    double remaining[RAY_LANES], h[RAY_LANES];
+    long evaluations = 0;
+    int pending = 0;
+
+    for (int l = 0; l < RAY_LANES; l++)
+    {
+        remaining[l] = step_lanes[l] ? interval[l] : 0.0;
+        h[l] = states->step_size[base + l];
+        pending += step_lanes[l] ? 1 : 0;
+    }
+    if (pending == 0)
+        return 0;
+
+    for (int f = 0; f < 6; f++)
+        s[f] = loadLanes(fields[f]);
+    geodesic_derivatives_lanes(s, rs, k[0]);
+    evaluations += pending;
+
+    for (int attempt = 0; pending > 0 && attempt < RK45_MAX_ATTEMPTS; attempt++)
+    {
+        // Finished lanes ride along with a zero step, which leaves them unchanged
+        double step_array[RAY_LANES];
+        for (int l = 0; l < RAY_LANES; l++)
+            step_array[l] = remaining[l] > 0.0 ? fmin(h[l], remaining[l]) : 0.0;
+        vdouble step = loadLanes(step_array);
+
+        for (int stage = 1; stage < 7; stage++)
+        {
+            for (int f = 0; f < 6; f++)
+            {
+                z[f] = s[f];
+                for (int j = 0; j < stage; j++)
+                    z[f] += step * DP_A[stage][j] * k[j][f];
+            }
+            geodesic_derivatives_lanes(z, rs, k[stage]);
+        }
+        evaluations += 6 * pending;
+
+        vdouble error = {0};
+        for (int f = 0; f < 6; f++)
+        {
+            vdouble e = {0};
+            for (int j = 0; j < 7; j++)
+                e += DP_E[j] * k[j][f];
+            vdouble scale = tolerance * (1.0 + maxLanes(absLanes(s[f]), absLanes(z[f])));
+            error = maxLanes(error, absLanes(step * e) / scale);
+        }
+
+        double error_array[RAY_LANES];
+        long long accept_array[RAY_LANES];
+        storeLanes(error_array, error);
+        pending = 0;
+        for (int l = 0; l < RAY_LANES; l++)
+        {
+            accept_array[l] = 0;
+            if (remaining[l] <= 0.0)
+                continue;
+
+            int accept = error_array[l] <= 1.0 || step_array[l] <= interval[l] * 1e-6;
+            if (accept)
+            {
+                accept_array[l] = -1;
+                remaining[l] -= step_array[l];
+            }
+            double proposal = step_array[l] * rk45_factor(error_array[l]);
+            h[l] = accept && step_array[l] < h[l] ? fmax(h[l], proposal) : proposal;
+            pending += remaining[l] > 0.0 ? 1 : 0;
+        }
+
+        vmask accept;
+        memcpy(&accept, accept_array, sizeof(accept));
+        for (int f = 0; f < 6; f++)
+        {
+            s[f] = selectLanes(accept, z[f], s[f]);
+            k[0][f] = selectLanes(accept, k[6][f], k[0][f]);
+        }
+    }
+
+    for (int f = 0; f < 6; f++)
+        storeLanes(fields[f], s[f]);
+    for (int l = 0; l < RAY_LANES; l++)
+    {
+        if (step_lanes[l])
+            states->step_size[base + l] = h[l];
+    }
+    return evaluations;
+}
+#else
+// Scalar fallback: one rk4_step per ray
+void rk4_step_lanes(RayStates *states, int base, const double *h_lanes, const long long *step_lanes, double rs)
+{
+    for (int l = 0; l < RAY_LANES; l++)
+    {
+        if (!step_lanes[l])
+            continue;
+
+        State s;
+        loadRayState(states, base + l, &s);
+        rk4_step(&s, h_lanes[l], rs);
+        storeRayState(states, base + l, &s);
+    }
+}
+
+void polarToCartesianLanes(const RayStates *states, int base, double offset[3][RAY_LANES], double velocity[3][RAY_LANES])
+{
+    for (int l = 0; l < RAY_LANES; l++)
+    {
+        State s;
+        loadRayState(states, base + l, &s);
+        double sin_theta = sin(s.theta);
+        double cos_theta = cos(s.theta);
+        double sin_phi = sin(s.phi);
+        double cos_phi = cos(s.phi);
+
+        offset[0][l] = s.r * sin_theta * cos_phi;
+        offset[1][l] = s.r * sin_theta * sin_phi;
+        offset[2][l] = s.r * cos_theta;
+        velocity[0][l] = s.dr * sin_theta * cos_phi + s.r * cos_theta * cos_phi * s.dtheta - s.r * sin_theta * sin_phi * s.dphi;
+        velocity[1][l] = s.dr * sin_theta * sin_phi + s.r * cos_theta * sin_phi * s.dtheta + s.r * sin_theta * cos_phi * s.dphi;
+        velocity[2][l] = s.dr * cos_theta - s.r * sin_theta * s.dtheta;
+    }
+}
+
+long rk45_advance_lanes(RayStates *states, int base, const double *interval, const long long *step_lanes, double rs, double tolerance)
+{
+    long evaluations = 0;
+    for (int l = 0; l < RAY_LANES; l++)
+    {
+        if (!step_lanes[l])
+            continue;
+
+        State s;
+        loadRayState(states, base + l, &s);
+        evaluations += rk45_advance(&s, interval[l], &states->step_size[base + l], rs, tolerance);
+        storeRayState(states, base + l, &s);
+    }
+    return evaluations;
+}
+#endif
+
+#endif
@@ -5,15 +5,22 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <GLUT/glut.h>
+#include "geodesic.h"
 
-#define C_SPEED 1.0
 #define WIDTH 400
 #define HEIGHT 300
 #define NUM_RAYS 1000
-#define TIME_STEP 0.05
-#define MAX_TRAIL_POINTS 300
+#define TRAIL_HISTORY_FRAMES 300 // trails reach back this many recorded frames...
+#define TRAIL_SLOTS 64            // ...in at most this many kept points per ray
 #define MAX_STEPS 20000
+#define MAX_THREADS 256
 
 #define DISK_INNER_RADIUS (1.5 * blackhole.schwarzschild_radius)
 #define DISK_OUTER_RADIUS (10.0 * blackhole.schwarzschild_radius)
@@ -23,53 +30,99 @@
 // LOD distances for performance optimization
 #define LOD_DISTANCE_1 50.0
 #define LOD_DISTANCE_2 100.0
+#define TRAIL_MIN_TURN 0.999 // cosine of the smallest bend kept by trail decimation
 
+// A kept trail point and the frame it was recorded in
 typedef struct
 {
-    double x, y, z;
-} Vector3;
+    float x, y, z;
+    unsigned int frame;
+} TrailPoint;
 
+// Trail history, TRAIL_SLOTS kept points per ray used as a ring. The newest point of a ring is
+// the ray's current position and moves every frame until the trail bends away from it.
 typedef struct
 {
-    Vector3 position;
-    double schwarzschild_radius;
-    double mass;
-} BlackHole;
+    TrailPoint *points;
+    int *head;
+    int *length;
+    unsigned int frame;
+} TrailStore;
 
+// Trail vertex as uploaded to the GPU
 typedef struct
 {
-    float r, g, b, a;
-} Color;
+    float x, y, z;
+    unsigned char r, g, b, a;
+} TrailVertex;
 
+// Every trail of a frame in one vertex buffer, one line strip per ray
+typedef struct
+{
+    TrailVertex *vertices;
+    GLint *first;
+    GLsizei *count;
+    int num_strips;
+    int num_vertices;
+    int vertex_capacity;
+    GLuint vbo;
+} TrailBatch;
+
+// What the draw pass needs from a ray, written by the workers after each step
 typedef struct
 {
     Vector3 position;
-    double r, theta, phi;
-    double dr, dtheta, dphi;
-    double energy;
-    double angular_momentum;
     Vector3 direction;
-    Vector3 trail[MAX_TRAIL_POINTS];
-    int trail_head;
-    int trail_length;
-    Color color;
+    double r;
     int active;
-    int absorbed;  // flag to indicate if ray was absorbed
-    int fade_timer; // timer for fading out trail after absorption
-} Ray;
+    int absorbed;
+    int fade_timer;
+} RaySnapshot;
+
+typedef enum
+{
+    INTEGRATOR_RK4,
+    INTEGRATOR_RK45
+} Integrator;
+
+// How directions are spread over an emitter's cone
+typedef enum
+{
+    SAMPLING_STRATIFIED, // golden-angle spiral, evenly covers the cone with few rays
+    SAMPLING_RANDOM      // independent uniform samples
+} Sampling;
 
+// What a step needs from the render thread, copied when the step is dispatched
 typedef struct
 {
-    Ray rays[NUM_RAYS];
-} ArrayRay;
+    double dt;
+    float dilation_factor;
+    Integrator integrator;
+    double tolerance;
+} StepSettings;
 
+// Persistent worker pool that steps the rays while the render thread draws
 typedef struct
 {
-    double r, theta, phi;
-    double dr, dtheta, dphi;
-    double energy;
-    double angular_momentum;
-} State;
+    pthread_t threads[MAX_THREADS];
+    int num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    unsigned int generation;
+    int pending;
+    int shutdown;
+
+    // Current job, only changed while every worker is idle
+    Ray *rays;
+    RayStates *states;
+    RaySnapshot *out;
+    int num_rays;
+    BlackHole bh;
+    StepSettings settings;
+    atomic_int next_chunk;
+    atomic_llong evaluations;
+} RayPool;
 
 typedef struct
 {
@@ -107,27 +160,35 @@ static float deltaTime = 0.0f;
 static float time_dilation_factor = 1.0f;
 static float schwarzschild_radius = 3.0f;
 static int ray_count = NUM_RAYS;
+static int active_rays = 0;
+static Integrator integrator = INTEGRATOR_RK4;
+static double tolerance = DEFAULT_TOLERANCE;
+static long long frame_evaluations = 0;
+static RayPool ray_pool;
 static int frame_count = 0;
 static int current_scenario = 0;
 static int reset = 0;
+static uint64_t emission_seed = 0;
+static Sampling sampling = SAMPLING_STRATIFIED;
+static unsigned int emission_count = 0; // emissions so far, so every reset draws new rays
 
-void updatePolarCoordinates(Ray *ray, const BlackHole *bh);
-void geodesic_derivatives(const State *s, double rs, State *ds);
-void rk4_step(State *s, double h, double rs);
 void drawBlackHole(const BlackHole *bh);
 void drawEmitter(const Emitter *emitter);
 void drawSpacetimeGrid(const BlackHole *bh);
 void drawDistortedGrid(const BlackHole *bh);
 void drawAccretionDisk(const BlackHole *bh);
-void drawRay(const Ray *ray);
-void drawTrail(const Ray *ray);
-void drawAdvancedTrail(const Ray *ray, const BlackHole *bh);
+void drawRay(const RaySnapshot *ray);
+TrailBatch allocTrailBatch(int num_rays);
+void freeTrailBatch(TrailBatch *batch);
+void buildTrailBatch(TrailBatch *batch, const TrailStore *trails, const RaySnapshot *front, int num_rays, const BlackHole *bh);
+void drawTrailBatch(TrailBatch *batch);
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 void mouse_callback(GLFWwindow *window, double xpos, double ypos);
 void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void scroll_callback(GLFWwindow *window, double xoffset, double yoffset);
 void updateCameraVectors();
-void generateRays(const Emitter *emitter, Ray *rays, int num_rays, const BlackHole *blackhole);
+double counterRandom(uint64_t seed, uint64_t stream, uint64_t counter);
+void generateRays(const Emitter *emitter, Ray *rays, int num_rays, const BlackHole *blackhole, uint64_t stream);
 void initEmitter(Emitter *emitter);
 void initEmitter2(Emitter *emitter);
 void drawSphere(float cx, float cy, float cz, float radius, int slices, int stacks);
@@ -140,19 +201,71 @@ void drawInfoPanel();
 void drawTextLine(int x, int y, int length);
 void drawNumericBar(float value, int x, int y, int max_bars);
 void toggleMouseControl(GLFWwindow *window);
-double calculateTimeDilation(double r, double rs);
-void updateRaysWithRelativity(Ray *rays, int num_rays, const BlackHole *bh, double dt);
-void updateCartesianFromPolar(Ray *r, const BlackHole *bh);
-double distanceToCamera(const Ray *ray, const Camera *cam);
-void updateRaysLOD(Ray *rays, int num_rays, const Camera *cam, const BlackHole *bh);
-void resetSimulation(Emitter *emitter, Emitter *emitter2, Ray *rays, const BlackHole *bh);
+long updateRaysWithRelativity(Ray *rays, RayStates *states, int start, int end, const BlackHole *bh, const StepSettings *settings);
+void snapshotRays(const Ray *rays, const RayStates *states, RaySnapshot *out, int start, int end);
+TrailStore allocTrailStore(int num_rays);
+void freeTrailStore(TrailStore *trails);
+void clearTrails(TrailStore *trails, int num_rays);
+void recordTrails(TrailStore *trails, const RaySnapshot *front, int num_rays, const Camera *cam);
+void rayPoolStart(RayPool *pool, int num_threads);
+void rayPoolDispatch(RayPool *pool, Ray *rays, RayStates *states, RaySnapshot *out, int num_rays, const BlackHole *bh, const StepSettings *settings);
+void rayPoolWait(RayPool *pool);
+void rayPoolStop(RayPool *pool);
+double distanceToCamera(const Vector3 *position, const Camera *cam);
+void resetSimulation(Emitter *emitter, Emitter *emitter2, Ray *rays, RayStates *states, TrailStore *trails, const BlackHole *bh);
 void drawProgressBar(float value, int x, int y, int width, float r, float g, float b);
 void drawGLUTText(float x, float y, void *font, const char *string);
 void drawScaledGLUTText(float x, float y, void *font, const char *string, float scale);
 
-int main(void)
+int main(int argc, char *argv[])
 {
-    srand(time(NULL));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cpus > 1 ? (int)cpus - 1 : 1;
+    int seed_given = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rays") == 0 && i + 1 < argc)
+        {
+            ray_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc)
+        {
+            integrator = strcmp(argv[++i], "rk45") == 0 ? INTEGRATOR_RK45 : INTEGRATOR_RK4;
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+            tolerance = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            emission_seed = strtoull(argv[++i], NULL, 10);
+            seed_given = 1;
+        }
+        else if (strcmp(argv[i], "--sampling") == 0 && i + 1 < argc)
+        {
+            sampling = strcmp(argv[++i], "random") == 0 ? SAMPLING_RANDOM : SAMPLING_STRATIFIED;
+        }
+        else
+        {
+            printf("Usage: %s [--rays N] [--threads N] [--integrator rk4|rk45] [--tolerance X] [--seed N] "
+                   "[--sampling stratified|random]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+    if (ray_count < 2 || num_threads < 1 || num_threads > MAX_THREADS || tolerance <= 0)
+    {
+        printf("Need at least 2 rays, between 1 and %d threads and a positive tolerance\n", MAX_THREADS);
+        return -1;
+    }
+
+    if (!seed_given)
+        emission_seed = (uint64_t)time(NULL);
+    printf("Seed %llu (pass --seed %llu to replay this run)\n", (unsigned long long)emission_seed, (unsigned long long)emission_seed);
     if (!glfwInit())
         return -1;
 
@@ -190,38 +303,27 @@ int main(void)
     initEmitter(&emitter);
     initEmitter2(&emitter2);
 
-    ArrayRay arrayRays;
-    generateRays(&emitter, arrayRays.rays, NUM_RAYS / 2, &blackhole);
-    generateRays(&emitter2, arrayRays.rays + NUM_RAYS / 2, NUM_RAYS / 2, &blackhole);
-
-    // Initialize ray physics
-    for (int i = 0; i < NUM_RAYS; i++)
+    // The rays are too many for the stack once trails are included
+    Ray *rays = calloc(ray_count, sizeof(Ray));
+    RaySnapshot *front = malloc(ray_count * sizeof(RaySnapshot));
+    RaySnapshot *back = malloc(ray_count * sizeof(RaySnapshot));
+    if (!rays || !front || !back)
     {
-        Ray *r = &arrayRays.rays[i];
-        updatePolarCoordinates(r, &blackhole);
-
-        double vx = r->direction.x * C_SPEED;
-        double vy = r->direction.y * C_SPEED;
-        double vz = r->direction.z * C_SPEED;
-
-        double sin_theta = sin(r->theta);
-        double cos_theta = cos(r->theta);
-        double sin_phi = sin(r->phi);
-        double cos_phi = cos(r->phi);
-
-        r->dr = sin_theta * cos_phi * vx + sin_theta * sin_phi * vy + cos_theta * vz;
-        r->dtheta = (cos_theta * cos_phi * vx + cos_theta * sin_phi * vy - sin_theta * vz) / r->r;
-        r->dphi = (-sin_phi * vx + cos_phi * vy) / (r->r * sin_theta);
-
-        // Calculate conserved quantities
-        double A = 1.0 - blackhole.schwarzschild_radius / r->r;
-        r->energy = A * (1.0 + r->dr * r->dr / A); // simplified energy
-        r->angular_momentum = r->r * r->r * sin_theta * sin_theta * r->dphi;
-
-        r->active = 1;
-        r->absorbed = 0;
-        r->fade_timer = 0;
+        printf("Unable to allocate %d rays\n", ray_count);
+        return -1;
     }
+    RayStates states = allocRayStates(ray_count);
+    TrailStore trails = allocTrailStore(ray_count);
+    TrailBatch trail_batch = allocTrailBatch(ray_count);
+
+    generateRays(&emitter, rays, ray_count / 2, &blackhole, 0);
+    generateRays(&emitter2, rays + ray_count / 2, ray_count - ray_count / 2, &blackhole, 1);
+    initRayPhysics(rays, &states, ray_count, &blackhole);
+    snapshotRays(rays, &states, front, 0, ray_count);
+
+    rayPoolStart(&ray_pool, num_threads);
+    printf("Simulating %d rays on %d worker threads, %d per vector\n", ray_count, num_threads, RAY_LANES);
+    int stepping = 0;
 
     updateCameraVectors();
     lastFrameTime = glfwGetTime();
@@ -239,6 +341,33 @@ int main(void)
         blackhole.schwarzschild_radius = schwarzschild_radius;
         blackhole.mass = schwarzschild_radius / 2.0;
 
+        // Collect the step dispatched last frame and make it the one we draw
+        if (stepping)
+        {
+            rayPoolWait(&ray_pool);
+            frame_evaluations = atomic_load(&ray_pool.evaluations);
+            RaySnapshot *swap = front;
+            front = back;
+            back = swap;
+            stepping = 0;
+        }
+
+        if (reset)
+        {
+            resetSimulation(&emitter, &emitter2, rays, &states, &trails, &blackhole);
+            snapshotRays(rays, &states, front, 0, ray_count);
+            reset = 0;
+        }
+
+        // Trails belong to the render thread; the workers only touch physics state
+        if (!paused)
+        {
+            recordTrails(&trails, front, ray_count, &camera);
+            StepSettings settings = {TIME_STEP, time_dilation_factor, integrator, tolerance};
+            rayPoolDispatch(&ray_pool, rays, &states, back, ray_count, &blackhole, &settings);
+            stepping = 1;
+        }
+
         glClearColor(0.02f, 0.02f, 0.05f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -292,22 +421,18 @@ int main(void)
         drawEmitter(&emitter);
         drawEmitter(&emitter2);
 
-        // Update and draw rays
-        if (!paused)
-        {
-            updateRaysWithRelativity(arrayRays.rays, ray_count, &blackhole, TIME_STEP);
-        }
+        // Draw rays from the front buffer while the workers fill the back one. Trails are drawn
+        // even for absorbed rays until their fade completes.
+        buildTrailBatch(&trail_batch, &trails, front, ray_count, &blackhole);
+        drawTrailBatch(&trail_batch);
 
+        active_rays = 0;
         for (int i = 0; i < ray_count; i++)
         {
-            Ray *r = &arrayRays.rays[i];
-            
-            // Always draw trail, even for absorbed rays (until fade completes)
-            if (r->trail_length > 1)
-            {
-                drawAdvancedTrail(r, &blackhole);
-            }
-            
+            const RaySnapshot *r = &front[i];
+            if (r->active)
+                active_rays++;
+
             // Only draw the ray itself if it's still active and not absorbed
             if (r->active && !r->absorbed && r->r > blackhole.schwarzschild_radius * 1.1)
             {
@@ -326,83 +451,108 @@ int main(void)
             drawHelpText();
         }
 
-        if (reset)
-        {
-            resetSimulation(&emitter, &emitter2, &arrayRays.rays, &blackhole);
-            reset = 0;
-        }
-
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
 
+    if (stepping)
+    {
+        rayPoolWait(&ray_pool);
+    }
+    rayPoolStop(&ray_pool);
+    free(rays);
+    free(front);
+    free(back);
+    freeRayStates(&states);
+    freeTrailStore(&trails);
+    freeTrailBatch(&trail_batch);
+
     glfwDestroyWindow(window);
     glfwTerminate();
     return 0;
 }
 
-void updateRaysWithRelativity(Ray *rays, int num_rays, const BlackHole *bh, double dt)
+long updateRaysWithRelativity(Ray *rays, RayStates *states, int start, int end, const BlackHole *bh, const StepSettings *settings)
 {
-    for (int i = 0; i < num_rays; i++)
+    double rs = bh->schwarzschild_radius;
+    long evaluations = 0;
+
+    // start is a multiple of RAY_LANES and the state arrays are padded, so every group is a full vector
+    for (int base = start; base < end; base += RAY_LANES)
     {
-        Ray *r = &rays[i];
-        
-        // Handle absorbed rays - let them fade out gradually
-        if (r->absorbed)
+        double h[RAY_LANES];
+        long long step[RAY_LANES];
+
+        for (int l = 0; l < RAY_LANES; l++)
         {
-            r->fade_timer++;
-            if (r->fade_timer > 120)  // Fade for 120 frames (~2 seconds at 60fps)
+            int i = base + l;
+            h[l] = 0.0;
+            step[l] = 0;
+            if (i >= end)
+                continue;
+
+            Ray *r = &rays[i];
+
+            // Handle absorbed rays - let them fade out gradually
+            if (r->absorbed)
             {
-                r->active = 0;  // Finally deactivate completely
+                r->fade_timer++;
+                if (r->fade_timer > 120)  // Fade for 120 frames (~2 seconds at 60fps)
+                {
+                    r->active = 0;  // Finally deactivate completely
+                }
+                continue;  // Skip physics update for absorbed rays
             }
-            continue;  // Skip physics update for absorbed rays
-        }
-        
-        if (!r->active)
-            continue;
 
-        // Add to trail only if ray is still active
-        r->trail[r->trail_head] = r->position;
-        r->trail_head = (r->trail_head + 1) % MAX_TRAIL_POINTS;
-        if (r->trail_length < MAX_TRAIL_POINTS)
-            r->trail_length++;
+            if (!r->active)
+                continue;
+
+            // Check if ray is approaching event horizon
+            if (states->r[i] <= rs * 1.05)  // Very close to event horizon
+            {
+                r->absorbed = 1;  // Mark as absorbed but don't deactivate yet
+                r->fade_timer = 0;
+                continue;
+            }
+
+            // Update physics if far enough from event horizon, at the locally dilated step
+            if (states->r[i] > rs * 1.1)
+            {
+                double dilation = calculateTimeDilation(states->r[i], rs);
+                h[l] = settings->dt * dilation * settings->dilation_factor;
+                step[l] = -1;
+            }
+        }
 
-        // Check if ray is approaching event horizon
-        if (r->r <= bh->schwarzschild_radius * 1.05)  // Very close to event horizon
+        if (settings->integrator == INTEGRATOR_RK45)
         {
-            r->absorbed = 1;  // Mark as absorbed but don't deactivate yet
-            r->fade_timer = 0;
-            continue;
+            // h is the interval to cover; the integrator picks its own substeps inside it
+            evaluations += rk45_advance_lanes(states, base, h, step, rs, settings->tolerance);
+        }
+        else
+        {
+            rk4_step_lanes(states, base, h, step, rs);
+            for (int l = 0; l < RAY_LANES; l++)
+                evaluations += step[l] ? 4 : 0;
         }
 
-        // Calculate local time dilation
-        double dilation = calculateTimeDilation(r->r, bh->schwarzschild_radius);
-        double effective_dt = dt * dilation * time_dilation_factor;
+        double offset[3][RAY_LANES], velocity[3][RAY_LANES];
+        polarToCartesianLanes(states, base, offset, velocity);
 
-        // Update physics if far enough from event horizon
-        if (r->r > bh->schwarzschild_radius * 1.1)
+        for (int l = 0; l < RAY_LANES; l++)
         {
-            State s = {r->r, r->theta, r->phi, r->dr, r->dtheta, r->dphi, r->energy, r->angular_momentum};
-            rk4_step(&s, effective_dt, bh->schwarzschild_radius);
-
-            r->r = s.r;
-            r->theta = s.theta;
-            r->phi = s.phi;
-            r->dr = s.dr;
-            r->dtheta = s.dtheta;
-            r->dphi = s.dphi;
+            if (!step[l])
+                continue;
 
-            updateCartesianFromPolar(r, bh);
+            Ray *r = &rays[base + l];
+            r->position.x = bh->position.x + offset[0][l];
+            r->position.y = bh->position.y + offset[1][l];
+            r->position.z = bh->position.z + offset[2][l];
 
             // Update direction vector
-            double sin_theta = sin(r->theta);
-            double cos_theta = cos(r->theta);
-            double sin_phi = sin(r->phi);
-            double cos_phi = cos(r->phi);
-
-            double vx = r->dr * sin_theta * cos_phi + r->r * cos_theta * cos_phi * r->dtheta - r->r * sin_theta * sin_phi * r->dphi;
-            double vy = r->dr * sin_theta * sin_phi + r->r * cos_theta * sin_phi * r->dtheta + r->r * sin_theta * cos_phi * r->dphi;
-            double vz = r->dr * cos_theta - r->r * sin_theta * r->dtheta;
+            double vx = velocity[0][l];
+            double vy = velocity[1][l];
+            double vz = velocity[2][l];
 
             double len = sqrt(vx * vx + vy * vy + vz * vz);
             if (len > 0)
@@ -411,115 +561,349 @@ void updateRaysWithRelativity(Ray *rays, int num_rays, const BlackHole *bh, doub
                 r->direction.y = vy / len;
                 r->direction.z = vz / len;
             }
+
+            // Deactivate rays that are too far away
+            if (states->r[base + l] > 200.0)
+            {
+                r->active = 0;
+            }
+        }
+    }
+
+    return evaluations;
+}
+
+void snapshotRays(const Ray *rays, const RayStates *states, RaySnapshot *out, int start, int end)
+{
+    for (int i = start; i < end; i++)
+    {
+        out[i].position = rays[i].position;
+        out[i].direction = rays[i].direction;
+        out[i].r = states->r[i];
+        out[i].active = rays[i].active;
+        out[i].absorbed = rays[i].absorbed;
+        out[i].fade_timer = rays[i].fade_timer;
+    }
+}
+
+TrailStore allocTrailStore(int num_rays)
+{
+    TrailStore trails;
+    trails.points = malloc((size_t)num_rays * TRAIL_SLOTS * sizeof(TrailPoint));
+    trails.head = calloc(num_rays, sizeof(int));
+    trails.length = calloc(num_rays, sizeof(int));
+    trails.frame = 0;
+    if (!trails.points || !trails.head || !trails.length)
+    {
+        printf("Unable to allocate trails for %d rays\n", num_rays);
+        exit(EXIT_FAILURE);
+    }
+    return trails;
+}
+
+void freeTrailStore(TrailStore *trails)
+{
+    free(trails->points);
+    free(trails->head);
+    free(trails->length);
+}
+
+void clearTrails(TrailStore *trails, int num_rays)
+{
+    memset(trails->head, 0, num_rays * sizeof(int));
+    memset(trails->length, 0, num_rays * sizeof(int));
+}
+
+/*
+ * Moves each active ray's newest trail point to its current position. The old newest point is kept
+ * only where the trail bends more than min_turn, or once it is max_gap frames past the point before
+ * it; both loosen with distance to the camera. Points older than TRAIL_HISTORY_FRAMES are dropped.
+ */
+void recordTrails(TrailStore *trails, const RaySnapshot *front, int num_rays, const Camera *cam)
+{
+    unsigned int frame = trails->frame++;
+    for (int i = 0; i < num_rays; i++)
+    {
+        // Add to trail only if ray is still active
+        if (!front[i].active || front[i].absorbed)
+            continue;
+
+        TrailPoint *trail = trails->points + (size_t)i * TRAIL_SLOTS;
+        TrailPoint p = {(float)front[i].position.x, (float)front[i].position.y, (float)front[i].position.z, frame};
+        int head = trails->head[i];
+        int length = trails->length[i];
+
+        int keep_tip = length < 2;
+        if (!keep_tip)
+        {
+            double dist_to_camera = distanceToCamera(&front[i].position, cam);
+            unsigned int max_gap = dist_to_camera > LOD_DISTANCE_2 ? 20 : dist_to_camera > LOD_DISTANCE_1 ? 10 : 5;
+            double min_turn = dist_to_camera > LOD_DISTANCE_2 ? 0.995 : TRAIL_MIN_TURN;
+
+            const TrailPoint *a = &trail[(head - 2 + TRAIL_SLOTS) % TRAIL_SLOTS];
+            const TrailPoint *b = &trail[(head - 1 + TRAIL_SLOTS) % TRAIL_SLOTS];
+            double ax = b->x - a->x, ay = b->y - a->y, az = b->z - a->z;
+            double bx = p.x - b->x, by = p.y - b->y, bz = p.z - b->z;
+            double lengths = sqrt((ax * ax + ay * ay + az * az) * (bx * bx + by * by + bz * bz));
+            double cos_turn = lengths > 0.0 ? (ax * bx + ay * by + az * bz) / lengths : 1.0;
+            keep_tip = cos_turn <= min_turn || b->frame - a->frame >= max_gap;
         }
 
-        // Deactivate rays that are too far away
-        if (r->r > 200.0)
+        if (keep_tip)
         {
-            r->active = 0;
+            head = (head + 1) % TRAIL_SLOTS;
+            if (length < TRAIL_SLOTS)
+                length++;
         }
+        trail[(head - 1 + TRAIL_SLOTS) % TRAIL_SLOTS] = p;
+        while (length > 2 && frame - trail[(head - length + 1 + TRAIL_SLOTS) % TRAIL_SLOTS].frame >= TRAIL_HISTORY_FRAMES)
+            length--;
+
+        trails->head[i] = head;
+        trails->length[i] = length;
     }
 }
 
-void drawAdvancedTrail(const Ray *ray, const BlackHole *bh)
+void *rayPoolWorker(void *arg)
 {
-    if (ray->trail_length < 2)
-        return;
+    RayPool *pool = arg;
+    unsigned int seen = 0;
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-    glLineWidth(2.0f);
+    pthread_mutex_lock(&pool->mutex);
+    for (;;)
+    {
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
 
-    glBegin(GL_LINE_STRIP);
-    for (int i = 0; i < ray->trail_length - 1; i++)
+        // Hand out small chunks so threads that land on absorbed rays pick up more work
+        for (;;)
+        {
+            int start = atomic_fetch_add(&pool->next_chunk, 1) * RAY_CHUNK;
+            if (start >= pool->num_rays)
+                break;
+            int count = pool->num_rays - start < RAY_CHUNK ? pool->num_rays - start : RAY_CHUNK;
+            long evaluations = updateRaysWithRelativity(pool->rays, pool->states, start, start + count, &pool->bh, &pool->settings);
+            atomic_fetch_add(&pool->evaluations, evaluations);
+            snapshotRays(pool->rays, pool->states, pool->out, start, start + count);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void rayPoolStart(RayPool *pool, int num_threads)
+{
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->shutdown = 0;
+    pool->num_threads = num_threads;
+    for (int i = 0; i < num_threads; i++)
     {
-        int idx = (ray->trail_head - ray->trail_length + i + MAX_TRAIL_POINTS) % MAX_TRAIL_POINTS;
-        int next_idx = (ray->trail_head - ray->trail_length + i + 1 + MAX_TRAIL_POINTS) % MAX_TRAIL_POINTS;
-
-        // Calculate velocity for Doppler effect simulation
-        Vector3 velocity;
-        velocity.x = ray->trail[next_idx].x - ray->trail[idx].x;
-        velocity.y = ray->trail[next_idx].y - ray->trail[idx].y;
-        velocity.z = ray->trail[next_idx].z - ray->trail[idx].z;
-
-        double speed = sqrt(velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z);
-
-        // Calculate distance to black hole for redshift effect
-        double dx = ray->trail[idx].x - bh->position.x;
-        double dy = ray->trail[idx].y - bh->position.y;
-        double dz = ray->trail[idx].z - bh->position.z;
-        double dist_to_bh = sqrt(dx * dx + dy * dy + dz * dz);
-
-        // Gravitational redshift factor
-        double redshift_factor = 1.0 - bh->schwarzschild_radius / (2.0 * dist_to_bh);
-
-        // Color based on velocity and redshift
-        float red = 1.0f - speed * 0.3f + (1.0f - redshift_factor) * 2.0f;
-        float green = 0.5f + speed * 0.2f;
-        float blue = speed + redshift_factor * 0.5f;
-        float alpha = (float)i / ray->trail_length;
-
-        // Apply fading for absorbed rays
-        if (ray->absorbed && ray->fade_timer > 0)
+        if (pthread_create(&pool->threads[i], NULL, rayPoolWorker, pool) != 0)
         {
-            float fade_factor = 1.0f - ((float)ray->fade_timer / 120.0f);
-            alpha *= fade_factor;
-            red *= fade_factor;
-            green *= fade_factor;
-            blue *= fade_factor;
+            printf("Unable to start worker thread %d\n", i);
+            exit(EXIT_FAILURE);
         }
+    }
+}
+
+void rayPoolDispatch(RayPool *pool, Ray *rays, RayStates *states, RaySnapshot *out, int num_rays, const BlackHole *bh, const StepSettings *settings)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->rays = rays;
+    pool->states = states;
+    pool->out = out;
+    pool->num_rays = num_rays;
+    pool->bh = *bh;
+    pool->settings = *settings;
+    atomic_store(&pool->next_chunk, 0);
+    atomic_store(&pool->evaluations, 0);
+    pool->pending = pool->num_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
 
-        red = fmax(0.0f, fmin(1.0f, red));
-        green = fmax(0.0f, fmin(1.0f, green));
-        blue = fmax(0.0f, fmin(1.0f, blue));
+void rayPoolWait(RayPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void rayPoolStop(RayPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
 
-        glColor4f(red, green, blue, alpha * 0.9f);
-        glVertex3f(ray->trail[idx].x, ray->trail[idx].y, ray->trail[idx].z);
+TrailBatch allocTrailBatch(int num_rays)
+{
+    TrailBatch batch = {0};
+    batch.first = malloc(num_rays * sizeof(GLint));
+    batch.count = malloc(num_rays * sizeof(GLsizei));
+    if (!batch.first || !batch.count)
+    {
+        printf("Unable to allocate trail vertices for %d rays\n", num_rays);
+        exit(EXIT_FAILURE);
     }
-    glEnd();
+    return batch;
+}
+
+void freeTrailBatch(TrailBatch *batch)
+{
+    if (batch->vbo)
+        glDeleteBuffers(1, &batch->vbo);
+    free(batch->vertices);
+    free(batch->first);
+    free(batch->count);
+}
+
+static inline unsigned char colorByte(float value)
+{
+    return (unsigned char)(fmax(0.0f, fmin(1.0f, value)) * 255.0f);
+}
+
+/*
+ * Flattens every trail into one strip each, oldest point first. recordTrails already dropped the
+ * points on straight stretches, so every kept point is emitted; the buffer grows to what is used.
+ */
+void buildTrailBatch(TrailBatch *batch, const TrailStore *trails, const RaySnapshot *front, int num_rays, const BlackHole *bh)
+{
+    batch->num_strips = 0;
+    batch->num_vertices = 0;
+
+    for (int index = 0; index < num_rays; index++)
+    {
+        const TrailPoint *trail = trails->points + (size_t)index * TRAIL_SLOTS;
+        const RaySnapshot *state = &front[index];
+        int trail_head = trails->head[index];
+        int trail_length = trails->length[index];
+        if (trail_length < 2)
+            continue;
+
+        if (batch->num_vertices + trail_length > batch->vertex_capacity)
+        {
+            int capacity = batch->vertex_capacity ? batch->vertex_capacity : 4096;
+            while (capacity < batch->num_vertices + trail_length)
+                capacity *= 2;
+            batch->vertices = realloc(batch->vertices, (size_t)capacity * sizeof(TrailVertex));
+            if (!batch->vertices)
+            {
+                printf("Unable to allocate %d trail vertices\n", capacity);
+                exit(EXIT_FAILURE);
+            }
+            batch->vertex_capacity = capacity;
+        }
+
+        float fade_factor = 1.0f;
+        if (state->absorbed && state->fade_timer > 0)
+            fade_factor = 1.0f - ((float)state->fade_timer / 120.0f);
+
+        const TrailPoint *oldest = &trail[(trail_head - trail_length + TRAIL_SLOTS) % TRAIL_SLOTS];
+        const TrailPoint *newest = &trail[(trail_head - 1 + TRAIL_SLOTS) % TRAIL_SLOTS];
+        float span = (float)(newest->frame - oldest->frame);
+
+        batch->first[batch->num_strips] = batch->num_vertices;
+        batch->count[batch->num_strips] = trail_length;
+        batch->num_strips++;
+        for (int i = 0; i < trail_length; i++)
+        {
+            const TrailPoint *point = &trail[(trail_head - trail_length + i + TRAIL_SLOTS) % TRAIL_SLOTS];
+
+            // Calculate velocity for Doppler effect simulation, per recorded frame, from the segment
+            // leaving the point (arriving at it for the newest one)
+            int segment = i < trail_length - 1 ? i : i - 1;
+            const TrailPoint *from = &trail[(trail_head - trail_length + segment + TRAIL_SLOTS) % TRAIL_SLOTS];
+            const TrailPoint *to = &trail[(trail_head - trail_length + segment + 1 + TRAIL_SLOTS) % TRAIL_SLOTS];
+            double frames = to->frame - from->frame;
+            double vx = to->x - from->x, vy = to->y - from->y, vz = to->z - from->z;
+            double speed = frames > 0.0 ? sqrt(vx * vx + vy * vy + vz * vz) / frames : 0.0;
+
+            // Calculate distance to black hole for redshift effect
+            double dx = point->x - bh->position.x;
+            double dy = point->y - bh->position.y;
+            double dz = point->z - bh->position.z;
+            double dist_to_bh = sqrt(dx * dx + dy * dy + dz * dz);
+
+            // Gravitational redshift factor
+            double redshift_factor = 1.0 - bh->schwarzschild_radius / (2.0 * dist_to_bh);
+
+            // Color based on velocity and redshift, faded for absorbed rays
+            float red = 1.0f - speed * 0.3f + (1.0f - redshift_factor) * 2.0f;
+            float green = 0.5f + speed * 0.2f;
+            float blue = speed + redshift_factor * 0.5f;
+            float alpha = span > 0.0f ? (float)(point->frame - oldest->frame) / span : 0.0f;
+
+            TrailVertex *v = &batch->vertices[batch->num_vertices++];
+            v->x = point->x;
+            v->y = point->y;
+            v->z = point->z;
+            v->r = colorByte(red * fade_factor);
+            v->g = colorByte(green * fade_factor);
+            v->b = colorByte(blue * fade_factor);
+            v->a = colorByte(alpha * fade_factor * 0.9f);
+        }
+    }
+}
+
+// Uploads the frame's trails into one vertex buffer and draws them with a single call
+void drawTrailBatch(TrailBatch *batch)
+{
+    if (batch->num_strips == 0)
+        return;
+    if (!batch->vbo)
+        glGenBuffers(1, &batch->vbo);
+
+    glBindBuffer(GL_ARRAY_BUFFER, batch->vbo);
+    glBufferData(GL_ARRAY_BUFFER, batch->num_vertices * sizeof(TrailVertex), batch->vertices, GL_STREAM_DRAW);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(TrailVertex), (void *)offsetof(TrailVertex, x));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(TrailVertex), (void *)offsetof(TrailVertex, r));
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    glLineWidth(2.0f);
+    glMultiDrawArrays(GL_LINE_STRIP, batch->first, batch->count, batch->num_strips);
     glDisable(GL_BLEND);
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void resetSimulation(Emitter *emitter, Emitter *emitter2, Ray *rays, const BlackHole *bh)
+void resetSimulation(Emitter *emitter, Emitter *emitter2, Ray *rays, RayStates *states, TrailStore *trails, const BlackHole *bh)
 {
     // Reset emitter to default position
     initEmitter(emitter);
     initEmitter2(emitter2);
 
-    // Regenerate and reinitialize rays for both emitters
-    generateRays(emitter, rays, NUM_RAYS / 2, bh);
-    generateRays(emitter2, rays + NUM_RAYS / 2, NUM_RAYS / 2, bh);
-
-    // Reinitialize ray physics for all rays
-    for (int i = 0; i < NUM_RAYS; i++)
-    {
-        Ray *r = &rays[i];
-        updatePolarCoordinates(r, bh);
-
-        double vx = r->direction.x * C_SPEED;
-        double vy = r->direction.y * C_SPEED;
-        double vz = r->direction.z * C_SPEED;
-
-        double sin_theta = sin(r->theta);
-        double cos_theta = cos(r->theta);
-        double sin_phi = sin(r->phi);
-        double cos_phi = cos(r->phi);
-
-        r->dr = sin_theta * cos_phi * vx + sin_theta * sin_phi * vy + cos_theta * vz;
-        r->dtheta = (cos_theta * cos_phi * vx + cos_theta * sin_phi * vy - sin_theta * vz) / r->r;
-        r->dphi = (-sin_phi * vx + cos_phi * vy) / (r->r * sin_theta);
-
-        // Calculate conserved quantities
-        double A = 1.0 - bh->schwarzschild_radius / r->r;
-        r->energy = A * (1.0 + r->dr * r->dr / A);
-        r->angular_momentum = r->r * r->r * sin_theta * sin_theta * r->dphi;
-
-        r->active = 1;
-        r->absorbed = 0;  // Reset absorption flag
-        r->fade_timer = 0; // Reset fade timer
-        r->trail_length = 0;
-        r->trail_head = 0;
-    }
+    // Regenerate and reinitialize rays for both emitters, from streams no earlier emission used
+    emission_count++;
+    generateRays(emitter, rays, ray_count / 2, bh, 2 * (uint64_t)emission_count);
+    generateRays(emitter2, rays + ray_count / 2, ray_count - ray_count / 2, bh, 2 * (uint64_t)emission_count + 1);
+    initRayPhysics(rays, states, ray_count, bh);
+    clearTrails(trails, ray_count);
 
     // Reset simulation parameters
     time_dilation_factor = 1.0f;
@@ -659,109 +1043,14 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
             printf("Resetting simulation\n");
             reset = 1;
             break;
+        case GLFW_KEY_K:
+            integrator = integrator == INTEGRATOR_RK4 ? INTEGRATOR_RK45 : INTEGRATOR_RK4;
+            printf("Integrator: %s\n", integrator == INTEGRATOR_RK45 ? "adaptive RK45" : "RK4");
+            break;
         }
     }
 }
 
-void geodesic_derivatives(const State *s, double rs, State *ds)
-{
-    double r = s->r;
-    double theta = s->theta;
-    double sin_theta = sin(theta);
-    double cos_theta = cos(theta);
-
-    if (r < rs * 1.01)
-    {
-        *ds = (State){0, 0, 0, 0, 0, 0, 0};
-        return;
-    }
-
-    double A = 1.0 - rs / r;
-    double sin2_theta = sin_theta * sin_theta;
-    double E = s->energy;
-    double L = s->angular_momentum;
-
-    ds->r = s->dr;
-    ds->theta = s->dtheta;
-    ds->phi = s->dphi;
-
-    // Enhanced radial equation with energy and angular momentum conservation
-    ds->dr = -rs / (2 * r * r * A) * (E * E / A - 1) + L * L / (r * r * r) - rs * L * L / (2 * r * r * r * r);
-
-    // Angular equations
-    if (sin_theta > 1e-10)
-    {
-        ds->dtheta = L * cos_theta / (r * r * sin2_theta * sin_theta);
-        ds->dphi = L / (r * r * sin2_theta);
-    }
-    else
-    {
-        ds->dtheta = 0;
-        ds->dphi = 0;
-    }
-
-    ds->energy = 0;           // Energy is conserved
-    ds->angular_momentum = 0; // Angular momentum is conserved
-}
-
-void rk4_step(State *s, double h, double rs)
-{
-    State k1, k2, k3, k4, temp;
-
-    geodesic_derivatives(s, rs, &k1);
-
-    temp.r = s->r + 0.5 * h * k1.r;
-    temp.theta = s->theta + 0.5 * h * k1.theta;
-    temp.phi = s->phi + 0.5 * h * k1.phi;
-    temp.dr = s->dr + 0.5 * h * k1.dr;
-    temp.dtheta = s->dtheta + 0.5 * h * k1.dtheta;
-    temp.dphi = s->dphi + 0.5 * h * k1.dphi;
-    temp.energy = s->energy;
-    temp.angular_momentum = s->angular_momentum;
-    geodesic_derivatives(&temp, rs, &k2);
-
-    temp.r = s->r + 0.5 * h * k2.r;
-    temp.theta = s->theta + 0.5 * h * k2.theta;
-    temp.phi = s->phi + 0.5 * h * k2.phi;
-    temp.dr = s->dr + 0.5 * h * k2.dr;
-    temp.dtheta = s->dtheta + 0.5 * h * k2.dtheta;
-    temp.dphi = s->dphi + 0.5 * h * k2.dphi;
-    temp.energy = s->energy;
-    temp.angular_momentum = s->angular_momentum;
-    geodesic_derivatives(&temp, rs, &k3);
-
-    temp.r = s->r + h * k3.r;
-    temp.theta = s->theta + h * k3.theta;
-    temp.phi = s->phi + h * k3.phi;
-    temp.dr = s->dr + h * k3.dr;
-    temp.dtheta = s->dtheta + h * k3.dtheta;
-    temp.dphi = s->dphi + h * k3.dphi;
-    temp.energy = s->energy;
-    temp.angular_momentum = s->angular_momentum;
-    geodesic_derivatives(&temp, rs, &k4);
-
-    s->r += h * (k1.r + 2 * k2.r + 2 * k3.r + k4.r) / 6.0;
-    s->theta += h * (k1.theta + 2 * k2.theta + 2 * k3.theta + k4.theta) / 6.0;
-    s->phi += h * (k1.phi + 2 * k2.phi + 2 * k3.phi + k4.phi) / 6.0;
-    s->dr += h * (k1.dr + 2 * k2.dr + 2 * k3.dr + k4.dr) / 6.0;
-    s->dtheta += h * (k1.dtheta + 2 * k2.dtheta + 2 * k3.dtheta + k4.dtheta) / 6.0;
-    s->dphi += h * (k1.dphi + 2 * k2.dphi + 2 * k3.dphi + k4.dphi) / 6.0;
-}
-
-double calculateTimeDilation(double r, double rs)
-{
-    if (r <= rs)
-        return 0.0;
-    return sqrt(1.0 - rs / r);
-}
-
-void updateCartesianFromPolar(Ray *r, const BlackHole *bh)
-{
-    r->position.x = bh->position.x + r->r * sin(r->theta) * cos(r->phi);
-    r->position.y = bh->position.y + r->r * sin(r->theta) * sin(r->phi);
-    r->position.z = bh->position.z + r->r * cos(r->theta);
-}
-
 void drawAccretionDisk(const BlackHole *bh)
 {
     double rs = bh->schwarzschild_radius;
@@ -967,24 +1256,25 @@ void drawHelpText()
     drawGLUTText(430, 475, GLUT_BITMAP_TIMES_ROMAN_24, "T: Time dilation");
     drawGLUTText(430, 460, GLUT_BITMAP_TIMES_ROMAN_24, "+/-: Black hole mass");
     drawGLUTText(430, 445, GLUT_BITMAP_TIMES_ROMAN_24, "Enter: Reset");
+    drawGLUTText(430, 430, GLUT_BITMAP_TIMES_ROMAN_24, "K: RK4 / adaptive RK45");
 
     // View controls
-    drawGLUTText(420, 420, GLUT_BITMAP_TIMES_ROMAN_24, "VIEW:");
-    drawGLUTText(430, 400, GLUT_BITMAP_TIMES_ROMAN_24, "G: Toggle grid");
-    drawGLUTText(430, 385, GLUT_BITMAP_TIMES_ROMAN_24, "L: Toggle lensing");
-    drawGLUTText(430, 370, GLUT_BITMAP_TIMES_ROMAN_24, "I: Info panel");
-    drawGLUTText(430, 355, GLUT_BITMAP_TIMES_ROMAN_24, "H: This help");
+    drawGLUTText(420, 405, GLUT_BITMAP_TIMES_ROMAN_24, "VIEW:");
+    drawGLUTText(430, 385, GLUT_BITMAP_TIMES_ROMAN_24, "G: Toggle grid");
+    drawGLUTText(430, 370, GLUT_BITMAP_TIMES_ROMAN_24, "L: Toggle lensing");
+    drawGLUTText(430, 355, GLUT_BITMAP_TIMES_ROMAN_24, "I: Info panel");
+    drawGLUTText(430, 340, GLUT_BITMAP_TIMES_ROMAN_24, "H: This help");
 
     // Special features
-    drawGLUTText(420, 330, GLUT_BITMAP_TIMES_ROMAN_24, "SPECIAL:");
-    drawGLUTText(430, 310, GLUT_BITMAP_TIMES_ROMAN_24, "F1-F4: Scenario presets");
-    drawGLUTText(430, 295, GLUT_BITMAP_TIMES_ROMAN_24, "F: Follow ray mode");
-    drawGLUTText(430, 280, GLUT_BITMAP_TIMES_ROMAN_24, "TAB: Mouse control");
-    drawGLUTText(430, 265, GLUT_BITMAP_TIMES_ROMAN_24, "ESC: Exit");
+    drawGLUTText(420, 315, GLUT_BITMAP_TIMES_ROMAN_24, "SPECIAL:");
+    drawGLUTText(430, 295, GLUT_BITMAP_TIMES_ROMAN_24, "F1-F4: Scenario presets");
+    drawGLUTText(430, 280, GLUT_BITMAP_TIMES_ROMAN_24, "F: Follow ray mode");
+    drawGLUTText(430, 265, GLUT_BITMAP_TIMES_ROMAN_24, "TAB: Mouse control");
+    drawGLUTText(430, 250, GLUT_BITMAP_TIMES_ROMAN_24, "ESC: Exit");
 
     // Close instruction
     glColor3f(1.0f, 0.3f, 0.3f);
-    drawGLUTText(420, 230, GLUT_BITMAP_TIMES_ROMAN_24, "Press H to close this help");
+    drawGLUTText(420, 215, GLUT_BITMAP_TIMES_ROMAN_24, "Press H to close this help");
 
     // Restore 3D rendering
     glDisable(GL_BLEND);
@@ -1053,26 +1343,6 @@ void mouse_callback(GLFWwindow *window, double xpos, double ypos)
     updateCameraVectors();
 }
 
-void updatePolarCoordinates(Ray *ray, const BlackHole *bh)
-{
-    double dx = ray->position.x - bh->position.x;
-    double dy = ray->position.y - bh->position.y;
-    double dz = ray->position.z - bh->position.z;
-
-    ray->r = sqrt(dx * dx + dy * dy + dz * dz);
-
-    if (ray->r == 0)
-    {
-        ray->theta = 0.0;
-        ray->phi = 0.0;
-    }
-    else
-    {
-        ray->theta = acos(dz / ray->r);
-        ray->phi = atan2(dy, dx);
-    }
-}
-
 void drawSphere(float cx, float cy, float cz, float radius, int slices, int stacks)
 {
     for (int i = 0; i <= stacks; i++)
@@ -1179,7 +1449,7 @@ void drawEmitter(const Emitter *emitter)
     glDisable(GL_BLEND);
 }
 
-void drawRay(const Ray *ray)
+void drawRay(const RaySnapshot *ray)
 {
     if (!ray->active)
         return;
@@ -1199,22 +1469,6 @@ void drawRay(const Ray *ray)
     glEnd();
 }
 
-void drawTrail(const Ray *ray)
-{
-    if (ray->trail_length < 2)
-        return;
-
-    glBegin(GL_LINE_STRIP);
-    for (int i = 0; i < ray->trail_length; i++)
-    {
-        int idx = (ray->trail_head - ray->trail_length + i + MAX_TRAIL_POINTS) % MAX_TRAIL_POINTS;
-        float alpha = (float)i / ray->trail_length;
-        glColor4f(1.0, 1.0, 0.0, alpha * 0.7);
-        glVertex3f(ray->trail[idx].x, ray->trail[idx].y, ray->trail[idx].z);
-    }
-    glEnd();
-}
-
 void framebuffer_size_callback(GLFWwindow *window, int width, int height)
 {
     glViewport(0, 0, width, height);
@@ -1313,7 +1567,25 @@ void myLookAt(float eyeX, float eyeY, float eyeZ,
     glTranslatef(-eyeX, -eyeY, -eyeZ);
 }
 
-void generateRays(const Emitter *emitter, Ray *rays, int num_rays, const BlackHole *blackhole)
+static inline uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Counter-based random number in [0, 1): a pure function of (seed, stream, counter), so samples
+ * can be drawn in any order and on any thread, and the same seed always replays the same values.
+ */
+double counterRandom(uint64_t seed, uint64_t stream, uint64_t counter)
+{
+    uint64_t z = mix64(mix64(seed + stream * 0x9e3779b97f4a7c15ull) + counter * 0x9e3779b97f4a7c15ull);
+    return (z >> 11) * 0x1.0p-53;
+}
+
+// Emits num_rays rays into the emitter's cone. Ray i depends only on (seed, stream, i).
+void generateRays(const Emitter *emitter, Ray *rays, int num_rays, const BlackHole *blackhole, uint64_t stream)
 {
     // Calculate direction towards black hole
     Vector3 toBlackHole;
@@ -1359,11 +1631,24 @@ void generateRays(const Emitter *emitter, Ray *rays, int num_rays, const BlackHo
     double fov_rad = emitter->fov * M_PI / 180.0;
     double max_angle = fov_rad / 2.0;
 
+    // The spiral is turned by a random angle per stream so successive emissions differ
+    double rotation = counterRandom(emission_seed, stream, UINT64_MAX);
+
     for (int i = 0; i < num_rays; i++)
     {
-        // Uniform sampling within cone
-        double u = (double)rand() / RAND_MAX;
-        double v = (double)rand() / RAND_MAX;
+        // Uniform sampling within cone: u picks the area fraction, v the angle
+        double u, v;
+        if (sampling == SAMPLING_STRATIFIED)
+        {
+            // Golden-angle spiral: equal area per ray and no two rays bunched together
+            u = (i + 0.5) / num_rays;
+            v = fmod(rotation + i * 0.6180339887498949, 1.0);
+        }
+        else
+        {
+            u = counterRandom(emission_seed, stream, 2 * (uint64_t)i);
+            v = counterRandom(emission_seed, stream, 2 * (uint64_t)i + 1);
+        }
 
         // Uniform sampling in circular area (cone projection)
         double r = sqrt(u) * tan(max_angle);
@@ -1388,8 +1673,6 @@ void generateRays(const Emitter *emitter, Ray *rays, int num_rays, const BlackHo
         // Assign to ray
         rays[i].position = emitter->pos;
         rays[i].direction = direction;
-        rays[i].trail_head = 0;
-        rays[i].trail_length = 0;
         rays[i].active = 1;
 
         // Set color based on initial direction (for visual variety)
@@ -1428,36 +1711,14 @@ void initEmitter2(Emitter *emitter)
     emitter->fov = 15.0f;
 }
 
-double distanceToCamera(const Ray *ray, const Camera *cam)
+double distanceToCamera(const Vector3 *position, const Camera *cam)
 {
-    double dx = ray->position.x - cam->posX;
-    double dy = ray->position.y - cam->posY;
-    double dz = ray->position.z - cam->posZ;
+    double dx = position->x - cam->posX;
+    double dy = position->y - cam->posY;
+    double dz = position->z - cam->posZ;
     return sqrt(dx * dx + dy * dy + dz * dz);
 }
 
-void updateRaysLOD(Ray *rays, int num_rays, const Camera *cam, const BlackHole *bh)
-{
-    for (int i = 0; i < num_rays; i++)
-    {
-        if (!rays[i].active)
-            continue;
-
-        double dist_to_camera = distanceToCamera(&rays[i], cam);
-
-        // Level of Detail based on distance
-        int should_update = 1;
-        if (dist_to_camera > LOD_DISTANCE_2)
-        {
-            should_update = (frame_count % 4 == 0); // Update every 4th frame
-        }
-        else if (dist_to_camera > LOD_DISTANCE_1)
-        {
-            should_update = (frame_count % 2 == 0); // Update every 2nd frame
-        }
-    }
-}
-
 extern Ray *current_rays;
 extern int current_num_rays;
 
@@ -1532,10 +1793,10 @@ void drawInfoPanel()
 
     drawGLUTText(20, 720, GLUT_BITMAP_TIMES_ROMAN_24, "Active Rays:");
     char rays_text[100];
-    snprintf(rays_text, sizeof(rays_text), "%d / %d", ray_count, NUM_RAYS);
+    snprintf(rays_text, sizeof(rays_text), "%d / %d", active_rays, ray_count);
     drawGLUTText(150, 720, GLUT_BITMAP_TIMES_ROMAN_24, rays_text);
 
-    drawProgressBar((float)ray_count / NUM_RAYS, 20, 705, 200, 0.2f, 0.8f, 0.2f);
+    drawProgressBar((float)active_rays / ray_count, 20, 705, 200, 0.2f, 0.8f, 0.2f);
 
     drawGLUTText(20, 690, GLUT_BITMAP_TIMES_ROMAN_24, "Time Dilation Factor:");
     char time_text[100];
@@ -1553,6 +1814,14 @@ void drawInfoPanel()
     glColor3f(showLensing ? 0.3f : 1.0f, showLensing ? 1.0f : 0.3f, 0.3f);
     drawGLUTText(220, 650, GLUT_BITMAP_TIMES_ROMAN_24, showLensing ? "LENS ON" : "LENS OFF");
 
+    glColor3f(0.9f, 0.9f, 0.9f);
+    char integrator_text[100];
+    if (integrator == INTEGRATOR_RK45)
+        snprintf(integrator_text, sizeof(integrator_text), "RK45 tol %.0e, %lld evals/frame", tolerance, frame_evaluations);
+    else
+        snprintf(integrator_text, sizeof(integrator_text), "RK4, %lld evals/frame", frame_evaluations);
+    drawGLUTText(20, 625, GLUT_BITMAP_TIMES_ROMAN_24, integrator_text);
+
     glDisable(GL_BLEND);
     glEnable(GL_DEPTH_TEST);
     glPopMatrix();
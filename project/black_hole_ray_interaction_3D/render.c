@@ -0,0 +1,475 @@
+/*
+ * Headless lensing renderer: traces one geodesic per pixel backwards from a pinhole camera with
+ * the same ray state and integrators as the interactive simulator, and writes PNG or PPM frames.
+ * Needs no display or OpenGL, so it runs on compute nodes.
+ *
+ *   ./render [--width N] [--height N] [--fov DEG] [--distance D] [--inclination DEG]
+ *            [--azimuth DEG] [--rs R] [--frames N] [--threads N] [--tolerance X] [--output FILE]
+ */
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "geodesic.h"
+
+#define TILE_SIZE 32
+#define SEGMENT_FRACTION 0.05 // each segment covers this fraction of the current radius
+#define MAX_SEGMENTS 4000
+#define MIN_TRANSMITTANCE 0.01
+
+typedef struct
+{
+    Vector3 position;
+    Vector3 forward, right, up;
+    double tan_half_fov;
+} PinholeCamera;
+
+// One frame being rendered, shared read-only by the workers apart from the counters
+typedef struct
+{
+    int width, height;
+    PinholeCamera camera;
+    BlackHole bh;
+    double tolerance;
+    double escape_radius;
+    float *pixels; // RGB, row-major
+    int tiles_x, num_tiles;
+    atomic_int next_tile;
+    atomic_llong evaluations;
+} RenderJob;
+
+void *renderWorker(void *arg);
+void renderTile(RenderJob *job, int tile, Ray *rays, RayStates *states);
+void skyColor(double dx, double dy, double dz, float *rgb);
+int diskCrossing(const double *p0, const double *p1, double rs, float *rgb, float *alpha);
+PinholeCamera orbitCamera(double distance, double inclination, double azimuth, double fov);
+int writePPM(const char *path, const float *pixels, int width, int height);
+int writePNG(const char *path, const float *pixels, int width, int height);
+double now_seconds();
+
+int main(int argc, char *argv[])
+{
+    int width = 640, height = 360, frames = 1;
+    double fov = 60.0, distance = 60.0, inclination = 8.0, azimuth = 0.0, rs = 3.0;
+    double tolerance = DEFAULT_TOLERANCE;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cpus > 0 ? (int)cpus : 1;
+    const char *output = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+            width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+            height = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--fov") == 0 && i + 1 < argc)
+            fov = atof(argv[++i]);
+        else if (strcmp(argv[i], "--distance") == 0 && i + 1 < argc)
+            distance = atof(argv[++i]);
+        else if (strcmp(argv[i], "--inclination") == 0 && i + 1 < argc)
+            inclination = atof(argv[++i]);
+        else if (strcmp(argv[i], "--azimuth") == 0 && i + 1 < argc)
+            azimuth = atof(argv[++i]);
+        else if (strcmp(argv[i], "--rs") == 0 && i + 1 < argc)
+            rs = atof(argv[++i]);
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+            tolerance = atof(argv[++i]);
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+        {
+            printf("Usage: %s [--width N] [--height N] [--fov DEG] [--distance D] [--inclination DEG] "
+                   "[--azimuth DEG] [--rs R] [--frames N] [--threads N] [--tolerance X] [--output FILE]\n",
+                   argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!output)
+        output = frames > 1 ? "frame_%04d.png" : "render.png";
+    if (width < 1 || height < 1 || frames < 1 || num_threads < 1 || rs <= 0.0 || distance <= 2.0 * rs ||
+        fov <= 0.0 || fov >= 180.0 || fabs(inclination) >= 90.0 || tolerance <= 0.0)
+    {
+        printf("Invalid size, frame count, thread count, radius, distance, field of view, inclination or tolerance\n");
+        exit(EXIT_FAILURE);
+    }
+    if (frames > 1 && !strchr(output, '%'))
+    {
+        printf("--frames needs an output pattern with a frame number, e.g. frame_%%04d.png\n");
+        exit(EXIT_FAILURE);
+    }
+
+    RenderJob job = {
+        .width = width,
+        .height = height,
+        .bh = {.position = {0.0, 0.0, 0.0}, .schwarzschild_radius = rs, .mass = 1.0},
+        .tolerance = tolerance,
+        .escape_radius = 2.0 * distance,
+        .tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE,
+    };
+    job.num_tiles = job.tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    job.pixels = malloc((size_t)width * height * 3 * sizeof(float));
+    if (!job.pixels)
+    {
+        printf("Unable to allocate a %dx%d image\n", width, height);
+        exit(EXIT_FAILURE);
+    }
+    if (num_threads > job.num_tiles)
+        num_threads = job.num_tiles;
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        // A frame sequence makes one full orbit around the hole
+        double frame_azimuth = azimuth + 360.0 * frame / frames;
+        job.camera = orbitCamera(distance, inclination, frame_azimuth, fov);
+        atomic_store(&job.next_tile, 0);
+        atomic_store(&job.evaluations, 0);
+
+        double start = now_seconds();
+        for (int t = 0; t < num_threads; t++)
+            pthread_create(&threads[t], NULL, renderWorker, &job);
+        for (int t = 0; t < num_threads; t++)
+            pthread_join(threads[t], NULL);
+        double seconds = now_seconds() - start;
+
+        char path[4096];
+        snprintf(path, sizeof(path), output, frame);
+        size_t len = strlen(path);
+        int ok = len > 4 && strcmp(path + len - 4, ".ppm") == 0 ? writePPM(path, job.pixels, width, height)
+                                                                 : writePNG(path, job.pixels, width, height);
+        if (ok != 0)
+        {
+            printf("Unable to write %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        long long evaluations = atomic_load(&job.evaluations);
+        printf("%s: %dx%d in %.2f s on %d threads, %.1f M derivative evaluations (%.0f per pixel)\n", path,
+               width, height, seconds, num_threads, evaluations / 1e6, (double)evaluations / (width * height));
+    }
+
+    free(threads);
+    free(job.pixels);
+    return 0;
+}
+
+void *renderWorker(void *arg)
+{
+    RenderJob *job = arg;
+    Ray *rays = malloc(TILE_SIZE * TILE_SIZE * sizeof(Ray));
+    RayStates states = allocRayStates(TILE_SIZE * TILE_SIZE);
+
+    for (int tile = atomic_fetch_add(&job->next_tile, 1); tile < job->num_tiles;
+         tile = atomic_fetch_add(&job->next_tile, 1))
+    {
+        renderTile(job, tile, rays, &states);
+    }
+
+    freeRayStates(&states);
+    free(rays);
+    return NULL;
+}
+
+void renderTile(RenderJob *job, int tile, Ray *rays, RayStates *states)
+{
+    const PinholeCamera *cam = &job->camera;
+    double rs = job->bh.schwarzschild_radius;
+    int x0 = tile % job->tiles_x * TILE_SIZE;
+    int y0 = tile / job->tiles_x * TILE_SIZE;
+    int tile_w = job->width - x0 < TILE_SIZE ? job->width - x0 : TILE_SIZE;
+    int tile_h = job->height - y0 < TILE_SIZE ? job->height - y0 : TILE_SIZE;
+    int n = tile_w * tile_h;
+    double aspect = (double)job->width / job->height;
+
+    for (int i = 0; i < n; i++)
+    {
+        int px = x0 + i % tile_w;
+        int py = y0 + i / tile_w;
+        double u = (2.0 * (px + 0.5) / job->width - 1.0) * cam->tan_half_fov * aspect;
+        double v = (1.0 - 2.0 * (py + 0.5) / job->height) * cam->tan_half_fov;
+        double dx = cam->forward.x + u * cam->right.x + v * cam->up.x;
+        double dy = cam->forward.y + u * cam->right.y + v * cam->up.y;
+        double dz = cam->forward.z + u * cam->right.z + v * cam->up.z;
+        double len = sqrt(dx * dx + dy * dy + dz * dz);
+        rays[i].position = cam->position;
+        rays[i].direction = (Vector3){dx / len, dy / len, dz / len};
+    }
+    initRayPhysics(rays, states, n, &job->bh);
+
+    long evaluations = 0;
+    for (int base = 0; base < n; base += RAY_LANES)
+    {
+        double prev[3][RAY_LANES], offset[3][RAY_LANES], velocity[3][RAY_LANES];
+        double interval[RAY_LANES];
+        long long step[RAY_LANES];
+        float color[RAY_LANES][3] = {{0}};
+        double transmittance[RAY_LANES];
+        int live = 0;
+
+        for (int l = 0; l < RAY_LANES; l++)
+        {
+            step[l] = base + l < n ? -1 : 0;
+            transmittance[l] = 1.0;
+            live += step[l] ? 1 : 0;
+        }
+        polarToCartesianLanes(states, base, prev, velocity);
+
+        for (int segment = 0; live > 0 && segment < MAX_SEGMENTS; segment++)
+        {
+            for (int l = 0; l < RAY_LANES; l++)
+                interval[l] = step[l] ? SEGMENT_FRACTION * states->r[base + l] : 0.0;
+            evaluations += rk45_advance_lanes(states, base, interval, step, rs, job->tolerance);
+            polarToCartesianLanes(states, base, offset, velocity);
+
+            for (int l = 0; l < RAY_LANES; l++)
+            {
+                if (!step[l])
+                    continue;
+
+                int i = base + l;
+                double p0[3] = {prev[0][l], prev[1][l], prev[2][l]};
+                double p1[3] = {offset[0][l], offset[1][l], offset[2][l]};
+                float disk[3], alpha;
+                if (diskCrossing(p0, p1, rs, disk, &alpha))
+                {
+                    for (int c = 0; c < 3; c++)
+                        color[l][c] += transmittance[l] * alpha * disk[c];
+                    transmittance[l] *= 1.0 - alpha;
+                }
+                for (int c = 0; c < 3; c++)
+                    prev[c][l] = offset[c][l];
+
+                int done = transmittance[l] < MIN_TRANSMITTANCE || states->r[i] <= rs * 1.05;
+                if (!done && states->r[i] > job->escape_radius && states->dr[i] > 0.0)
+                {
+                    float sky[3];
+                    skyColor(velocity[0][l], velocity[1][l], velocity[2][l], sky);
+                    for (int c = 0; c < 3; c++)
+                        color[l][c] += transmittance[l] * sky[c];
+                    done = 1;
+                }
+                if (done)
+                {
+                    step[l] = 0;
+                    live--;
+                }
+            }
+        }
+
+        // Rays still orbiting after MAX_SEGMENTS keep what they collected, like captured ones
+        for (int l = 0; l < RAY_LANES && base + l < n; l++)
+        {
+            int i = base + l;
+            float *out = &job->pixels[((size_t)(y0 + i / tile_w) * job->width + x0 + i % tile_w) * 3];
+            out[0] = color[l][0];
+            out[1] = color[l][1];
+            out[2] = color[l][2];
+        }
+    }
+    atomic_fetch_add(&job->evaluations, evaluations);
+}
+
+/*
+ * Where a segment passes through the y = 0 plane inside the disk, returns the disk colour and
+ * opacity there, matching the rings drawn by drawAccretionDisk in the interactive view.
+ */
+int diskCrossing(const double *p0, const double *p1, double rs, float *rgb, float *alpha)
+{
+    if ((p0[1] > 0.0) == (p1[1] > 0.0) || p0[1] == p1[1])
+        return 0;
+
+    double t = p0[1] / (p0[1] - p1[1]);
+    double x = p0[0] + t * (p1[0] - p0[0]);
+    double z = p0[2] + t * (p1[2] - p0[2]);
+    double radius = sqrt(x * x + z * z);
+    double inner_radius = 3.0 * rs;
+    double outer_radius = 15.0 * rs;
+    if (radius < inner_radius || radius > outer_radius)
+        return 0;
+
+    double ring = 50.0 * (radius - inner_radius) / (outer_radius - inner_radius);
+    double temp_factor = inner_radius / radius;
+    rgb[0] = fmin(1.0, temp_factor * 2.0);
+    rgb[1] = fmin(1.0, temp_factor);
+    rgb[2] = fmin(0.5, temp_factor * 0.5);
+    *alpha = 0.6f * (1.0f - (float)ring / 50.0f);
+    return 1;
+}
+
+// Background for escaped rays: the simulator's clear colour with a latitude grid and hashed stars
+void skyColor(double dx, double dy, double dz, float *rgb)
+{
+    double len = sqrt(dx * dx + dy * dy + dz * dz);
+    if (len == 0.0)
+        len = 1.0;
+    double lon = atan2(dz, dx) * 180.0 / M_PI + 180.0;
+    double lat = asin(fmax(-1.0, fmin(1.0, dy / len))) * 180.0 / M_PI + 90.0;
+
+    rgb[0] = 0.02f;
+    rgb[1] = 0.02f;
+    rgb[2] = 0.05f;
+
+    // Grid lines every 15 degrees show how the background is distorted
+    double grid_lon = fabs(fmod(lon, 15.0) - 7.5);
+    double grid_lat = fabs(fmod(lat, 15.0) - 7.5);
+    if (grid_lon > 7.2 || grid_lat > 7.2)
+    {
+        rgb[0] += 0.08f;
+        rgb[1] += 0.08f;
+        rgb[2] += 0.12f;
+    }
+
+    uint32_t cell = (uint32_t)(lon * 8.0) * 2654435761u ^ (uint32_t)(lat * 8.0) * 2246822519u;
+    cell ^= cell >> 15;
+    cell *= 2246822519u;
+    cell ^= cell >> 13;
+    if ((cell & 0xff) < 3)
+    {
+        float brightness = 0.4f + 0.6f * ((cell >> 8) & 0xff) / 255.0f;
+        rgb[0] += brightness;
+        rgb[1] += brightness;
+        rgb[2] += brightness;
+    }
+}
+
+PinholeCamera orbitCamera(double distance, double inclination, double azimuth, double fov)
+{
+    double inc = inclination * M_PI / 180.0;
+    double az = azimuth * M_PI / 180.0;
+    PinholeCamera cam;
+    cam.position = (Vector3){distance * cos(inc) * cos(az), distance * sin(inc), distance * cos(inc) * sin(az)};
+
+    // Look at the hole with the disk normal (+y) as up
+    cam.forward = (Vector3){-cam.position.x / distance, -cam.position.y / distance, -cam.position.z / distance};
+    double len = sqrt(cam.forward.x * cam.forward.x + cam.forward.z * cam.forward.z);
+    cam.right = (Vector3){-cam.forward.z / len, 0.0, cam.forward.x / len};
+    cam.up = (Vector3){cam.right.y * cam.forward.z - cam.right.z * cam.forward.y,
+                       cam.right.z * cam.forward.x - cam.right.x * cam.forward.z,
+                       cam.right.x * cam.forward.y - cam.right.y * cam.forward.x};
+    cam.tan_half_fov = tan(fov * M_PI / 360.0);
+    return cam;
+}
+
+static unsigned char toByte(float value)
+{
+    return (unsigned char)(fminf(1.0f, fmaxf(0.0f, value)) * 255.0f + 0.5f);
+}
+
+int writePPM(const char *path, const float *pixels, int width, int height)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return -1;
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    for (size_t i = 0; i < (size_t)width * height * 3; i++)
+        fputc(toByte(pixels[i]), file);
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t len)
+{
+    static uint32_t table[256];
+    if (!table[1])
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+    for (size_t i = 0; i < len; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static void writeChunk(FILE *file, const char *type, const unsigned char *data, uint32_t len)
+{
+    unsigned char header[8] = {len >> 24, len >> 16, len >> 8, len, type[0], type[1], type[2], type[3]};
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, len, file);
+    uint32_t crc = ~crc32Update(crc32Update(0xffffffffu, header + 4, 4), data, len);
+    unsigned char trailer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+    fwrite(trailer, 1, 4, file);
+}
+
+// PNG with the image data in uncompressed deflate blocks, so no zlib is needed
+int writePNG(const char *path, const float *pixels, int width, int height)
+{
+    size_t row = (size_t)width * 3 + 1;
+    size_t raw_len = row * height;
+    size_t blocks = (raw_len + 65534) / 65535;
+    size_t zlen = 2 + raw_len + blocks * 5 + 4;
+    unsigned char *raw = malloc(raw_len);
+    unsigned char *zdata = malloc(zlen);
+    if (!raw || !zdata || zlen > 0xffffffffu)
+    {
+        free(raw);
+        free(zdata);
+        return -1;
+    }
+
+    for (int y = 0; y < height; y++)
+    {
+        raw[y * row] = 0; // no filter
+        for (size_t x = 0; x < (size_t)width * 3; x++)
+            raw[y * row + 1 + x] = toByte(pixels[(size_t)y * width * 3 + x]);
+    }
+
+    size_t pos = 0;
+    zdata[pos++] = 0x78;
+    zdata[pos++] = 0x01;
+    uint32_t a = 1, b = 0;
+    for (size_t offset = 0; offset < raw_len; offset += 65535)
+    {
+        size_t len = raw_len - offset < 65535 ? raw_len - offset : 65535;
+        zdata[pos++] = offset + len == raw_len;
+        zdata[pos++] = len & 0xff;
+        zdata[pos++] = len >> 8;
+        zdata[pos++] = ~len & 0xff;
+        zdata[pos++] = (~len >> 8) & 0xff;
+        memcpy(zdata + pos, raw + offset, len);
+        pos += len;
+        for (size_t i = 0; i < len; i++)
+        {
+            a = (a + raw[offset + i]) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    uint32_t adler = b << 16 | a;
+    zdata[pos++] = adler >> 24;
+    zdata[pos++] = adler >> 16;
+    zdata[pos++] = adler >> 8;
+    zdata[pos++] = adler;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        free(raw);
+        free(zdata);
+        return -1;
+    }
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, 8, file);
+    unsigned char ihdr[13] = {width >> 24, width >> 16, width >> 8, width, height >> 24, height >> 16,
+                              height >> 8, height, 8, 2, 0, 0, 0}; // 8-bit RGB
+    writeChunk(file, "IHDR", ihdr, 13);
+    writeChunk(file, "IDAT", zdata, (uint32_t)pos);
+    writeChunk(file, "IEND", NULL, 0);
+
+    free(raw);
+    free(zdata);
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,322 @@
+/*
+ * Benchmark driver: loads a table into a temporary file, then runs a random
+ * mix of inserts, point lookups and short range scans against it and reports
+ * throughput, latency percentiles and pager counters for the measured phase.
+ * With --readers, that many threads scan the whole table through snapshots
+ * meanwhile and check every scan.
+ *
+ *   ./bench [--rows N] [--ops N] [--mix INSERT,LOOKUP,SCAN] [--scan-rows N]
+ *           [--frames N] [--mmap] [--async-commit] [--readers N] [--seed N]
+ */
+#define DB_NO_MAIN
+#include "main.c"
+
+typedef enum
+{
+    OP_INSERT,
+    OP_LOOKUP,
+    OP_SCAN,
+    NUM_OPS
+} BenchOp;
+
+/*
+ * Multiplying by an odd constant is a bijection on 31 bits, so row k of the
+ * load gets a unique id and ids arrive in random order.
+ */
+uint32_t bench_id(uint32_t k)
+{
+    return ((k + 1) * 2654435761u) & 0x7fffffff;
+}
+
+uint64_t bench_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+void bench_row(uint32_t k, Row *row)
+{
+    row->id = bench_id(k);
+    sprintf(row->username, "user%u", k % 10000);
+    sprintf(row->email, "user%u@example.com", k);
+}
+
+/*
+ * State shared by the writer and the --readers threads. The writer commits and
+ * bumps committed_rows under the mutex, so a snapshot opened under it must see
+ * exactly committed_rows rows.
+ */
+typedef struct
+{
+    Table *table;
+    pthread_mutex_t mutex;
+    uint32_t committed_rows;
+    bool stop;
+    uint64_t scans;
+    uint64_t rows_read;
+    uint64_t bad_scans;
+} BenchReaders;
+
+/*
+ * Reader thread: full snapshot scans back to back until told to stop. A scan
+ * is bad if its ids are not strictly increasing or it does not return the
+ * number of rows committed when its snapshot was opened.
+ */
+void *bench_reader(void *arg)
+{
+    BenchReaders *readers = arg;
+    uint64_t scans = 0;
+    uint64_t rows_read = 0;
+    uint64_t bad_scans = 0;
+    Row row;
+
+    while (true)
+    {
+        pthread_mutex_lock(&readers->mutex);
+        if (readers->stop)
+        {
+            pthread_mutex_unlock(&readers->mutex);
+            break;
+        }
+        Snapshot *snapshot = snapshot_open(readers->table);
+        uint32_t expected_rows = readers->committed_rows;
+        pthread_mutex_unlock(&readers->mutex);
+
+        Cursor *cursor = snapshot_start(snapshot);
+        uint32_t num_rows = 0;
+        uint32_t last_id = 0;
+        bool sorted = true;
+        while (!cursor->end_of_table)
+        {
+            cursor_row(cursor, &row);
+            if (num_rows > 0 && row.id <= last_id)
+            {
+                sorted = false;
+            }
+            last_id = row.id;
+            num_rows++;
+            cursor_advance(cursor);
+        }
+        cursor_close(cursor);
+        snapshot_close(snapshot);
+
+        if (!sorted || num_rows != expected_rows)
+        {
+            if (bad_scans == 0)
+            {
+                printf("Bad snapshot scan: %u rows, expected %u, %s\n", num_rows, expected_rows,
+                       sorted ? "sorted" : "out of order");
+            }
+            bad_scans++;
+        }
+        scans++;
+        rows_read += num_rows;
+    }
+
+    pthread_mutex_lock(&readers->mutex);
+    readers->scans += scans;
+    readers->rows_read += rows_read;
+    readers->bad_scans += bad_scans;
+    pthread_mutex_unlock(&readers->mutex);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_rows = 100000;
+    uint32_t num_ops = 100000;
+    uint32_t mix[NUM_OPS] = {10, 85, 5};
+    uint32_t scan_rows = 100;
+    uint32_t num_frames = DEFAULT_POOL_FRAMES;
+    bool use_mmap = false;
+    bool async_commit = false;
+    uint32_t num_readers = 0;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc)
+        {
+            num_rows = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+        {
+            num_ops = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc &&
+                 sscanf(argv[++i], "%u,%u,%u", &mix[OP_INSERT], &mix[OP_LOOKUP], &mix[OP_SCAN]) == 3)
+        {
+            continue;
+        }
+        else if (strcmp(argv[i], "--scan-rows") == 0 && i + 1 < argc)
+        {
+            scan_rows = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            num_frames = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            use_mmap = true;
+        }
+        else if (strcmp(argv[i], "--async-commit") == 0)
+        {
+            async_commit = true;
+        }
+        else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc)
+        {
+            num_readers = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else
+        {
+            printf("Usage: %s [--rows N] [--ops N] [--mix INSERT,LOOKUP,SCAN] [--scan-rows N] [--frames N] [--mmap] "
+                   "[--async-commit] [--readers N] [--seed N]\n",
+                   argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint32_t mix_total = mix[OP_INSERT] + mix[OP_LOOKUP] + mix[OP_SCAN];
+    if (num_frames < MIN_POOL_FRAMES || mix_total == 0 || seed == 0 || num_readers > MAX_READERS)
+    {
+        printf("Need at least %d frames, a non-zero mix, a non-zero seed and at most %d readers\n", MIN_POOL_FRAMES,
+               MAX_READERS);
+        exit(EXIT_FAILURE);
+    }
+
+    char filename[] = "/tmp/bench-XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd == -1)
+    {
+        printf("Unable to create a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    Table *table = db_open(filename, num_frames, use_mmap);
+    table->pager->async_commit = async_commit;
+
+    // Load phase: one commit per IMPORT_BATCH_ROWS rows.
+    uint64_t load_start = now_ns();
+    Row row;
+    for (uint32_t k = 0; k < num_rows; k++)
+    {
+        bench_row(k, &row);
+        table_insert(table, &row);
+        if ((k + 1) % IMPORT_BATCH_ROWS == 0)
+        {
+            pager_commit(table->pager);
+        }
+    }
+    pager_commit(table->pager);
+    double load_seconds = (now_ns() - load_start) / 1e9;
+    printf("Loaded %u rows in %.3f s (%.0f rows/s), %u pages\n", num_rows, load_seconds,
+           load_seconds > 0 ? num_rows / load_seconds : 0.0, table->pager->num_pages);
+
+    // Measured phase.
+    BenchReaders readers = {table, PTHREAD_MUTEX_INITIALIZER, num_rows, false, 0, 0, 0};
+    pthread_t *reader_threads = malloc(num_readers * sizeof(pthread_t));
+    for (uint32_t i = 0; i < num_readers; i++)
+    {
+        pthread_create(&reader_threads[i], NULL, bench_reader, &readers);
+    }
+    LatencyHistogram *latency = calloc(NUM_OPS, sizeof(LatencyHistogram));
+    PagerStats before = pager_stats(table->pager);
+    uint64_t rows_scanned = 0;
+    uint32_t max_wal_frames = 0;
+    uint32_t next_row = num_rows;
+    uint64_t run_start = now_ns();
+    for (uint32_t i = 0; i < num_ops; i++)
+    {
+        uint32_t pick = bench_random(&seed) % mix_total;
+        BenchOp op = pick < mix[OP_INSERT] ? OP_INSERT : pick < mix[OP_INSERT] + mix[OP_LOOKUP] ? OP_LOOKUP : OP_SCAN;
+        uint32_t k = next_row > 0 ? bench_random(&seed) % next_row : 0;
+
+        uint64_t op_start = now_ns();
+        switch (op)
+        {
+        case OP_INSERT:
+            bench_row(next_row++, &row);
+            pthread_mutex_lock(&readers.mutex);
+            table_insert(table, &row);
+            pager_commit(table->pager);
+            readers.committed_rows++;
+            pthread_mutex_unlock(&readers.mutex);
+            if (table->pager->wal_frames > max_wal_frames)
+            {
+                max_wal_frames = table->pager->wal_frames;
+            }
+            break;
+        case OP_LOOKUP:
+        {
+            Cursor *cursor = table_find(table, bench_id(k));
+            if (cursor->cell_num < *leaf_node_num_cells(cursor->page))
+            {
+                cursor_row(cursor, &row);
+            }
+            cursor_close(cursor);
+            break;
+        }
+        case OP_SCAN:
+        {
+            Cursor *cursor = table_seek(table, bench_id(k));
+            for (uint32_t n = 0; n < scan_rows && !cursor->end_of_table; n++)
+            {
+                cursor_row(cursor, &row);
+                rows_scanned++;
+                cursor_advance(cursor);
+            }
+            cursor_close(cursor);
+            break;
+        }
+        default:
+            break;
+        }
+        latency_record(&latency[op], now_ns() - op_start);
+    }
+    double run_seconds = (now_ns() - run_start) / 1e9;
+    PagerStats after = pager_stats(table->pager);
+
+    pthread_mutex_lock(&readers.mutex);
+    readers.stop = true;
+    pthread_mutex_unlock(&readers.mutex);
+    for (uint32_t i = 0; i < num_readers; i++)
+    {
+        pthread_join(reader_threads[i], NULL);
+    }
+    free(reader_threads);
+
+    printf("Ran %u operations in %.3f s (%.0f ops/s, %llu rows scanned)\n", num_ops, run_seconds,
+           run_seconds > 0 ? num_ops / run_seconds : 0.0, (unsigned long long)rows_scanned);
+    const char *names[NUM_OPS] = {"insert", "lookup", "scan"};
+    for (uint32_t op = 0; op < NUM_OPS; op++)
+    {
+        print_latency(names[op], &latency[op]);
+    }
+
+    PagerStats delta = {
+        after.cache_hits - before.cache_hits,
+        after.cache_misses - before.cache_misses,
+        after.mapped_reads - before.mapped_reads,
+        after.snapshot_reads - before.snapshot_reads,
+        after.frames_written - before.frames_written,
+        after.pages_checkpointed - before.pages_checkpointed,
+    };
+    print_pager_stats(&delta);
+    if (num_readers > 0)
+    {
+        printf("Readers: %u threads, %llu snapshot scans, %llu rows read, %llu bad scans, log peaked at %u frames\n",
+               num_readers, (unsigned long long)readers.scans, (unsigned long long)readers.rows_read,
+               (unsigned long long)readers.bad_scans, max_wal_frames);
+    }
+
+    free(latency);
+    db_close(table);
+    unlink(filename);
+    return readers.bad_scans == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,11 +6,29 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
-#define TABLE_MAX_PAGES 100
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+#define DEFAULT_POOL_FRAMES 1024
+#define MIN_POOL_FRAMES 32
+#define WAL_SYNC_COMMITS 64        // with async_commit, fsync the log at least every N commits...
+#define WAL_SYNC_INTERVAL_MS 10    // ...and never later than this after a commit
+#define WAL_CHECKPOINT_FRAMES 1024 // wake the checkpointer after this many new frames
+#define WAL_RESTART_FRAMES 4096    // checkpoint synchronously if the log grows past this
+#define WAL_MAX_FRAMES 16384       // past this the writer waits for old snapshots so the log can restart
+#define IMPORT_BATCH_ROWS 4096
+#define MMAP_RESERVE_BYTES ((size_t)1 << 36) // address space reserved for the mmap read path
+#define MAX_READERS 64                       // snapshots open at once
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS ((64 - 3) * LATENCY_SUB_BUCKETS)
 
 typedef struct
 {
@@ -27,33 +45,219 @@ const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 const uint32_t PAGE_SIZE = 4096;
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+
+/*
+ * File header (page 0)
+ */
+const char DB_FILE_MAGIC[8] = "CDBFILE";
+const uint32_t DB_FORMAT_VERSION = 2;
+const uint32_t HEADER_MAGIC_SIZE = sizeof(DB_FILE_MAGIC);
+const uint32_t HEADER_MAGIC_OFFSET = 0;
+const uint32_t HEADER_VERSION_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET = HEADER_VERSION_OFFSET + HEADER_VERSION_SIZE;
+const uint32_t HEADER_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_INDEX_ROOTS_OFFSET = HEADER_ROOT_PAGE_OFFSET + HEADER_ROOT_PAGE_SIZE;
+
+/*
+ * Write-ahead log (<db>-wal): a header followed by frames, each a frame header
+ * and a full page image. A frame with a non-zero db size ends a commit.
+ */
+const char WAL_FILE_MAGIC[8] = "CDBWAL";
+const uint32_t WAL_MAGIC_SIZE = sizeof(WAL_FILE_MAGIC);
+const uint32_t WAL_MAGIC_OFFSET = 0;
+const uint32_t WAL_SALT_OFFSET = WAL_MAGIC_OFFSET + WAL_MAGIC_SIZE;
+const uint32_t WAL_HEADER_SIZE = WAL_SALT_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_PAGE_NUM_OFFSET = 0;
+const uint32_t WAL_FRAME_DB_SIZE_OFFSET = WAL_FRAME_PAGE_NUM_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_SALT_OFFSET = WAL_FRAME_DB_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_CHECKSUM_OFFSET = WAL_FRAME_SALT_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_FRAME_HEADER_SIZE = WAL_FRAME_CHECKSUM_OFFSET + sizeof(uint32_t);
+
+/*
+ * Secondary index layout (extendible hashing). The meta page holds the global
+ * depth and the pages of the directory, which maps the low global-depth bits
+ * of a value's hash to a bucket page. Buckets hold (hash, id) entries.
+ */
+const uint32_t INDEX_GLOBAL_DEPTH_OFFSET = 0;
+const uint32_t INDEX_NUM_DIR_PAGES_OFFSET = INDEX_GLOBAL_DEPTH_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_DIR_PAGES_OFFSET = INDEX_NUM_DIR_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_DIR_ENTRIES_PER_PAGE = PAGE_SIZE / sizeof(uint32_t);
+const uint32_t INDEX_MAX_GLOBAL_DEPTH = 19; // 512 directory pages
+const uint32_t BUCKET_LOCAL_DEPTH_OFFSET = 0;
+const uint32_t BUCKET_NUM_ENTRIES_OFFSET = BUCKET_LOCAL_DEPTH_OFFSET + sizeof(uint32_t);
+const uint32_t BUCKET_OVERFLOW_OFFSET = BUCKET_NUM_ENTRIES_OFFSET + sizeof(uint32_t);
+const uint32_t BUCKET_HEADER_SIZE = BUCKET_OVERFLOW_OFFSET + sizeof(uint32_t);
+const uint32_t BUCKET_ENTRY_SIZE = 2 * sizeof(uint32_t);
+const uint32_t BUCKET_MAX_ENTRIES = (PAGE_SIZE - BUCKET_HEADER_SIZE) / BUCKET_ENTRY_SIZE;
+
+/*
+ * Common Node Header Layout
+ */
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 const uint32_t NODE_TYPE_OFFSET = 0;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET;
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
 const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+
+/*
+ * Leaf Node Header Layout. Besides the cell count and sibling pointer, a leaf
+ * records where its cell content starts and a small dictionary of email
+ * domains shared by the rows on the page.
+ */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_MAX_DOMAINS = 8;
+const uint32_t LEAF_NODE_DOMAINS_SIZE = LEAF_NODE_MAX_DOMAINS * sizeof(uint16_t);
+const uint32_t LEAF_NODE_DOMAINS_OFFSET = LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_NUM_DOMAINS_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_NODE_NUM_DOMAINS_OFFSET = LEAF_NODE_DOMAINS_OFFSET + LEAF_NODE_DOMAINS_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = LEAF_NODE_NUM_DOMAINS_OFFSET + LEAF_NODE_NUM_DOMAINS_SIZE;
+
+/*
+ * Leaf Node Body Layout. A sorted slot array (key, cell offset, cell length)
+ * grows up from the header and cells grow down from the end of the page.
+ * A cell is the username, the local part of the email and its domain, each
+ * prefixed by its length. The domain is a dictionary entry number, inline
+ * bytes, or absent for emails without an '@'.
+ */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+const uint32_t LEAF_NODE_CELL_POINTER_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CELL_POINTER_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_CELL_LENGTH_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CELL_LENGTH_OFFSET = LEAF_NODE_CELL_POINTER_OFFSET + LEAF_NODE_CELL_POINTER_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_CELL_LENGTH_OFFSET + LEAF_NODE_CELL_LENGTH_SIZE;
+const uint8_t LEAF_DOMAIN_INLINE = 0xFF;
+const uint8_t LEAF_DOMAIN_NONE = 0xFE;
+
+/*
+ * Format 1 leaves held fixed-size (key, serialized row) cells after the
+ * num_cells and next_leaf fields. They are only read when a file is upgraded.
+ */
+const uint32_t V1_LEAF_NODE_HEADER_SIZE = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t V1_LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + ROW_SIZE;
+
+/*
+ * Format 0 files predate the B+tree and the header: serialized rows back to
+ * back, V0_ROWS_PER_PAGE to a page, with the last page cut off after its last
+ * row. They are only read when a file is upgraded.
+ */
+const uint32_t V0_ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
+
+/*
+ * Internal Node Header Layout
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
+/*
+ * Internal Node Body Layout
+ */
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_MAX_KEYS = (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
 
 /* ======== STRUCT & ENUM DEFINITIONS ======== */
 
+/*
+ * One slot of the buffer pool. Frames sit on a doubly linked LRU list,
+ * most recently used first; pinned frames are never evicted.
+ */
+typedef struct
+{
+    uint32_t page_num; // INVALID_PAGE_NUM while the frame is free
+    uint32_t pin_count;
+    bool dirty;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    void *data;
+} Frame;
+
+/*
+ * Counters behind .stats and the benchmark driver. The last three are also
+ * bumped by other threads and change under wal_mutex.
+ */
+typedef struct
+{
+    uint64_t cache_hits;         // get_page found the page in the pool
+    uint64_t cache_misses;       // get_page had to read the page
+    uint64_t mapped_reads;       // leaves read straight from the mmap'd file
+    uint64_t snapshot_reads;     // pages read by snapshot cursors
+    uint64_t frames_written;     // pages appended to the log
+    uint64_t pages_checkpointed; // pages copied from the log into the db file
+} PagerStats;
+
+/*
+ * Log-linear histogram of nanosecond latencies: values below 16 get their
+ * own bucket, larger ones share 16 buckets per power of two, so a percentile
+ * is off by at most 1/16.
+ */
+typedef struct
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/*
+ * Pages only reach the db file through checkpoints. Everything written before
+ * that goes to the WAL, and wal_index says which frame holds a page's latest
+ * image; wal_frame_prev links each frame to the page's previous one, so older
+ * versions stay reachable for snapshots. The wal_mutex guards the counters
+ * shared with the background thread, which fsyncs the log and checkpoints it,
+ * and everything snapshot readers on other threads look at: wal_index,
+ * wal_frame_prev and the reader slots.
+ */
 typedef struct
 {
     int file_descriptor;
-    uint32_t file_lenght;
-    void *pages[TABLE_MAX_PAGES];
+    uint32_t num_pages;
+    Frame *frames;
+    uint32_t num_frames;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    uint32_t *page_table; // page_num -> frame index, INVALID_FRAME if not resident
+    uint32_t *wal_index;  // page_num -> latest WAL frame with the page, 0 if none
+    uint32_t page_table_capacity;
+
+    void *map;         // read-only mapping of the db file, NULL unless --mmap
+    size_t map_length; // bytes of the mapping known to be backed by the file
+
+    char *wal_filename;
+    int wal_file_descriptor;
+    uint32_t wal_salt;
+    uint32_t wal_frames;     // frames appended, numbered from 1
+    uint32_t wal_committed;  // last frame that ends a commit
+    uint32_t wal_synced;     // frames known to be on disk
+    uint32_t wal_backfilled; // frames already copied into the db file
+    uint32_t commits_since_sync;
+    bool wal_syncing;         // a thread is in fdatasync on the log
+    bool async_commit;        // acknowledge commits before their fsync, see pager_commit
+    uint32_t *wal_frame_prev; // frame -> previous frame of the same page, 0 if none
+    uint32_t wal_frame_prev_capacity;
+    uint32_t reader_marks[MAX_READERS]; // last frame each open snapshot sees, INVALID_FRAME if free
+    uint32_t num_readers;
+    uint32_t reads_in_progress; // snapshot preads started but not finished
+    bool wal_restarting;        // wal_restart is waiting for reads_in_progress to drain
+    pthread_cond_t reader_cond;
+    PagerStats stats;
+    bool checkpoint_running;
+    bool wal_worker_stop;
+    pthread_t wal_worker;
+    pthread_mutex_t wal_mutex;
+    pthread_cond_t wal_cond;
 } Pager;
 
 typedef struct
@@ -81,7 +285,8 @@ typedef enum
 typedef enum
 {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    NUM_STATEMENT_TYPES
 } StatementType;
 
 typedef enum
@@ -90,28 +295,77 @@ typedef enum
     NODE_LEAF
 } NodeType;
 
+typedef enum
+{
+    PREDICATE_NONE,
+    PREDICATE_ID_RANGE,
+    PREDICATE_USERNAME,
+    PREDICATE_EMAIL
+} PredicateType;
+
+/*
+ * The where clause of a select. "id = N" is the range [N, N].
+ */
+typedef struct
+{
+    PredicateType type;
+    uint32_t id_min;
+    uint32_t id_max;
+    char value[COLUMN_EMAIL_SIZE + 1];
+} Predicate;
+
 typedef struct
 {
     StatementType type;
     Row row_to_insert;
+    Predicate where;
 } Statement;
 
+typedef enum
+{
+    INDEX_USERNAME,
+    INDEX_EMAIL,
+    NUM_INDEXES
+} IndexColumn;
+
 typedef struct
 {
-    uint32_t num_rows;
     Pager *pager;
+    uint32_t root_page_num;
+    uint32_t index_root[NUM_INDEXES]; // meta page of each secondary index, 0 if none
+    LatencyHistogram statement_latency[NUM_STATEMENT_TYPES];
 } Table;
 
 typedef enum
 {
     EXECUTE_SUCCESS,
-    EXECUTE_TABLE_FULL
+    EXECUTE_DUPLICATE_KEY
 } ExecuteResult;
 
+/*
+ * A reader's view of the table as of the last commit before snapshot_open.
+ * The writer keeps going while snapshots are open; each snapshot is used by
+ * one thread at a time.
+ */
 typedef struct
 {
     Table *table;
-    uint32_t row_num;
+    uint32_t slot; // reader_marks[slot] is the newest WAL frame the snapshot sees
+} Snapshot;
+
+/*
+ * A cursor keeps the leaf it points into pinned until it moves on or is closed.
+ * Scans in mmap mode may instead point straight into the mapped file.
+ * Snapshot cursors never touch the buffer pool: they read into their own page.
+ */
+typedef struct
+{
+    Table *table;
+    Snapshot *snapshot; // NULL for the writer's cursors
+    uint32_t page_num;
+    uint32_t cell_num;
+    void *page;
+    bool page_pinned; // false when page points into the mmap'd file
     bool end_of_table;
 } Cursor;
 
@@ -126,357 +380,3179 @@ PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
 ExecuteResult execute_statement(Statement *statement, Table *table);
 ExecuteResult execute_insert(Statement *statement, Table *table);
 ExecuteResult execute_select(Statement *statement, Table *table);
-void serialize_row(Row *source, void *destination);
+ExecuteResult table_insert(Table *table, Row *row);
+void execute_import(Table *table, const char *filename);
+void execute_create_index(Table *table, const char *column);
+void index_insert_row(Table *table, Row *row);
+uint32_t index_lookup(Table *table, IndexColumn column, const char *value, uint32_t **ids);
 void deserialize_row(void *source, Row *destination);
-void *row_slot(Table *table, uint32_t row_num);
-Table *new_table();
 void free_table(Table *table);
 void print_row(Row *row);
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level);
+void print_stats(Table *table);
 void db_close(Table *table);
+void db_upgrade(Table *old_table, const char *filename, uint32_t num_frames);
+bool db_is_format0(const char *filename);
+void db_upgrade_format0(const char *filename, uint32_t num_frames);
+void *get_page(Pager *pager, uint32_t page_num);
+void unpin_page(Pager *pager, uint32_t page_num, bool dirty);
+void pager_flush(Pager *pager, uint32_t page_num);
+void pager_commit(Pager *pager);
+uint32_t get_unused_page_num(Pager *pager);
 Cursor *table_start(Table *table);
-Cursor *table_end(Table *table);
+Cursor *table_seek(Table *table, uint32_t key);
+Cursor *table_find(Table *table, uint32_t key);
 void cursor_advance(Cursor *cursor);
-void *cursor_value(Cursor *cursor);
+Snapshot *snapshot_open(Table *table);
+void snapshot_close(Snapshot *snapshot);
+void snapshot_read_page(Snapshot *snapshot, uint32_t page_num, void *buffer);
+Cursor *snapshot_seek(Snapshot *snapshot, uint32_t key);
+Cursor *snapshot_start(Snapshot *snapshot);
+void cursor_close(Cursor *cursor);
+void cursor_row(Cursor *cursor, Row *row);
+void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value);
+void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num);
+
+/* ======== NODE ACCESSORS ======== */
+
+NodeType get_node_type(void *node)
+{
+    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
 
-/* ======== FUNCTION ======== */
+void set_node_type(void *node, NodeType type)
+{
+    uint8_t value = type;
+    *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+}
 
-InputBuffer *new_input_buffer()
+bool is_node_root(void *node)
 {
-    InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
-    return input_buffer;
+    uint8_t value = *((uint8_t *)(node + IS_ROOT_OFFSET));
+    return (bool)value;
 }
 
-void print_prompt()
+void set_node_root(void *node, bool is_root)
 {
-    printf("db > ");
+    uint8_t value = is_root;
+    *((uint8_t *)(node + IS_ROOT_OFFSET)) = value;
 }
 
-void print_row(Row *row)
+uint32_t *node_parent(void *node)
 {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    return node + PARENT_POINTER_OFFSET;
 }
 
-void read_input(InputBuffer *input_buffer)
+uint32_t *leaf_node_num_cells(void *node)
 {
-    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
 
-    if (bytes_read <= 0)
-    {
-        printf("Error reading input\n");
-        exit(EXIT_FAILURE);
-    }
+uint32_t *leaf_node_next_leaf(void *node)
+{
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
 
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = '\0';
+uint16_t *leaf_node_content_start(void *node)
+{
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
 }
 
-void close_input_buffer(InputBuffer *input_buffer)
+uint8_t *leaf_node_num_domains(void *node)
 {
-    free(input_buffer->buffer);
-    free(input_buffer);
+    return node + LEAF_NODE_NUM_DOMAINS_OFFSET;
 }
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table)
+uint16_t *leaf_node_domain(void *node, uint32_t domain_num)
 {
-    if (strcmp(input_buffer->buffer, ".exit") == 0)
-    {
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    }
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+    return node + LEAF_NODE_DOMAINS_OFFSET + domain_num * sizeof(uint16_t);
 }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
+void *leaf_node_slot(void *node, uint32_t cell_num)
 {
-    statement->type = STATEMENT_INSERT;
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_SLOT_SIZE;
+}
 
-    char *keyword = strtok(input_buffer->buffer, " ");
-    char *id_string = strtok(NULL, " ");
-    char *username = strtok(NULL, " ");
-    char *email = strtok(NULL, " ");
+uint32_t *leaf_node_key(void *node, uint32_t cell_num)
+{
+    return leaf_node_slot(node, cell_num) + LEAF_NODE_KEY_OFFSET;
+}
 
-    if (id_string == NULL || username == NULL || email == NULL)
-    {
-        return PREPARE_SYNTAX_ERROR;
-    }
+uint16_t *leaf_node_cell_pointer(void *node, uint32_t cell_num)
+{
+    return leaf_node_slot(node, cell_num) + LEAF_NODE_CELL_POINTER_OFFSET;
+}
 
-    int id = atoi(id_string);
-    if (id < 0)
-    {
-        return PREPARE_NEGATIVE_ID;
-    }
-    if (strlen(username) > COLUMN_USERNAME_SIZE)
-    {
-        return PREPARE_STRING_TOO_LONG;
-    }
-    if (strlen(email) > COLUMN_EMAIL_SIZE)
-    {
-        return PREPARE_STRING_TOO_LONG;
-    }
+uint16_t *leaf_node_cell_length(void *node, uint32_t cell_num)
+{
+    return leaf_node_slot(node, cell_num) + LEAF_NODE_CELL_LENGTH_OFFSET;
+}
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+uint32_t leaf_node_free_space(void *node)
+{
+    return *leaf_node_content_start(node) - LEAF_NODE_HEADER_SIZE - *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+}
 
-    return PREPARE_SUCCESS;
+uint32_t *internal_node_num_keys(void *node)
+{
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
+uint32_t *internal_node_right_child(void *node)
 {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0)
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t *internal_node_cell(void *node, uint32_t cell_num)
+{
+    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t *internal_node_child(void *node, uint32_t child_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys)
     {
-        return prepare_insert(input_buffer, statement);
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
     }
-    if (strcmp(input_buffer->buffer, "select") == 0)
+    if (child_num == num_keys)
     {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        return internal_node_right_child(node);
     }
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    return internal_node_cell(node, child_num);
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table)
+uint32_t *internal_node_key(void *node, uint32_t key_num)
 {
-    if (table->num_rows >= TABLE_MAX_ROWS)
-    {
-        return EXECUTE_TABLE_FULL;
-    }
-
-    Row *row_to_insert = &(statement->row_to_insert);
-    Cursor *cursor = table_end(table);
+    return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
 
-    serialize_row(row_to_insert, cursor_value(cursor));
-    table->num_rows += 1;
+void initialize_leaf_node(void *node)
+{
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0; // 0 is the file header, so it can never be a sibling
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_num_domains(node) = 0;
+}
 
-    return EXECUTE_SUCCESS;
+void initialize_internal_node(void *node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *internal_node_right_child(node) = INVALID_PAGE_NUM;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table)
+/*
+ * Decode the row in a leaf cell.
+ */
+void leaf_node_row(void *node, uint32_t cell_num, Row *row)
 {
-    Cursor *cursor = table_start(table);
+    uint8_t *cell = node + *leaf_node_cell_pointer(node, cell_num);
+    row->id = *leaf_node_key(node, cell_num);
 
-    Row row;
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
-    }
+    uint8_t length = *cell++;
+    memcpy(row->username, cell, length);
+    row->username[length] = '\0';
+    cell += length;
 
-    free(cursor);
+    length = *cell++;
+    memcpy(row->email, cell, length);
+    char *email_end = row->email + length;
+    cell += length;
 
-    return EXECUTE_SUCCESS;
+    uint8_t domain = *cell++;
+    if (domain != LEAF_DOMAIN_NONE)
+    {
+        uint8_t *entry = (domain == LEAF_DOMAIN_INLINE) ? cell : (uint8_t *)node + *leaf_node_domain(node, domain);
+        *email_end++ = '@';
+        memcpy(email_end, entry + 1, entry[0]);
+        email_end += entry[0];
+    }
+    *email_end = '\0';
 }
 
-ExecuteResult execute_statement(Statement *statement, Table *table)
+uint8_t leaf_node_find_domain(void *node, const char *domain, uint32_t length)
 {
-    switch (statement->type)
+    for (uint8_t i = 0; i < *leaf_node_num_domains(node); i++)
     {
-    case STATEMENT_INSERT:
-        return execute_insert(statement, table);
-    case STATEMENT_SELECT:
-        return execute_select(statement, table);
+        uint8_t *entry = node + *leaf_node_domain(node, i);
+        if (entry[0] == length && memcmp(entry + 1, domain, length) == 0)
+        {
+            return i;
+        }
     }
-    return EXECUTE_SUCCESS;
+    return LEAF_DOMAIN_INLINE;
 }
 
-void serialize_row(Row *source, void *destination)
+/*
+ * Store a domain in the page dictionary. The caller checks there is room.
+ */
+uint8_t leaf_node_add_domain(void *node, const char *domain, uint32_t length)
 {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+    uint16_t content_start = *leaf_node_content_start(node) - (1 + length);
+    uint8_t *entry = node + content_start;
+    entry[0] = length;
+    memcpy(entry + 1, domain, length);
+    *leaf_node_content_start(node) = content_start;
+
+    uint8_t domain_num = *leaf_node_num_domains(node);
+    *leaf_node_domain(node, domain_num) = content_start;
+    *leaf_node_num_domains(node) = domain_num + 1;
+    return domain_num;
 }
 
-void deserialize_row(void *source, Row *destination)
+/*
+ * Bytes a row takes with its domain stored inline.
+ */
+uint32_t leaf_cell_length(Row *row)
 {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    return 3 + strlen(row->username) + strlen(row->email) + 1;
 }
 
-void *get_page(Pager *pager, uint32_t page_num)
+/*
+ * Encode a row into the leaf at cell_num if there is room, shifting later
+ * slots up. A domain not yet in the dictionary is added while there is a free
+ * entry, which costs no more than storing it inline.
+ */
+bool leaf_node_try_insert(void *node, uint32_t cell_num, uint32_t key, Row *row)
 {
-    if (page_num > TABLE_MAX_PAGES)
+    uint32_t username_length = strlen(row->username);
+    char *at = strrchr(row->email, '@');
+    uint32_t local_length = (at != NULL) ? (uint32_t)(at - row->email) : strlen(row->email);
+    uint32_t domain_length = (at != NULL) ? strlen(at + 1) : 0;
+    uint8_t domain = (at != NULL) ? leaf_node_find_domain(node, at + 1, domain_length) : LEAF_DOMAIN_NONE;
+
+    uint32_t dictionary_bytes = 0;
+    uint32_t inline_bytes = 0;
+    if (domain == LEAF_DOMAIN_INLINE)
     {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+        if (*leaf_node_num_domains(node) < LEAF_NODE_MAX_DOMAINS)
+        {
+            dictionary_bytes = 1 + domain_length;
+        }
+        else
+        {
+            inline_bytes = 1 + domain_length;
+        }
     }
-    if (pager->pages[page_num] == NULL)
+    uint32_t cell_length = 3 + username_length + local_length + inline_bytes;
+    if (dictionary_bytes + cell_length + LEAF_NODE_SLOT_SIZE > leaf_node_free_space(node))
     {
-        void *page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_lenght / PAGE_SIZE;
+        return false;
+    }
+
+    if (dictionary_bytes != 0)
+    {
+        domain = leaf_node_add_domain(node, at + 1, domain_length);
+    }
+    uint16_t content_start = *leaf_node_content_start(node) - cell_length;
+    uint8_t *cell = node + content_start;
+    *cell++ = username_length;
+    memcpy(cell, row->username, username_length);
+    cell += username_length;
+    *cell++ = local_length;
+    memcpy(cell, row->email, local_length);
+    cell += local_length;
+    *cell++ = domain;
+    if (domain == LEAF_DOMAIN_INLINE)
+    {
+        *cell++ = domain_length;
+        memcpy(cell, at + 1, domain_length);
+    }
+    *leaf_node_content_start(node) = content_start;
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cell_num < num_cells)
+    {
+        memmove(leaf_node_slot(node, cell_num + 1), leaf_node_slot(node, cell_num),
+                (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+    }
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_cell_pointer(node, cell_num) = content_start;
+    *leaf_node_cell_length(node, cell_num) = cell_length;
+    *leaf_node_num_cells(node) = num_cells + 1;
+    return true;
+}
 
-        if (pager->file_lenght % PAGE_SIZE)
+/*
+ * Fill an empty leaf with sorted rows. The dictionary is seeded with the
+ * domains that save the most bytes, so a page rebuilt by a split is never
+ * worse off than the page it came from. Returns false if the rows do not fit.
+ */
+bool leaf_node_build(void *node, Row *rows, uint32_t num_rows)
+{
+    const char **domains = malloc(num_rows * sizeof(char *));
+    uint32_t *counts = malloc(num_rows * sizeof(uint32_t));
+    uint32_t num_distinct = 0;
+    for (uint32_t i = 0; i < num_rows; i++)
+    {
+        char *at = strrchr(rows[i].email, '@');
+        if (at == NULL)
+        {
+            continue;
+        }
+        uint32_t j = 0;
+        while (j < num_distinct && strcmp(domains[j], at + 1) != 0)
+        {
+            j++;
+        }
+        if (j == num_distinct)
         {
-            num_pages += 1;
+            domains[num_distinct] = at + 1;
+            counts[num_distinct++] = 0;
         }
+        counts[j]++;
+    }
 
-        if (page_num <= num_pages)
+    while (*leaf_node_num_domains(node) < LEAF_NODE_MAX_DOMAINS)
+    {
+        uint32_t best = num_distinct;
+        uint32_t best_saving = 0;
+        for (uint32_t j = 0; j < num_distinct; j++)
         {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1)
+            uint32_t saving = (counts[j] > 1) ? (counts[j] - 1) * (1 + strlen(domains[j])) : 0;
+            if (saving > best_saving)
             {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
+                best = j;
+                best_saving = saving;
             }
         }
-        pager->pages[page_num] = page;
+        if (best == num_distinct)
+        {
+            break;
+        }
+        leaf_node_add_domain(node, domains[best], strlen(domains[best]));
+        counts[best] = 0;
+    }
+    free(domains);
+    free(counts);
+
+    for (uint32_t i = 0; i < num_rows; i++)
+    {
+        if (!leaf_node_try_insert(node, i, rows[i].id, &rows[i]))
+        {
+            return false;
+        }
     }
-    return pager->pages[page_num];
+    return true;
 }
 
-void *cursor_value(Cursor *cursor)
+uint32_t get_node_max_key(Pager *pager, void *node)
 {
-    uint32_t row_num = cursor->row_num;
-    uint32_t page_num = row_num / ROWS_PER_PAGE;
+    if (get_node_type(node) == NODE_LEAF)
+    {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+    uint32_t right_child_page_num = *internal_node_right_child(node);
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t max_key = get_node_max_key(pager, right_child);
+    unpin_page(pager, right_child_page_num, false);
+    return max_key;
+}
 
-    void *page = get_page(cursor->table->pager, page_num);
+/* ======== FUNCTION ======== */
 
-    uint32_t row_offset = row_num % ROWS_PER_PAGE;
-    uint32_t byte_offset = row_offset * ROW_SIZE;
+InputBuffer *new_input_buffer()
+{
+    InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
+    input_buffer->buffer = NULL;
+    input_buffer->buffer_length = 0;
+    input_buffer->input_length = 0;
+    return input_buffer;
+}
 
-    return page + byte_offset;
+void print_prompt()
+{
+    printf("db > ");
 }
 
-void cursor_advance(Cursor *cursor)
+void print_row(Row *row)
 {
-    cursor->row_num += 1;
-    if (cursor->row_num >= cursor->table->num_rows)
-    {
-        cursor->end_of_table = true;
-    }
+    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
-Pager *pager_open(const char *filename)
+uint64_t now_ns()
 {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
-    if (fd == -1)
+void latency_record(LatencyHistogram *histogram, uint64_t ns)
+{
+    uint32_t bucket = ns;
+    if (ns >= LATENCY_SUB_BUCKETS)
     {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+        uint32_t exponent = 63 - __builtin_clzll(ns); // at least 4
+        uint32_t sub_bucket = (ns >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1);
+        bucket = (exponent - 3) * LATENCY_SUB_BUCKETS + sub_bucket;
     }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_ns += ns;
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
-
-    Pager *pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_lenght = file_length;
-
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+/*
+ * Smallest latency that at least fraction of the samples do not exceed,
+ * rounded down to its bucket.
+ */
+uint64_t latency_percentile(LatencyHistogram *histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * histogram->count + 0.999999);
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
     {
-        pager->pages[i] = NULL;
+        seen += histogram->buckets[bucket];
+        if (seen >= rank && seen > 0)
+        {
+            if (bucket < LATENCY_SUB_BUCKETS)
+            {
+                return bucket;
+            }
+            uint32_t exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+            return (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (exponent - 4);
+        }
     }
-
-    return pager;
+    return 0;
 }
 
-void pager_flush(Pager *pager, uint32_t page_num, uint32_t size)
+void print_latency(const char *name, LatencyHistogram *histogram)
 {
-    if (pager->pages[page_num] == NULL)
+    if (histogram->count == 0)
     {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+        printf("  %-8s      0\n", name);
+        return;
     }
+    printf("  %-8s %6llu  mean %8.1f us  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us\n", name,
+           (unsigned long long)histogram->count, histogram->total_ns / 1e3 / histogram->count,
+           latency_percentile(histogram, 0.50) / 1e3, latency_percentile(histogram, 0.99) / 1e3,
+           latency_percentile(histogram, 0.999) / 1e3);
+}
+
+PagerStats pager_stats(Pager *pager)
+{
+    pthread_mutex_lock(&pager->wal_mutex);
+    PagerStats stats = pager->stats;
+    pthread_mutex_unlock(&pager->wal_mutex);
+    return stats;
+}
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+void print_pager_stats(PagerStats *stats)
+{
+    uint64_t lookups = stats->cache_hits + stats->cache_misses;
+    printf("Pages: %llu read (%llu more from the mmap, %llu by snapshots), %llu written to the log, %llu checkpointed\n",
+           (unsigned long long)stats->cache_misses, (unsigned long long)stats->mapped_reads,
+           (unsigned long long)stats->snapshot_reads, (unsigned long long)stats->frames_written,
+           (unsigned long long)stats->pages_checkpointed);
+    printf("Buffer pool: %.2f%% hit rate (%llu hits, %llu misses)\n",
+           lookups > 0 ? 100.0 * stats->cache_hits / lookups : 0.0, (unsigned long long)stats->cache_hits,
+           (unsigned long long)stats->cache_misses);
+}
 
-    if (offset == -1)
+/*
+ * Counters since the database was opened.
+ */
+void print_stats(Table *table)
+{
+    const char *names[NUM_STATEMENT_TYPES] = {"insert", "select"};
+    printf("Statements:\n");
+    for (uint32_t i = 0; i < NUM_STATEMENT_TYPES; i++)
     {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+        print_latency(names[i], &table->statement_latency[i]);
     }
+    PagerStats stats = pager_stats(table->pager);
+    print_pager_stats(&stats);
+}
 
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], size);
-
-    if (bytes_written == -1)
+void indent(uint32_t level)
+{
+    for (uint32_t i = 0; i < level; i++)
     {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+        printf("  ");
     }
 }
 
-void db_close(Table *table)
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level)
 {
-    Pager *pager = table->pager;
-    uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE;
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys, child;
 
-    for (uint32_t i = 0; i < num_full_pages; i++)
+    switch (get_node_type(node))
     {
-        if (pager->pages[i] == NULL)
+    case NODE_LEAF:
+        num_keys = *leaf_node_num_cells(node);
+        indent(indentation_level);
+        printf("- leaf (size %d)\n", num_keys);
+        for (uint32_t i = 0; i < num_keys; i++)
         {
-            continue;
+            indent(indentation_level + 1);
+            printf("- %d\n", *leaf_node_key(node, i));
         }
-        pager_flush(pager, i, PAGE_SIZE);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
-    }
-
-    uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
-    if (num_additional_rows > 0)
-    {
-        uint32_t page_num = num_full_pages;
-        if (pager->pages[page_num] != NULL)
+        break;
+    case NODE_INTERNAL:
+        num_keys = *internal_node_num_keys(node);
+        indent(indentation_level);
+        printf("- internal (size %d)\n", num_keys);
+        for (uint32_t i = 0; i < num_keys; i++)
         {
-            pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
-            free(pager->pages[page_num]);
-            pager->pages[page_num] = NULL;
+            child = *internal_node_child(node, i);
+            print_tree(pager, child, indentation_level + 1);
+
+            indent(indentation_level + 1);
+            printf("- key %d\n", *internal_node_key(node, i));
         }
+        child = *internal_node_right_child(node);
+        print_tree(pager, child, indentation_level + 1);
+        break;
     }
+    unpin_page(pager, page_num, false);
+}
 
-    int result = close(pager->file_descriptor);
-    if (result == -1)
+void read_input(InputBuffer *input_buffer)
+{
+    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+    if (bytes_read <= 0)
     {
-        printf("Error closing db file\n");
+        printf("Error reading input\n");
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
-    {
-        void *page = pager->pages[i];
-        if (page)
-        {
-            free(page);
-            pager->pages[i] = NULL;
-        }
-    }
-    free(pager);
-    free(table);
+
+    input_buffer->input_length = bytes_read - 1;
+    input_buffer->buffer[bytes_read - 1] = '\0';
 }
 
-Table *db_open(const char *filename)
+void close_input_buffer(InputBuffer *input_buffer)
 {
-    Pager *pager = pager_open(filename);
-    uint32_t num_rows = pager->file_lenght / ROW_SIZE;
-    Table *table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->num_rows = num_rows;
-
-    return table;
+    free(input_buffer->buffer);
+    free(input_buffer);
 }
 
-Cursor *table_start(Table *table)
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table)
+{
+    if (strcmp(input_buffer->buffer, ".exit") == 0)
+    {
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    }
+    if (strcmp(input_buffer->buffer, ".btree") == 0)
+    {
+        printf("Tree:\n");
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    }
+    if (strncmp(input_buffer->buffer, ".import ", 8) == 0)
+    {
+        execute_import(table, input_buffer->buffer + 8);
+        return META_COMMAND_SUCCESS;
+    }
+    if (strcmp(input_buffer->buffer, ".stats") == 0)
+    {
+        print_stats(table);
+        return META_COMMAND_SUCCESS;
+    }
+    if (strncmp(input_buffer->buffer, ".index ", 7) == 0)
+    {
+        execute_create_index(table, input_buffer->buffer + 7);
+        return META_COMMAND_SUCCESS;
+    }
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+}
+
+PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
+{
+    statement->type = STATEMENT_INSERT;
+
+    char *keyword = strtok(input_buffer->buffer, " ");
+    char *id_string = strtok(NULL, " ");
+    char *username = strtok(NULL, " ");
+    char *email = strtok(NULL, " ");
+
+    (void)keyword;
+    if (id_string == NULL || username == NULL || email == NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id = atoi(id_string);
+    if (id < 0)
+    {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE)
+    {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strlen(email) > COLUMN_EMAIL_SIZE)
+    {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    statement->row_to_insert.id = id;
+    strcpy(statement->row_to_insert.username, username);
+    strcpy(statement->row_to_insert.email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+bool parse_id(const char *string, uint32_t *id)
+{
+    char *end;
+    long value = strtol(string, &end, 10);
+    if (end == string || *end != '\0' || value < 0 || value > UINT32_MAX)
+    {
+        return false;
+    }
+    *id = (uint32_t)value;
+    return true;
+}
+
+/*
+ * select
+ * select where id = N
+ * select where id between A and B
+ * select where username = X
+ * select where email = X
+ */
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement)
+{
+    statement->type = STATEMENT_SELECT;
+    statement->where.type = PREDICATE_NONE;
+
+    char *keyword = strtok(input_buffer->buffer, " ");
+    char *where = strtok(NULL, " ");
+    if (strcmp(keyword, "select") != 0)
+    {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    if (where == NULL)
+    {
+        return PREPARE_SUCCESS;
+    }
+
+    char *column = strtok(NULL, " ");
+    char *operator = strtok(NULL, " ");
+    char *operand = strtok(NULL, " ");
+    if (strcmp(where, "where") != 0 || column == NULL || operator == NULL || operand == NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(column, "id") == 0)
+    {
+        statement->where.type = PREDICATE_ID_RANGE;
+        if (strcmp(operator, "=") == 0)
+        {
+            if (!parse_id(operand, &statement->where.id_min))
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            statement->where.id_max = statement->where.id_min;
+        }
+        else if (strcmp(operator, "between") == 0)
+        {
+            char *and = strtok(NULL, " ");
+            char *upper = strtok(NULL, " ");
+            if (and == NULL || strcmp(and, "and") != 0 || upper == NULL ||
+                !parse_id(operand, &statement->where.id_min) || !parse_id(upper, &statement->where.id_max))
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+        }
+        else
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    else if (strcmp(column, "username") == 0 || strcmp(column, "email") == 0)
+    {
+        bool is_username = strcmp(column, "username") == 0;
+        if (strcmp(operator, "=") != 0)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strlen(operand) > (is_username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE))
+        {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        statement->where.type = is_username ? PREDICATE_USERNAME : PREDICATE_EMAIL;
+        strcpy(statement->where.value, operand);
+    }
+    else
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strtok(NULL, " ") != NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
+{
+    if (strncmp(input_buffer->buffer, "insert", 6) == 0)
+    {
+        return prepare_insert(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "select", 6) == 0)
+    {
+        return prepare_select(input_buffer, statement);
+    }
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/*
+ * Insert a row without committing it.
+ */
+ExecuteResult table_insert(Table *table, Row *row_to_insert)
+{
+    uint32_t key_to_insert = row_to_insert->id;
+    Cursor *cursor = table_find(table, key_to_insert);
+
+    void *node = cursor->page;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cursor->cell_num < num_cells && *leaf_node_key(node, cursor->cell_num) == key_to_insert)
+    {
+        cursor_close(cursor);
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    leaf_node_insert(cursor, key_to_insert, row_to_insert);
+    cursor_close(cursor);
+    index_insert_row(table, row_to_insert);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table)
+{
+    ExecuteResult result = table_insert(table, &(statement->row_to_insert));
+    if (result == EXECUTE_SUCCESS)
+    {
+        pager_commit(table->pager);
+    }
+    return result;
+}
+
+/*
+ * Non-key predicates are checked against the encoded cell, so filtered-out
+ * rows are never decoded.
+ */
+bool row_matches(Predicate *where, void *node, uint32_t cell_num)
+{
+    if (where->type != PREDICATE_USERNAME && where->type != PREDICATE_EMAIL)
+    {
+        return true;
+    }
+    uint8_t *cell = node + *leaf_node_cell_pointer(node, cell_num);
+    const char *value = where->value;
+    uint32_t value_length = strlen(value);
+
+    uint8_t length = *cell++;
+    if (where->type == PREDICATE_USERNAME)
+    {
+        return length == value_length && memcmp(cell, value, length) == 0;
+    }
+    cell += length;
+
+    length = *cell++;
+    if (length > value_length || memcmp(cell, value, length) != 0)
+    {
+        return false;
+    }
+    cell += length;
+    value += length;
+    value_length -= length;
+
+    uint8_t domain = *cell++;
+    if (domain == LEAF_DOMAIN_NONE)
+    {
+        return value_length == 0;
+    }
+    uint8_t *entry = (domain == LEAF_DOMAIN_INLINE) ? cell : (uint8_t *)node + *leaf_node_domain(node, domain);
+    return value_length == 1u + entry[0] && value[0] == '@' && memcmp(entry + 1, value + 1, entry[0]) == 0;
+}
+
+int compare_ids(const void *a, const void *b)
+{
+    uint32_t id_a = *(const uint32_t *)a;
+    uint32_t id_b = *(const uint32_t *)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/*
+ * Fetch the candidate ids from the index and look each one up by key. The
+ * index only stores hashes, so every row is checked against the predicate.
+ */
+void select_by_index(Table *table, Predicate *where, IndexColumn column)
+{
+    uint32_t *ids;
+    uint32_t num_ids = index_lookup(table, column, where->value, &ids);
+    qsort(ids, num_ids, sizeof(uint32_t), compare_ids);
+
+    for (uint32_t i = 0; i < num_ids; i++)
+    {
+        Cursor *cursor = table_find(table, ids[i]);
+        if (cursor->cell_num < *leaf_node_num_cells(cursor->page) &&
+            *leaf_node_key(cursor->page, cursor->cell_num) == ids[i])
+        {
+            if (row_matches(where, cursor->page, cursor->cell_num))
+            {
+                Row row;
+                cursor_row(cursor, &row);
+                print_row(&row);
+            }
+        }
+        cursor_close(cursor);
+    }
+    free(ids);
+}
+
+/*
+ * Plan: an id predicate seeks to the lower bound and walks the leaves until
+ * the upper bound, touching only the pages in the range. A username or email
+ * predicate uses the column's index if there is one. Anything else streams
+ * the whole table through row_matches.
+ */
+ExecuteResult execute_select(Statement *statement, Table *table)
+{
+    Predicate *where = &statement->where;
+    Cursor *cursor;
+    uint32_t id_max = UINT32_MAX;
+
+    if (where->type == PREDICATE_USERNAME && table->index_root[INDEX_USERNAME] != 0)
+    {
+        select_by_index(table, where, INDEX_USERNAME);
+        return EXECUTE_SUCCESS;
+    }
+    if (where->type == PREDICATE_EMAIL && table->index_root[INDEX_EMAIL] != 0)
+    {
+        select_by_index(table, where, INDEX_EMAIL);
+        return EXECUTE_SUCCESS;
+    }
+
+    if (where->type == PREDICATE_ID_RANGE)
+    {
+        cursor = table_seek(table, where->id_min);
+        id_max = where->id_max;
+    }
+    else
+    {
+        cursor = table_start(table);
+    }
+
+    while (!(cursor->end_of_table)) {
+        if (*leaf_node_key(cursor->page, cursor->cell_num) > id_max)
+        {
+            break;
+        }
+        if (row_matches(where, cursor->page, cursor->cell_num))
+        {
+            Row row;
+            cursor_row(cursor, &row);
+            print_row(&row);
+        }
+        cursor_advance(cursor);
+    }
+
+    cursor_close(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement *statement, Table *table)
+{
+    uint64_t start_ns = now_ns();
+    ExecuteResult result = EXECUTE_SUCCESS;
+    switch (statement->type)
+    {
+    case STATEMENT_INSERT:
+        result = execute_insert(statement, table);
+        break;
+    case STATEMENT_SELECT:
+        result = execute_select(statement, table);
+        break;
+    default:
+        break;
+    }
+    latency_record(&table->statement_latency[statement->type], now_ns() - start_ns);
+    return result;
+}
+
+void deserialize_row(void *source, Row *destination)
+{
+    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+/* ======== WRITE-AHEAD LOG ======== */
+
+off_t wal_frame_offset(uint32_t frame_num)
+{
+    return WAL_HEADER_SIZE + (off_t)(frame_num - 1) * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+}
+
+/*
+ * FNV-1a over the first part of the frame header and the page image.
+ */
+uint32_t wal_checksum(void *frame_header, void *page)
+{
+    uint32_t hash = 2166136261u;
+    uint8_t *bytes = frame_header;
+    for (uint32_t i = 0; i < WAL_FRAME_CHECKSUM_OFFSET; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    bytes = page;
+    for (uint32_t i = 0; i < PAGE_SIZE; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void wal_append_frame(Pager *pager, uint32_t page_num, void *page, uint32_t db_size)
+{
+    uint32_t frame_num = pager->wal_frames + 1;
+    uint8_t frame_header[WAL_FRAME_HEADER_SIZE];
+    *(uint32_t *)(frame_header + WAL_FRAME_PAGE_NUM_OFFSET) = page_num;
+    *(uint32_t *)(frame_header + WAL_FRAME_DB_SIZE_OFFSET) = db_size;
+    *(uint32_t *)(frame_header + WAL_FRAME_SALT_OFFSET) = pager->wal_salt;
+    *(uint32_t *)(frame_header + WAL_FRAME_CHECKSUM_OFFSET) = wal_checksum(frame_header, page);
+
+    struct iovec iov[2] = {{frame_header, WAL_FRAME_HEADER_SIZE}, {page, PAGE_SIZE}};
+    ssize_t bytes_written = pwritev(pager->wal_file_descriptor, iov, 2, wal_frame_offset(frame_num));
+    if (bytes_written != (ssize_t)(WAL_FRAME_HEADER_SIZE + PAGE_SIZE))
+    {
+        printf("Error writing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    if (frame_num >= pager->wal_frame_prev_capacity)
+    {
+        uint32_t capacity = pager->wal_frame_prev_capacity > 0 ? 2 * pager->wal_frame_prev_capacity : 1024;
+        pager->wal_frame_prev = realloc(pager->wal_frame_prev, capacity * sizeof(uint32_t));
+        pager->wal_frame_prev_capacity = capacity;
+    }
+    pager->wal_frame_prev[frame_num] = pager->wal_index[page_num];
+    pager->wal_index[page_num] = frame_num;
+    pager->wal_frames = frame_num;
+    pager->stats.frames_written++;
+    if (db_size != 0)
+    {
+        pager->wal_committed = frame_num;
+    }
+    pthread_mutex_unlock(&pager->wal_mutex);
+}
+
+/*
+ * Make every commit appended so far durable. A caller that finds another
+ * thread's fsync under way waits for it and then syncs whatever is still
+ * missing, so commits that arrive together share one fsync (group commit). A
+ * restart during the fsync renumbers the frames, so the target only counts if
+ * the salt is unchanged.
+ */
+void wal_sync(Pager *pager)
+{
+    pthread_mutex_lock(&pager->wal_mutex);
+    while (pager->wal_syncing)
+    {
+        pthread_cond_wait(&pager->wal_cond, &pager->wal_mutex);
+    }
+    uint32_t target = pager->wal_committed;
+    uint32_t salt = pager->wal_salt;
+    if (pager->wal_synced >= target)
+    {
+        pthread_mutex_unlock(&pager->wal_mutex);
+        return;
+    }
+    pager->wal_syncing = true;
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    if (fdatasync(pager->wal_file_descriptor) == -1)
+    {
+        printf("Error syncing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->wal_syncing = false;
+    if (pager->wal_salt == salt && pager->wal_synced < target)
+    {
+        pager->wal_synced = target;
+    }
+    pthread_cond_broadcast(&pager->wal_cond);
+    pthread_mutex_unlock(&pager->wal_mutex);
+}
+
+/*
+ * Copy the latest committed image of every page in frames
+ * (wal_backfilled, up_to] into the db file. Walking backwards writes each page
+ * once. Only pages that have a frame in the log are touched, so this can run
+ * while the writer keeps reading other pages from the db file. The caller must
+ * own checkpoint_running.
+ */
+void wal_checkpoint(Pager *pager, uint32_t up_to)
+{
+    wal_sync(pager);
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    uint32_t backfilled = pager->wal_backfilled;
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    uint32_t seen_capacity = 0;
+    uint8_t *seen = NULL;
+    uint32_t pages_written = 0;
+    void *page = malloc(PAGE_SIZE);
+    uint8_t frame_header[WAL_FRAME_HEADER_SIZE];
+
+    for (uint32_t frame_num = up_to; frame_num > backfilled; frame_num--)
+    {
+        off_t offset = wal_frame_offset(frame_num);
+        if (pread(pager->wal_file_descriptor, frame_header, WAL_FRAME_HEADER_SIZE, offset) != (ssize_t)WAL_FRAME_HEADER_SIZE)
+        {
+            printf("Error reading WAL: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t page_num = *(uint32_t *)(frame_header + WAL_FRAME_PAGE_NUM_OFFSET);
+        if (page_num / 8 >= seen_capacity)
+        {
+            uint32_t capacity = page_num / 8 + 1024;
+            seen = realloc(seen, capacity);
+            memset(seen + seen_capacity, 0, capacity - seen_capacity);
+            seen_capacity = capacity;
+        }
+        if (seen[page_num / 8] & (1 << (page_num % 8)))
+        {
+            continue;
+        }
+        seen[page_num / 8] |= 1 << (page_num % 8);
+
+        if (pread(pager->wal_file_descriptor, page, PAGE_SIZE, offset + WAL_FRAME_HEADER_SIZE) != (ssize_t)PAGE_SIZE ||
+            pwrite(pager->file_descriptor, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE) != (ssize_t)PAGE_SIZE)
+        {
+            printf("Error during checkpoint: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pages_written++;
+    }
+    free(page);
+    free(seen);
+
+    if (fdatasync(pager->file_descriptor) == -1)
+    {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->wal_backfilled = up_to;
+    pager->stats.pages_checkpointed += pages_written;
+    pthread_mutex_unlock(&pager->wal_mutex);
+}
+
+/*
+ * Once every committed frame is in the db file the log can start over. A new
+ * salt makes any stale frames left past the new end invalid. A snapshot whose
+ * mark is at or before wal_backfilled finds all its pages in the db file, so
+ * it moves to mark 0; a snapshot that still needs a frame keeps the log.
+ * Snapshot reads already under way finish before the file is truncated, and
+ * new ones wait until the restart is done. Returns whether the log was
+ * restarted.
+ */
+bool wal_restart(Pager *pager)
+{
+    pthread_mutex_lock(&pager->wal_mutex);
+    bool frames_needed = pager->wal_backfilled < pager->wal_committed;
+    for (uint32_t i = 0; pager->num_readers > 0 && i < MAX_READERS; i++)
+    {
+        if (pager->reader_marks[i] != INVALID_FRAME && pager->reader_marks[i] > pager->wal_backfilled)
+        {
+            frames_needed = true;
+        }
+    }
+    if (frames_needed)
+    {
+        pthread_mutex_unlock(&pager->wal_mutex);
+        return false;
+    }
+    pager->wal_restarting = true;
+    while (pager->reads_in_progress > 0)
+    {
+        pthread_cond_wait(&pager->reader_cond, &pager->wal_mutex);
+    }
+    for (uint32_t i = 0; pager->num_readers > 0 && i < MAX_READERS; i++)
+    {
+        if (pager->reader_marks[i] != INVALID_FRAME)
+        {
+            pager->reader_marks[i] = 0;
+        }
+    }
+    pager->wal_salt++;
+
+    uint8_t header[WAL_HEADER_SIZE];
+    memcpy(header + WAL_MAGIC_OFFSET, WAL_FILE_MAGIC, WAL_MAGIC_SIZE);
+    *(uint32_t *)(header + WAL_SALT_OFFSET) = pager->wal_salt;
+    if (ftruncate(pager->wal_file_descriptor, 0) == -1 ||
+        pwrite(pager->wal_file_descriptor, header, WAL_HEADER_SIZE, 0) != (ssize_t)WAL_HEADER_SIZE)
+    {
+        printf("Error resetting WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(pager->wal_index, 0, pager->page_table_capacity * sizeof(uint32_t));
+    pager->wal_frames = 0;
+    pager->wal_committed = 0;
+    pager->wal_synced = 0;
+    pager->wal_backfilled = 0;
+    pager->wal_restarting = false;
+    pthread_cond_broadcast(&pager->reader_cond);
+    pthread_mutex_unlock(&pager->wal_mutex);
+    return true;
+}
+
+/*
+ * How far the db file may be brought forward. A snapshot reads pages that
+ * have no frame at or before its mark from the db file, so frames past the
+ * oldest open snapshot's mark must stay out of it. Caller holds wal_mutex.
+ */
+uint32_t wal_checkpoint_limit(Pager *pager)
+{
+    uint32_t limit = pager->wal_committed;
+    for (uint32_t i = 0; pager->num_readers > 0 && i < MAX_READERS; i++)
+    {
+        if (pager->reader_marks[i] < limit)
+        {
+            limit = pager->reader_marks[i];
+        }
+    }
+    return limit;
+}
+
+/*
+ * Block the writer until no open snapshot is behind the last commit, so the
+ * next checkpoint can reach the end of the log and restart it. Snapshots
+ * opened meanwhile see the last commit and do not hold it up.
+ */
+void wal_wait_for_readers(Pager *pager)
+{
+    pthread_mutex_lock(&pager->wal_mutex);
+    while (wal_checkpoint_limit(pager) < pager->wal_committed)
+    {
+        pthread_cond_wait(&pager->reader_cond, &pager->wal_mutex);
+    }
+    pthread_mutex_unlock(&pager->wal_mutex);
+}
+
+/*
+ * Replay a log left behind by a crash: find the last complete commit, copy
+ * everything up to it into the db file and start a fresh log.
+ */
+void wal_recover(Pager *pager)
+{
+    uint8_t header[WAL_HEADER_SIZE];
+    ssize_t bytes_read = pread(pager->wal_file_descriptor, header, WAL_HEADER_SIZE, 0);
+    if (bytes_read == (ssize_t)WAL_HEADER_SIZE && memcmp(header + WAL_MAGIC_OFFSET, WAL_FILE_MAGIC, WAL_MAGIC_SIZE) == 0)
+    {
+        uint32_t salt = *(uint32_t *)(header + WAL_SALT_OFFSET);
+        uint8_t frame_header[WAL_FRAME_HEADER_SIZE];
+        void *page = malloc(PAGE_SIZE);
+        uint32_t last_commit = 0;
+
+        for (uint32_t frame_num = 1;; frame_num++)
+        {
+            off_t offset = wal_frame_offset(frame_num);
+            if (pread(pager->wal_file_descriptor, frame_header, WAL_FRAME_HEADER_SIZE, offset) != (ssize_t)WAL_FRAME_HEADER_SIZE ||
+                pread(pager->wal_file_descriptor, page, PAGE_SIZE, offset + WAL_FRAME_HEADER_SIZE) != (ssize_t)PAGE_SIZE)
+            {
+                break;
+            }
+            if (*(uint32_t *)(frame_header + WAL_FRAME_SALT_OFFSET) != salt ||
+                *(uint32_t *)(frame_header + WAL_FRAME_CHECKSUM_OFFSET) != wal_checksum(frame_header, page))
+            {
+                break;
+            }
+            if (*(uint32_t *)(frame_header + WAL_FRAME_DB_SIZE_OFFSET) != 0)
+            {
+                last_commit = frame_num;
+            }
+        }
+        free(page);
+
+        pager->wal_salt = salt;
+        if (last_commit > 0)
+        {
+            wal_checkpoint(pager, last_commit);
+        }
+    }
+    wal_restart(pager);
+}
+
+/*
+ * Background thread: fsyncs commits that async_commit acknowledged without
+ * waiting and checkpoints the log once enough frames have piled up.
+ */
+void *wal_worker_main(void *arg)
+{
+    Pager *pager = arg;
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    while (!pager->wal_worker_stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_SYNC_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pager->wal_cond, &pager->wal_mutex, &deadline);
+
+        if (pager->wal_synced < pager->wal_committed)
+        {
+            pthread_mutex_unlock(&pager->wal_mutex);
+            wal_sync(pager);
+            pthread_mutex_lock(&pager->wal_mutex);
+        }
+        uint32_t up_to = wal_checkpoint_limit(pager);
+        if (!pager->checkpoint_running && !pager->wal_worker_stop &&
+            pager->wal_committed - pager->wal_backfilled >= WAL_CHECKPOINT_FRAMES && up_to > pager->wal_backfilled)
+        {
+            pager->checkpoint_running = true;
+            pthread_mutex_unlock(&pager->wal_mutex);
+            wal_checkpoint(pager, up_to);
+            pthread_mutex_lock(&pager->wal_mutex);
+            pager->checkpoint_running = false;
+            pthread_cond_broadcast(&pager->wal_cond);
+        }
+    }
+    pthread_mutex_unlock(&pager->wal_mutex);
+    return NULL;
+}
+
+/*
+ * Wait for a running background checkpoint, then checkpoint everything that is
+ * committed and restart the log. Called by the writer between commits. Open
+ * snapshots hold both steps back.
+ */
+void wal_checkpoint_all(Pager *pager)
+{
+    pthread_mutex_lock(&pager->wal_mutex);
+    while (pager->checkpoint_running)
+    {
+        pthread_cond_wait(&pager->wal_cond, &pager->wal_mutex);
+    }
+    pager->checkpoint_running = true;
+    uint32_t up_to = wal_checkpoint_limit(pager);
+    bool pending = pager->wal_backfilled < up_to;
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    if (pending)
+    {
+        wal_checkpoint(pager, up_to);
+    }
+    wal_restart(pager);
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->checkpoint_running = false;
+    pthread_mutex_unlock(&pager->wal_mutex);
+}
+
+/*
+ * Make the changes of the current statement durable: append every dirty page
+ * to the log, marking the last frame as a commit, and return once the commit
+ * is fsynced. With async_commit the fsync is left to every WAL_SYNC_COMMITS
+ * commits and the background thread, so a crash can lose up to that many
+ * acknowledged commits or WAL_SYNC_INTERVAL_MS of work, never half of one.
+ */
+void pager_commit(Pager *pager)
+{
+    uint32_t last_dirty = INVALID_FRAME;
+    for (uint32_t i = 0; i < pager->num_frames; i++)
+    {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num == INVALID_PAGE_NUM || !frame->dirty)
+        {
+            continue;
+        }
+        if (last_dirty != INVALID_FRAME)
+        {
+            pager_flush(pager, pager->frames[last_dirty].page_num);
+        }
+        last_dirty = i;
+    }
+
+    if (last_dirty == INVALID_FRAME)
+    {
+        if (pager->wal_frames == pager->wal_committed)
+        {
+            return; // nothing changed
+        }
+        // Pages were already spilled to the log by eviction; commit them
+        // with a copy of the header page.
+        void *header = get_page(pager, 0);
+        wal_append_frame(pager, 0, header, pager->num_pages);
+        unpin_page(pager, 0, false);
+    }
+    else
+    {
+        Frame *frame = &pager->frames[last_dirty];
+        wal_append_frame(pager, frame->page_num, frame->data, pager->num_pages);
+        frame->dirty = false;
+    }
+
+    if (!pager->async_commit)
+    {
+        wal_sync(pager);
+    }
+    else if (++pager->commits_since_sync >= WAL_SYNC_COMMITS)
+    {
+        wal_sync(pager);
+        pager->commits_since_sync = 0;
+    }
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    bool wake_checkpointer = pager->wal_committed - pager->wal_backfilled >= WAL_CHECKPOINT_FRAMES;
+    bool fully_backfilled = !pager->checkpoint_running && pager->wal_backfilled == pager->wal_frames;
+    if (wake_checkpointer)
+    {
+        pthread_cond_signal(&pager->wal_cond);
+    }
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    if (fully_backfilled)
+    {
+        wal_restart(pager);
+    }
+    else if (pager->wal_frames >= WAL_RESTART_FRAMES)
+    {
+        // The checkpointer cannot keep up, or snapshots hold the log back;
+        // catch up here as far as they allow. Past WAL_MAX_FRAMES, wait for
+        // the snapshots that need older frames, so the log stays bounded.
+        if (pager->wal_frames >= WAL_MAX_FRAMES)
+        {
+            wal_wait_for_readers(pager);
+        }
+        wal_checkpoint_all(pager);
+    }
+}
+
+/* ======== PAGER ======== */
+
+void lru_unlink(Pager *pager, uint32_t frame_index)
+{
+    Frame *frame = &pager->frames[frame_index];
+    if (frame->lru_prev != INVALID_FRAME)
+    {
+        pager->frames[frame->lru_prev].lru_next = frame->lru_next;
+    }
+    else
+    {
+        pager->lru_head = frame->lru_next;
+    }
+    if (frame->lru_next != INVALID_FRAME)
+    {
+        pager->frames[frame->lru_next].lru_prev = frame->lru_prev;
+    }
+    else
+    {
+        pager->lru_tail = frame->lru_prev;
+    }
+}
+
+void lru_push_front(Pager *pager, uint32_t frame_index)
+{
+    Frame *frame = &pager->frames[frame_index];
+    frame->lru_prev = INVALID_FRAME;
+    frame->lru_next = pager->lru_head;
+    if (pager->lru_head != INVALID_FRAME)
+    {
+        pager->frames[pager->lru_head].lru_prev = frame_index;
+    }
+    pager->lru_head = frame_index;
+    if (pager->lru_tail == INVALID_FRAME)
+    {
+        pager->lru_tail = frame_index;
+    }
+}
+
+/*
+ * Pick the least recently used unpinned frame, writing it back first if it is
+ * dirty. Free frames are kept at the tail, so they are used up first.
+ */
+uint32_t pager_evict(Pager *pager)
+{
+    uint32_t frame_index = pager->lru_tail;
+    while (frame_index != INVALID_FRAME && pager->frames[frame_index].pin_count > 0)
+    {
+        frame_index = pager->frames[frame_index].lru_prev;
+    }
+    if (frame_index == INVALID_FRAME)
+    {
+        printf("Buffer pool exhausted: all %d frames are pinned.\n", pager->num_frames);
+        exit(EXIT_FAILURE);
+    }
+
+    Frame *frame = &pager->frames[frame_index];
+    if (frame->page_num != INVALID_PAGE_NUM)
+    {
+        if (frame->dirty)
+        {
+            pager_flush(pager, frame->page_num);
+        }
+        pager->page_table[frame->page_num] = INVALID_FRAME;
+        frame->page_num = INVALID_PAGE_NUM;
+    }
+    return frame_index;
+}
+
+void pager_grow_page_table(Pager *pager, uint32_t page_num)
+{
+    uint32_t capacity = pager->page_table_capacity > 0 ? pager->page_table_capacity : 64;
+    while (capacity <= page_num)
+    {
+        capacity *= 2;
+    }
+    pager->page_table = realloc(pager->page_table, capacity * sizeof(uint32_t));
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->wal_index = realloc(pager->wal_index, capacity * sizeof(uint32_t));
+    for (uint32_t i = pager->page_table_capacity; i < capacity; i++)
+    {
+        pager->page_table[i] = INVALID_FRAME;
+        pager->wal_index[i] = 0;
+    }
+    pager->page_table_capacity = capacity;
+    pthread_mutex_unlock(&pager->wal_mutex);
+}
+
+/*
+ * Return the page pinned in the buffer pool. Every get_page must be matched by
+ * an unpin_page once the caller is done with the pointer.
+ */
+void *get_page(Pager *pager, uint32_t page_num)
+{
+    if (page_num >= pager->page_table_capacity)
+    {
+        pager_grow_page_table(pager, page_num);
+    }
+
+    uint32_t frame_index = pager->page_table[page_num];
+    if (frame_index != INVALID_FRAME)
+    {
+        pager->stats.cache_hits++;
+    }
+    else
+    {
+        pager->stats.cache_misses++;
+        frame_index = pager_evict(pager);
+        Frame *frame = &pager->frames[frame_index];
+
+        // Pages past the end of the file read back as zeroes.
+        memset(frame->data, 0, PAGE_SIZE);
+        ssize_t bytes_read;
+        uint32_t wal_frame = pager->wal_index[page_num];
+        if (wal_frame != 0)
+        {
+            bytes_read = pread(pager->wal_file_descriptor, frame->data, PAGE_SIZE,
+                               wal_frame_offset(wal_frame) + WAL_FRAME_HEADER_SIZE);
+        }
+        else
+        {
+            bytes_read = pread(pager->file_descriptor, frame->data, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+        }
+        if (bytes_read == -1)
+        {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        frame->page_num = page_num;
+        frame->dirty = false;
+        pager->page_table[page_num] = frame_index;
+
+        if (page_num >= pager->num_pages)
+        {
+            pager->num_pages = page_num + 1;
+        }
+    }
+
+    Frame *frame = &pager->frames[frame_index];
+    frame->pin_count++;
+    lru_unlink(pager, frame_index);
+    lru_push_front(pager, frame_index);
+    return frame->data;
+}
+
+void unpin_page(Pager *pager, uint32_t page_num, bool dirty)
+{
+    uint32_t frame_index = page_num < pager->page_table_capacity ? pager->page_table[page_num] : INVALID_FRAME;
+    if (frame_index == INVALID_FRAME || pager->frames[frame_index].pin_count == 0)
+    {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame *frame = &pager->frames[frame_index];
+    frame->pin_count--;
+    frame->dirty |= dirty;
+}
+
+/*
+ * Pages are never freed, so new pages always go onto the end of the file.
+ */
+uint32_t get_unused_page_num(Pager *pager)
+{
+    return pager->num_pages;
+}
+
+void cursor_row(Cursor *cursor, Row *row)
+{
+    leaf_node_row(cursor->page, cursor->cell_num, row);
+}
+
+/*
+ * Read-only access for scans. In mmap mode a page that is neither in the
+ * buffer pool nor in the log is current in the db file, so it is returned
+ * straight from the mapping without being pinned. Anything else goes through
+ * get_page.
+ */
+void *get_page_for_read(Pager *pager, uint32_t page_num, bool *pinned)
+{
+    if (pager->map != NULL && page_num < pager->page_table_capacity &&
+        pager->page_table[page_num] == INVALID_FRAME && pager->wal_index[page_num] == 0)
+    {
+        size_t page_end = (size_t)(page_num + 1) * PAGE_SIZE;
+        if (page_end > pager->map_length)
+        {
+            // Checkpoints may have grown the file since we last looked.
+            struct stat st;
+            if (fstat(pager->file_descriptor, &st) == 0)
+            {
+                pager->map_length = (size_t)st.st_size < MMAP_RESERVE_BYTES ? (size_t)st.st_size : MMAP_RESERVE_BYTES;
+            }
+        }
+        if (page_end <= pager->map_length)
+        {
+            pager->stats.mapped_reads++;
+            *pinned = false;
+            return pager->map + (size_t)page_num * PAGE_SIZE;
+        }
+    }
+    *pinned = true;
+    return get_page(pager, page_num);
+}
+
+/*
+ * Only scans move cursors, so the next leaf is fetched read-only.
+ */
+void cursor_advance(Cursor *cursor)
+{
+    void *node = cursor->page;
+
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+        }
+        else if (cursor->snapshot != NULL)
+        {
+            cursor->page_num = next_page_num;
+            snapshot_read_page(cursor->snapshot, next_page_num, cursor->page);
+            cursor->cell_num = 0;
+        }
+        else
+        {
+            if (cursor->page_pinned)
+            {
+                unpin_page(cursor->table->pager, cursor->page_num, false);
+            }
+            cursor->page_num = next_page_num;
+            cursor->page = get_page_for_read(cursor->table->pager, next_page_num, &cursor->page_pinned);
+            cursor->cell_num = 0;
+        }
+    }
+}
+
+void cursor_close(Cursor *cursor)
+{
+    if (cursor->snapshot != NULL)
+    {
+        free(cursor->page);
+    }
+    else if (cursor->page_pinned)
+    {
+        unpin_page(cursor->table->pager, cursor->page_num, false);
+    }
+    free(cursor);
+}
+
+Pager *pager_open(const char *filename, uint32_t num_frames, bool use_mmap)
+{
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+    if (fd == -1)
+    {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Pager *pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+
+    pager->num_frames = num_frames;
+    pager->frames = malloc(num_frames * sizeof(Frame));
+    void *pool = malloc((size_t)num_frames * PAGE_SIZE);
+    pager->lru_head = INVALID_FRAME;
+    pager->lru_tail = INVALID_FRAME;
+    for (uint32_t i = 0; i < num_frames; i++)
+    {
+        Frame *frame = &pager->frames[i];
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->pin_count = 0;
+        frame->dirty = false;
+        frame->data = pool + (size_t)i * PAGE_SIZE;
+        lru_push_front(pager, i);
+    }
+
+    pthread_mutex_init(&pager->wal_mutex, NULL);
+    pthread_cond_init(&pager->wal_cond, NULL);
+    pthread_cond_init(&pager->reader_cond, NULL);
+    pager->page_table_capacity = 0;
+    pager->page_table = NULL;
+    pager->wal_index = NULL;
+    pager_grow_page_table(pager, 0);
+
+    pager->wal_filename = malloc(strlen(filename) + 5);
+    sprintf(pager->wal_filename, "%s-wal", filename);
+    pager->wal_file_descriptor = open(pager->wal_filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (pager->wal_file_descriptor == -1)
+    {
+        printf("Unable to open WAL file\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->wal_salt = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+    pager->wal_frames = 0;
+    pager->wal_committed = 0;
+    pager->wal_synced = 0;
+    pager->wal_backfilled = 0;
+    pager->commits_since_sync = 0;
+    pager->wal_syncing = false;
+    pager->async_commit = false;
+    pager->wal_frame_prev = NULL;
+    pager->wal_frame_prev_capacity = 0;
+    for (uint32_t i = 0; i < MAX_READERS; i++)
+    {
+        pager->reader_marks[i] = INVALID_FRAME;
+    }
+    pager->num_readers = 0;
+    pager->reads_in_progress = 0;
+    pager->wal_restarting = false;
+    memset(&pager->stats, 0, sizeof(PagerStats));
+    pager->checkpoint_running = false;
+    pager->wal_worker_stop = false;
+
+    wal_recover(pager);
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    if (file_length % PAGE_SIZE != 0)
+    {
+        printf("Db file is not a whole number of pages. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->num_pages = file_length / PAGE_SIZE;
+    pager_grow_page_table(pager, pager->num_pages);
+
+    pager->map = NULL;
+    pager->map_length = 0;
+    if (use_mmap)
+    {
+        // Reserve address space once so the mapping never moves as the file grows.
+        void *map = mmap(NULL, MMAP_RESERVE_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            printf("Unable to mmap db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        madvise(map, MMAP_RESERVE_BYTES, MADV_SEQUENTIAL);
+        pager->map = map;
+        pager->map_length = (size_t)file_length;
+    }
+
+    pthread_create(&pager->wal_worker, NULL, wal_worker_main, pager);
+
+    return pager;
+}
+
+/*
+ * Write a page out of the buffer pool. Pages go to the log, never straight to
+ * the db file; the frame is part of the commit that follows it.
+ */
+void pager_flush(Pager *pager, uint32_t page_num)
+{
+    uint32_t frame_index = page_num < pager->page_table_capacity ? pager->page_table[page_num] : INVALID_FRAME;
+    if (frame_index == INVALID_FRAME)
+    {
+        printf("Tried to flush page %d which is not in the buffer pool\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame *frame = &pager->frames[frame_index];
+
+    wal_append_frame(pager, page_num, frame->data, 0);
+    frame->dirty = false;
+}
+
+void db_close(Table *table)
+{
+    Pager *pager = table->pager;
+    if (pager->num_readers > 0)
+    {
+        printf("Tried to close the database with %d snapshots open\n", pager->num_readers);
+        exit(EXIT_FAILURE);
+    }
+
+    pager_commit(pager);
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->wal_worker_stop = true;
+    pthread_cond_broadcast(&pager->wal_cond);
+    pthread_mutex_unlock(&pager->wal_mutex);
+    pthread_join(pager->wal_worker, NULL);
+
+    wal_checkpoint_all(pager);
+
+    int result = close(pager->file_descriptor);
+    if (result == -1)
+    {
+        printf("Error closing db file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(pager->wal_file_descriptor);
+    unlink(pager->wal_filename);
+    if (pager->map != NULL)
+    {
+        munmap(pager->map, MMAP_RESERVE_BYTES);
+    }
+
+    pthread_mutex_destroy(&pager->wal_mutex);
+    pthread_cond_destroy(&pager->wal_cond);
+    pthread_cond_destroy(&pager->reader_cond);
+    free(pager->wal_filename);
+    free(pager->frames[0].data);
+    free(pager->frames);
+    free(pager->page_table);
+    free(pager->wal_index);
+    free(pager->wal_frame_prev);
+    free(pager);
+    free(table);
+}
+
+Table *db_open(const char *filename, uint32_t num_frames, bool use_mmap)
+{
+    if (db_is_format0(filename))
+    {
+        db_upgrade_format0(filename, num_frames);
+    }
+    Pager *pager = pager_open(filename, num_frames, use_mmap);
+    Table *table = malloc(sizeof(Table));
+    table->pager = pager;
+    memset(table->statement_latency, 0, sizeof(table->statement_latency));
+
+    if (pager->num_pages == 0)
+    {
+        // New database file. Page 0 is the header, page 1 the root leaf.
+        void *header = get_page(pager, 0);
+        memcpy(header + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE);
+        *(uint32_t *)(header + HEADER_VERSION_OFFSET) = DB_FORMAT_VERSION;
+        *(uint32_t *)(header + HEADER_ROOT_PAGE_OFFSET) = 1;
+        unpin_page(pager, 0, true);
+
+        void *root_node = get_page(pager, 1);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        unpin_page(pager, 1, true);
+        pager_commit(pager);
+    }
+
+    void *header = get_page(pager, 0);
+    if (memcmp(header + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE) != 0)
+    {
+        printf("File is not a database file.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t version = *(uint32_t *)(header + HEADER_VERSION_OFFSET);
+    if (version == 1)
+    {
+        unpin_page(pager, 0, false);
+        db_upgrade(table, filename, num_frames);
+        return db_open(filename, num_frames, use_mmap);
+    }
+    if (version != DB_FORMAT_VERSION)
+    {
+        printf("Unsupported database format version %d.\n", version);
+        exit(EXIT_FAILURE);
+    }
+    table->root_page_num = *(uint32_t *)(header + HEADER_ROOT_PAGE_OFFSET);
+    for (uint32_t i = 0; i < NUM_INDEXES; i++)
+    {
+        // Files written before indexes existed have zeroes here: no index.
+        table->index_root[i] = *(uint32_t *)(header + HEADER_INDEX_ROOTS_OFFSET + i * HEADER_INDEX_ROOT_SIZE);
+    }
+    unpin_page(pager, 0, false);
+
+    return table;
+}
+
+/* ======== B+TREE ======== */
+
+/*
+ * Binary search for the position of key in the leaf. Returns the index of the
+ * key if present, otherwise the index it should be inserted at.
+ */
+uint32_t leaf_node_find_cell(void *node, uint32_t key)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t min_index = 0;
+    uint32_t one_past_max_index = num_cells;
+    while (one_past_max_index != min_index)
+    {
+        uint32_t index = (min_index + one_past_max_index) / 2;
+        uint32_t key_at_index = *leaf_node_key(node, index);
+        if (key == key_at_index)
+        {
+            return index;
+        }
+        if (key < key_at_index)
+        {
+            one_past_max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+    return min_index;
+}
+
+Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key)
+{
+    void *node = get_page(table->pager, page_num);
+
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->snapshot = NULL;
+    cursor->page_num = page_num;
+    cursor->page = node;
+    cursor->page_pinned = true;
+    cursor->end_of_table = false;
+    cursor->cell_num = leaf_node_find_cell(node, key);
+    return cursor;
+}
+
+/*
+ * Index of the child which should contain the given key.
+ */
+uint32_t internal_node_find_child(void *node, uint32_t key)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys; // there is one more child than key
+    while (min_index != max_index)
+    {
+        uint32_t index = (min_index + max_index) / 2;
+        uint32_t key_to_right = *internal_node_key(node, index);
+        if (key_to_right >= key)
+        {
+            max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index;
+}
+
+/*
+ * Return the position of the given key. If the key is not present, return
+ * the position where it should be inserted.
+ */
+Cursor *table_find(Table *table, uint32_t key)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(pager, page_num);
+
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t child_index = internal_node_find_child(node, key);
+        uint32_t child_num = *internal_node_child(node, child_index);
+        unpin_page(pager, page_num, false);
+        page_num = child_num;
+        node = get_page(pager, page_num);
+    }
+    unpin_page(pager, page_num, false);
+
+    return leaf_node_find(table, page_num, key);
+}
+
+/*
+ * Cursor at the first row whose key is >= key.
+ */
+Cursor *table_seek(Table *table, uint32_t key)
+{
+    Cursor *cursor = table_find(table, key);
+
+    uint32_t num_cells = *leaf_node_num_cells(cursor->page);
+    if (cursor->cell_num >= num_cells)
+    {
+        // Past the last key of this leaf: the next row, if any, starts the next leaf.
+        uint32_t next_page_num = *leaf_node_next_leaf(cursor->page);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+        }
+        else
+        {
+            unpin_page(table->pager, cursor->page_num, false);
+            cursor->page_num = next_page_num;
+            cursor->page = get_page_for_read(table->pager, next_page_num, &cursor->page_pinned);
+            cursor->cell_num = 0;
+        }
+    }
+
+    return cursor;
+}
+
+Cursor *table_start(Table *table)
+{
+    return table_seek(table, 0);
+}
+
+/*
+ * The root always stays on the same page. Its contents move to a new left
+ * child and it becomes an internal node over the left and right children.
+ */
+void create_new_root(Table *table, uint32_t right_child_page_num)
+{
+    Pager *pager = table->pager;
+    void *root = get_page(pager, table->root_page_num);
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(pager);
+    void *left_child = get_page(pager, left_child_page_num);
+
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    if (get_node_type(left_child) == NODE_INTERNAL)
+    {
+        for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++)
+        {
+            uint32_t child_page_num = *internal_node_child(left_child, i);
+            void *child = get_page(pager, child_page_num);
+            *node_parent(child) = left_child_page_num;
+            unpin_page(pager, child_page_num, true);
+        }
+    }
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    *internal_node_key(root, 0) = get_node_max_key(pager, left_child);
+    *internal_node_right_child(root) = right_child_page_num;
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+
+    unpin_page(pager, left_child_page_num, true);
+    unpin_page(pager, right_child_page_num, true);
+    unpin_page(pager, table->root_page_num, true);
+}
+
+void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
+{
+    uint32_t old_child_index = internal_node_find_child(node, old_key);
+    // The right child has no key of its own.
+    if (old_child_index < *internal_node_num_keys(node))
+    {
+        *internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+/*
+ * The node is full: gather its children plus the new one, give the lower
+ * half back to the old node and move the upper half to a new sibling.
+ */
+void internal_node_split_and_insert(Table *table, uint32_t old_page_num, uint32_t child_page_num)
+{
+    Pager *pager = table->pager;
+    void *old_node = get_page(pager, old_page_num);
+    uint32_t old_max = get_node_max_key(pager, old_node);
+    void *child = get_page(pager, child_page_num);
+    uint32_t child_max = get_node_max_key(pager, child);
+    unpin_page(pager, child_page_num, false);
+
+    uint32_t old_num_keys = *internal_node_num_keys(old_node);
+    uint32_t total = old_num_keys + 2;
+    uint32_t children[total];
+    uint32_t keys[total];
+
+    uint32_t n = 0;
+    bool inserted = false;
+    for (uint32_t i = 0; i <= old_num_keys; i++)
+    {
+        uint32_t key = (i < old_num_keys) ? *internal_node_key(old_node, i) : old_max;
+        if (!inserted && child_max < key)
+        {
+            children[n] = child_page_num;
+            keys[n++] = child_max;
+            inserted = true;
+        }
+        children[n] = *internal_node_child(old_node, i);
+        keys[n++] = key;
+    }
+    if (!inserted)
+    {
+        children[n] = child_page_num;
+        keys[n++] = child_max;
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    initialize_internal_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+
+    uint32_t left_count = total / 2;
+    *internal_node_num_keys(old_node) = left_count - 1;
+    for (uint32_t i = 0; i < left_count - 1; i++)
+    {
+        *internal_node_child(old_node, i) = children[i];
+        *internal_node_key(old_node, i) = keys[i];
+    }
+    *internal_node_right_child(old_node) = children[left_count - 1];
+
+    *internal_node_num_keys(new_node) = total - left_count - 1;
+    for (uint32_t i = left_count; i < total - 1; i++)
+    {
+        *internal_node_child(new_node, i - left_count) = children[i];
+        *internal_node_key(new_node, i - left_count) = keys[i];
+    }
+    *internal_node_right_child(new_node) = children[total - 1];
+    unpin_page(pager, new_page_num, true);
+
+    for (uint32_t i = 0; i < total; i++)
+    {
+        void *moved_child = get_page(pager, children[i]);
+        *node_parent(moved_child) = (i < left_count) ? old_page_num : new_page_num;
+        unpin_page(pager, children[i], true);
+    }
+
+    bool old_is_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    unpin_page(pager, old_page_num, true);
+
+    if (old_is_root)
+    {
+        create_new_root(table, new_page_num);
+    }
+    else
+    {
+        void *parent = get_page(pager, parent_page_num);
+        update_internal_node_key(parent, old_max, keys[left_count - 1]);
+        unpin_page(pager, parent_page_num, true);
+        internal_node_insert(table, parent_page_num, new_page_num);
+    }
+}
+
+/*
+ * Add a new child/key pair to parent that corresponds to child.
+ */
+void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num)
+{
+    Pager *pager = table->pager;
+    void *parent = get_page(pager, parent_page_num);
+    void *child = get_page(pager, child_page_num);
+    uint32_t child_max_key = get_node_max_key(pager, child);
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+    if (original_num_keys >= INTERNAL_NODE_MAX_KEYS)
+    {
+        unpin_page(pager, child_page_num, false);
+        unpin_page(pager, parent_page_num, false);
+        internal_node_split_and_insert(table, parent_page_num, child_page_num);
+        return;
+    }
+
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t right_child_max_key = get_node_max_key(pager, right_child);
+    unpin_page(pager, right_child_page_num, false);
+
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    if (child_max_key > right_child_max_key)
+    {
+        // Replace right child
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = right_child_max_key;
+        *internal_node_right_child(parent) = child_page_num;
+    }
+    else
+    {
+        // Make room for the new cell
+        for (uint32_t i = original_num_keys; i > index; i--)
+        {
+            void *destination = internal_node_cell(parent, i);
+            void *source = internal_node_cell(parent, i - 1);
+            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+        }
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+    }
+    *node_parent(child) = parent_page_num;
+
+    unpin_page(pager, child_page_num, true);
+    unpin_page(pager, parent_page_num, true);
+}
+
+/*
+ * Decode the leaf's rows plus the new one, then rebuild the old node with the
+ * lower half and a new node with the upper half. The halves are split by
+ * bytes rather than by count, since rows vary in size. Update the parent or
+ * create a new root.
+ */
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value)
+{
+    Pager *pager = cursor->table->pager;
+    void *old_node = cursor->page;
+    uint32_t old_max = get_node_max_key(pager, old_node);
+
+    uint32_t num_rows = *leaf_node_num_cells(old_node) + 1;
+    Row *rows = malloc(num_rows * sizeof(Row));
+    uint32_t *lengths = malloc(num_rows * sizeof(uint32_t));
+    uint32_t total_length = 0;
+    for (uint32_t i = 0, cell_num = 0; i < num_rows; i++)
+    {
+        if (i == cursor->cell_num)
+        {
+            rows[i] = *value;
+            rows[i].id = key;
+            lengths[i] = leaf_cell_length(value) + LEAF_NODE_SLOT_SIZE;
+        }
+        else
+        {
+            leaf_node_row(old_node, cell_num, &rows[i]);
+            lengths[i] = *leaf_node_cell_length(old_node, cell_num) + LEAF_NODE_SLOT_SIZE;
+            cell_num++;
+        }
+        total_length += lengths[i];
+    }
+
+    // Both halves keep at least one row.
+    uint32_t left_count = 0;
+    uint32_t left_length = 0;
+    while (left_count < num_rows - 1 && (left_count == 0 || 2 * (left_length + lengths[left_count]) <= total_length))
+    {
+        left_length += lengths[left_count++];
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+
+    bool old_is_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    initialize_leaf_node(old_node);
+    set_node_root(old_node, old_is_root);
+    *node_parent(old_node) = parent_page_num;
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    if (!leaf_node_build(old_node, rows, left_count) ||
+        !leaf_node_build(new_node, rows + left_count, num_rows - left_count))
+    {
+        printf("Split leaf does not fit in a page.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(rows);
+    free(lengths);
+
+    unpin_page(pager, new_page_num, true);
+    unpin_page(pager, cursor->page_num, true); // the cursor still holds its own pin
+
+    if (old_is_root)
+    {
+        create_new_root(cursor->table, new_page_num);
+    }
+    else
+    {
+        uint32_t new_max = get_node_max_key(pager, old_node);
+        void *parent = get_page(pager, parent_page_num);
+
+        update_internal_node_key(parent, old_max, new_max);
+        unpin_page(pager, parent_page_num, true);
+        internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    }
+}
+
+void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value)
+{
+    Pager *pager = cursor->table->pager;
+    void *node = get_page(pager, cursor->page_num);
+
+    if (!leaf_node_try_insert(node, cursor->cell_num, key, value))
+    {
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+    unpin_page(pager, cursor->page_num, true);
+}
+
+/* ======== SNAPSHOTS ======== */
+
+/*
+ * Start a read-only view of everything committed so far. Snapshots may be
+ * opened, read and closed on any thread while the writer thread keeps
+ * inserting. The writer only waits for them once the log reaches
+ * WAL_MAX_FRAMES, so the writer thread must not hold a snapshot itself. Waits
+ * if MAX_READERS snapshots are already open. Close every snapshot before
+ * db_close.
+ */
+Snapshot *snapshot_open(Table *table)
+{
+    Pager *pager = table->pager;
+    Snapshot *snapshot = malloc(sizeof(Snapshot));
+    snapshot->table = table;
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    while (pager->num_readers == MAX_READERS)
+    {
+        pthread_cond_wait(&pager->reader_cond, &pager->wal_mutex);
+    }
+    uint32_t slot = 0;
+    while (pager->reader_marks[slot] != INVALID_FRAME)
+    {
+        slot++;
+    }
+    snapshot->slot = slot;
+    pager->reader_marks[slot] = pager->wal_committed;
+    pager->num_readers++;
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    return snapshot;
+}
+
+void snapshot_close(Snapshot *snapshot)
+{
+    Pager *pager = snapshot->table->pager;
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->reader_marks[snapshot->slot] = INVALID_FRAME;
+    pager->num_readers--;
+    pthread_cond_broadcast(&pager->reader_cond);
+    pthread_mutex_unlock(&pager->wal_mutex);
+    free(snapshot);
+}
+
+/*
+ * Copy a page as the snapshot sees it into buffer: the newest log frame at or
+ * before the snapshot's mark, or the db file if there is none. Checkpoints
+ * never go past the oldest open snapshot, so the db file still holds that
+ * version, and the read counts in reads_in_progress so the log is not
+ * restarted under it.
+ */
+void snapshot_read_page(Snapshot *snapshot, uint32_t page_num, void *buffer)
+{
+    Pager *pager = snapshot->table->pager;
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    while (pager->wal_restarting)
+    {
+        pthread_cond_wait(&pager->reader_cond, &pager->wal_mutex);
+    }
+    uint32_t mark = pager->reader_marks[snapshot->slot];
+    uint32_t frame_num = page_num < pager->page_table_capacity ? pager->wal_index[page_num] : 0;
+    while (frame_num > mark)
+    {
+        frame_num = pager->wal_frame_prev[frame_num];
+    }
+    pager->stats.snapshot_reads++;
+    pager->reads_in_progress++;
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    ssize_t bytes_read;
+    if (frame_num != 0)
+    {
+        bytes_read = pread(pager->wal_file_descriptor, buffer, PAGE_SIZE,
+                           wal_frame_offset(frame_num) + WAL_FRAME_HEADER_SIZE);
+    }
+    else
+    {
+        bytes_read = pread(pager->file_descriptor, buffer, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+    }
+
+    pthread_mutex_lock(&pager->wal_mutex);
+    pager->reads_in_progress--;
+    if (pager->reads_in_progress == 0 && pager->wal_restarting)
+    {
+        pthread_cond_broadcast(&pager->reader_cond);
+    }
+    pthread_mutex_unlock(&pager->wal_mutex);
+
+    // Every page a snapshot can reach was committed, so it is always whole.
+    if (bytes_read != (ssize_t)PAGE_SIZE)
+    {
+        printf("Error reading page %d for a snapshot: %d\n", page_num, errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Snapshot cursor at the first row whose key is >= key. The cursor owns a
+ * private copy of its leaf instead of a buffer pool pin.
+ */
+Cursor *snapshot_seek(Snapshot *snapshot, uint32_t key)
+{
+    Table *table = snapshot->table;
+    void *node = malloc(PAGE_SIZE);
+    uint32_t page_num = table->root_page_num;
+    snapshot_read_page(snapshot, page_num, node);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        snapshot_read_page(snapshot, page_num, node);
+    }
+
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->snapshot = snapshot;
+    cursor->page_num = page_num;
+    cursor->page = node;
+    cursor->page_pinned = false;
+    cursor->end_of_table = false;
+    cursor->cell_num = leaf_node_find_cell(node, key);
+
+    if (cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+        }
+        else
+        {
+            cursor->page_num = next_page_num;
+            snapshot_read_page(snapshot, next_page_num, node);
+            cursor->cell_num = 0;
+        }
+    }
+    return cursor;
+}
+
+Cursor *snapshot_start(Snapshot *snapshot)
+{
+    return snapshot_seek(snapshot, 0);
+}
+
+/* ======== SECONDARY INDEXES ======== */
+
+uint32_t *index_global_depth(void *meta)
+{
+    return meta + INDEX_GLOBAL_DEPTH_OFFSET;
+}
+
+uint32_t *index_num_dir_pages(void *meta)
+{
+    return meta + INDEX_NUM_DIR_PAGES_OFFSET;
+}
+
+uint32_t *index_dir_page(void *meta, uint32_t i)
+{
+    return meta + INDEX_DIR_PAGES_OFFSET + i * sizeof(uint32_t);
+}
+
+uint32_t *bucket_local_depth(void *bucket)
+{
+    return bucket + BUCKET_LOCAL_DEPTH_OFFSET;
+}
+
+uint32_t *bucket_num_entries(void *bucket)
+{
+    return bucket + BUCKET_NUM_ENTRIES_OFFSET;
+}
+
+uint32_t *bucket_overflow(void *bucket)
+{
+    return bucket + BUCKET_OVERFLOW_OFFSET;
+}
+
+uint32_t *bucket_entry_hash(void *bucket, uint32_t entry_num)
+{
+    return bucket + BUCKET_HEADER_SIZE + entry_num * BUCKET_ENTRY_SIZE;
+}
+
+uint32_t *bucket_entry_id(void *bucket, uint32_t entry_num)
+{
+    return bucket + BUCKET_HEADER_SIZE + entry_num * BUCKET_ENTRY_SIZE + sizeof(uint32_t);
+}
+
+/*
+ * FNV-1a over a column value.
+ */
+uint32_t hash_value(const char *value, uint32_t max_length)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < max_length && value[i] != '\0'; i++)
+    {
+        hash = (hash ^ (uint8_t)value[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t index_hash(IndexColumn column, const char *value)
+{
+    return column == INDEX_USERNAME ? hash_value(value, COLUMN_USERNAME_SIZE) : hash_value(value, COLUMN_EMAIL_SIZE);
+}
+
+uint32_t index_dir_get(Pager *pager, void *meta, uint32_t slot)
 {
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->row_num = 0;
-    cursor->end_of_table = (table->num_rows == 0);
+    uint32_t page_num = *index_dir_page(meta, slot / INDEX_DIR_ENTRIES_PER_PAGE);
+    uint32_t *dir = get_page(pager, page_num);
+    uint32_t bucket_page_num = dir[slot % INDEX_DIR_ENTRIES_PER_PAGE];
+    unpin_page(pager, page_num, false);
+    return bucket_page_num;
+}
 
-    return cursor;
+void index_dir_set(Pager *pager, void *meta, uint32_t slot, uint32_t bucket_page_num)
+{
+    uint32_t page_num = *index_dir_page(meta, slot / INDEX_DIR_ENTRIES_PER_PAGE);
+    uint32_t *dir = get_page(pager, page_num);
+    dir[slot % INDEX_DIR_ENTRIES_PER_PAGE] = bucket_page_num;
+    unpin_page(pager, page_num, true);
 }
 
-Cursor *table_end(Table *table)
+/*
+ * An empty index: global depth 0, one directory page, one bucket.
+ */
+uint32_t index_create_empty(Pager *pager)
 {
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->row_num = table->num_rows;
-    cursor->end_of_table = true;
+    uint32_t meta_page_num = get_unused_page_num(pager);
+    void *meta = get_page(pager, meta_page_num);
+    uint32_t dir_page_num = get_unused_page_num(pager);
+    void *dir = get_page(pager, dir_page_num);
+    uint32_t bucket_page_num = get_unused_page_num(pager);
+    void *bucket = get_page(pager, bucket_page_num);
+
+    memset(meta, 0, PAGE_SIZE);
+    memset(dir, 0, PAGE_SIZE);
+    memset(bucket, 0, PAGE_SIZE);
+    *index_num_dir_pages(meta) = 1;
+    *index_dir_page(meta, 0) = dir_page_num;
+    ((uint32_t *)dir)[0] = bucket_page_num;
+
+    unpin_page(pager, bucket_page_num, true);
+    unpin_page(pager, dir_page_num, true);
+    unpin_page(pager, meta_page_num, true);
+    return meta_page_num;
+}
 
-    return cursor;
+/*
+ * Double the directory: slot i + n points where slot i does.
+ */
+void index_double_directory(Pager *pager, void *meta)
+{
+    uint32_t num_slots = 1u << *index_global_depth(meta);
+    uint32_t pages_needed = (2 * num_slots + INDEX_DIR_ENTRIES_PER_PAGE - 1) / INDEX_DIR_ENTRIES_PER_PAGE;
+    while (*index_num_dir_pages(meta) < pages_needed)
+    {
+        uint32_t page_num = get_unused_page_num(pager);
+        void *dir = get_page(pager, page_num);
+        memset(dir, 0, PAGE_SIZE);
+        unpin_page(pager, page_num, true);
+        *index_dir_page(meta, *index_num_dir_pages(meta)) = page_num;
+        *index_num_dir_pages(meta) += 1;
+    }
+
+    for (uint32_t slot = 0; slot < num_slots; slot++)
+    {
+        index_dir_set(pager, meta, slot + num_slots, index_dir_get(pager, meta, slot));
+    }
+    *index_global_depth(meta) += 1;
+}
+
+bool bucket_single_hash(void *bucket)
+{
+    uint32_t num_entries = *bucket_num_entries(bucket);
+    for (uint32_t i = 1; i < num_entries; i++)
+    {
+        if (*bucket_entry_hash(bucket, i) != *bucket_entry_hash(bucket, 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Append to the last page of the bucket's overflow chain, starting a new
+ * page when it is full.
+ */
+void bucket_chain_append(Pager *pager, uint32_t page_num, uint32_t hash, uint32_t id)
+{
+    void *page = get_page(pager, page_num);
+    while (*bucket_overflow(page) != 0)
+    {
+        uint32_t next_page_num = *bucket_overflow(page);
+        unpin_page(pager, page_num, false);
+        page_num = next_page_num;
+        page = get_page(pager, page_num);
+    }
+
+    if (*bucket_num_entries(page) >= BUCKET_MAX_ENTRIES)
+    {
+        uint32_t new_page_num = get_unused_page_num(pager);
+        void *new_page = get_page(pager, new_page_num);
+        memset(new_page, 0, PAGE_SIZE);
+        *bucket_local_depth(new_page) = *bucket_local_depth(page);
+        *bucket_overflow(page) = new_page_num;
+        unpin_page(pager, page_num, true);
+        page_num = new_page_num;
+        page = new_page;
+    }
+
+    uint32_t num_entries = *bucket_num_entries(page);
+    *bucket_entry_hash(page, num_entries) = hash;
+    *bucket_entry_id(page, num_entries) = id;
+    *bucket_num_entries(page) = num_entries + 1;
+    unpin_page(pager, page_num, true);
+}
+
+/*
+ * Split the bucket on bit local_depth of the hash, doubling the directory
+ * first if the bucket is already as deep as the directory.
+ */
+void bucket_split(Pager *pager, void *meta, uint32_t bucket_page_num)
+{
+    void *bucket = get_page(pager, bucket_page_num);
+    uint32_t local_depth = *bucket_local_depth(bucket);
+    if (local_depth == *index_global_depth(meta))
+    {
+        index_double_directory(pager, meta);
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_bucket = get_page(pager, new_page_num);
+    memset(new_bucket, 0, PAGE_SIZE);
+    *bucket_local_depth(bucket) = local_depth + 1;
+    *bucket_local_depth(new_bucket) = local_depth + 1;
+
+    uint32_t kept = 0;
+    uint32_t moved = 0;
+    uint32_t num_entries = *bucket_num_entries(bucket);
+    for (uint32_t i = 0; i < num_entries; i++)
+    {
+        uint32_t hash = *bucket_entry_hash(bucket, i);
+        uint32_t id = *bucket_entry_id(bucket, i);
+        if (hash & (1u << local_depth))
+        {
+            *bucket_entry_hash(new_bucket, moved) = hash;
+            *bucket_entry_id(new_bucket, moved++) = id;
+        }
+        else
+        {
+            *bucket_entry_hash(bucket, kept) = hash;
+            *bucket_entry_id(bucket, kept++) = id;
+        }
+    }
+    *bucket_num_entries(bucket) = kept;
+    *bucket_num_entries(new_bucket) = moved;
+    uint32_t low_bits = *bucket_entry_hash(bucket, 0);
+    if (kept == 0)
+    {
+        low_bits = *bucket_entry_hash(new_bucket, 0);
+    }
+    low_bits &= (1u << local_depth) - 1;
+    unpin_page(pager, new_page_num, true);
+    unpin_page(pager, bucket_page_num, true);
+
+    // Every slot ending in low_bits pointed at the old bucket; those with the
+    // new bit set now point at the new one.
+    uint32_t num_slots = 1u << *index_global_depth(meta);
+    for (uint32_t slot = low_bits | (1u << local_depth); slot < num_slots; slot += 2u << local_depth)
+    {
+        index_dir_set(pager, meta, slot, new_page_num);
+    }
+}
+
+void hash_index_insert(Pager *pager, uint32_t meta_page_num, uint32_t hash, uint32_t id)
+{
+    void *meta = get_page(pager, meta_page_num);
+    while (true)
+    {
+        uint32_t slot = hash & ((1u << *index_global_depth(meta)) - 1);
+        uint32_t bucket_page_num = index_dir_get(pager, meta, slot);
+        void *bucket = get_page(pager, bucket_page_num);
+        uint32_t num_entries = *bucket_num_entries(bucket);
+
+        if (num_entries < BUCKET_MAX_ENTRIES && *bucket_overflow(bucket) == 0)
+        {
+            *bucket_entry_hash(bucket, num_entries) = hash;
+            *bucket_entry_id(bucket, num_entries) = id;
+            *bucket_num_entries(bucket) = num_entries + 1;
+            unpin_page(pager, bucket_page_num, true);
+            break;
+        }
+
+        // Splitting cannot separate entries with the same hash (many rows with
+        // one username), so those buckets grow an overflow chain instead.
+        bool chain = *bucket_overflow(bucket) != 0 || bucket_single_hash(bucket) ||
+                     (*bucket_local_depth(bucket) == INDEX_MAX_GLOBAL_DEPTH);
+        unpin_page(pager, bucket_page_num, false);
+        if (chain)
+        {
+            bucket_chain_append(pager, bucket_page_num, hash, id);
+            break;
+        }
+        bucket_split(pager, meta, bucket_page_num);
+    }
+    unpin_page(pager, meta_page_num, true);
+}
+
+/*
+ * Ids of all rows whose column hashes like value, in a malloc'd array. Hash
+ * collisions are possible, so callers still compare the row itself.
+ */
+uint32_t index_lookup(Table *table, IndexColumn column, const char *value, uint32_t **ids)
+{
+    Pager *pager = table->pager;
+    uint32_t meta_page_num = table->index_root[column];
+    uint32_t hash = index_hash(column, value);
+
+    void *meta = get_page(pager, meta_page_num);
+    uint32_t slot = hash & ((1u << *index_global_depth(meta)) - 1);
+    uint32_t page_num = index_dir_get(pager, meta, slot);
+    unpin_page(pager, meta_page_num, false);
+
+    uint32_t num_ids = 0;
+    uint32_t capacity = 16;
+    *ids = malloc(capacity * sizeof(uint32_t));
+    while (page_num != 0)
+    {
+        void *bucket = get_page(pager, page_num);
+        uint32_t num_entries = *bucket_num_entries(bucket);
+        for (uint32_t i = 0; i < num_entries; i++)
+        {
+            if (*bucket_entry_hash(bucket, i) != hash)
+            {
+                continue;
+            }
+            if (num_ids == capacity)
+            {
+                capacity *= 2;
+                *ids = realloc(*ids, capacity * sizeof(uint32_t));
+            }
+            (*ids)[num_ids++] = *bucket_entry_id(bucket, i);
+        }
+        uint32_t next_page_num = *bucket_overflow(bucket);
+        unpin_page(pager, page_num, false);
+        page_num = next_page_num;
+    }
+    return num_ids;
+}
+
+const char *index_column_value(Row *row, IndexColumn column)
+{
+    return (column == INDEX_USERNAME) ? row->username : row->email;
+}
+
+/*
+ * Add a newly inserted row to every index on the table.
+ */
+void index_insert_row(Table *table, Row *row)
+{
+    for (uint32_t column = 0; column < NUM_INDEXES; column++)
+    {
+        if (table->index_root[column] != 0)
+        {
+            hash_index_insert(table->pager, table->index_root[column],
+                              index_hash(column, index_column_value(row, column)), row->id);
+        }
+    }
+}
+
+/*
+ * Build an index over the rows already in the table and record its meta page
+ * in the header, all in one commit. Returns the number of rows indexed.
+ */
+uint32_t table_create_index(Table *table, IndexColumn column)
+{
+    Pager *pager = table->pager;
+    uint32_t meta_page_num = index_create_empty(pager);
+    uint32_t num_rows = 0;
+
+    Cursor *cursor = table_start(table);
+    while (!(cursor->end_of_table))
+    {
+        Row row;
+        cursor_row(cursor, &row);
+        hash_index_insert(pager, meta_page_num, index_hash(column, index_column_value(&row, column)), row.id);
+        num_rows++;
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+
+    void *header = get_page(pager, 0);
+    *(uint32_t *)(header + HEADER_INDEX_ROOTS_OFFSET + column * HEADER_INDEX_ROOT_SIZE) = meta_page_num;
+    unpin_page(pager, 0, true);
+    table->index_root[column] = meta_page_num;
+    pager_commit(pager);
+    return num_rows;
+}
+
+void execute_create_index(Table *table, const char *column_name)
+{
+    IndexColumn column;
+    if (strcmp(column_name, "username") == 0)
+    {
+        column = INDEX_USERNAME;
+    }
+    else if (strcmp(column_name, "email") == 0)
+    {
+        column = INDEX_EMAIL;
+    }
+    else
+    {
+        printf("Cannot index column '%s'\n", column_name);
+        return;
+    }
+    if (table->index_root[column] != 0)
+    {
+        printf("Index on %s already exists\n", column_name);
+        return;
+    }
+
+    uint32_t num_rows = table_create_index(table, column);
+    printf("Indexed %u rows on %s\n", num_rows, column_name);
+}
+
+/* ======== BULK IMPORT ======== */
+
+uint32_t table_rightmost_leaf(Table *table)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t child_page_num = *internal_node_right_child(node);
+        unpin_page(pager, page_num, false);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+    }
+    unpin_page(pager, page_num, false);
+    return page_num;
+}
+
+/*
+ * Append a row whose key is larger than every key in the table to the
+ * rightmost leaf. Unlike leaf_node_split_and_insert, a full leaf stays full
+ * and the row starts a new leaf, so sorted input packs every page and new
+ * pages are allocated in file order. Returns the new rightmost leaf.
+ */
+uint32_t leaf_node_append(Table *table, uint32_t leaf_page_num, Row *row)
+{
+    Pager *pager = table->pager;
+    void *leaf = get_page(pager, leaf_page_num);
+
+    if (leaf_node_try_insert(leaf, *leaf_node_num_cells(leaf), row->id, row))
+    {
+        unpin_page(pager, leaf_page_num, true);
+        return leaf_page_num;
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_leaf = get_page(pager, new_page_num);
+    initialize_leaf_node(new_leaf);
+    *node_parent(new_leaf) = *node_parent(leaf);
+    *leaf_node_next_leaf(leaf) = new_page_num;
+    leaf_node_try_insert(new_leaf, 0, row->id, row);
+
+    bool leaf_is_root = is_node_root(leaf);
+    uint32_t parent_page_num = *node_parent(leaf);
+    unpin_page(pager, new_page_num, true);
+    unpin_page(pager, leaf_page_num, true);
+
+    if (leaf_is_root)
+    {
+        create_new_root(table, new_page_num);
+    }
+    else
+    {
+        internal_node_insert(table, parent_page_num, new_page_num);
+    }
+    return new_page_num;
+}
+
+/*
+ * Parse "id,username,email". Returns false for lines that are not a valid row.
+ */
+bool parse_csv_row(char *line, Row *row)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *username = strchr(line, ',');
+    if (username == NULL)
+    {
+        return false;
+    }
+    *username++ = '\0';
+    char *email = strchr(username, ',');
+    if (email == NULL)
+    {
+        return false;
+    }
+    *email++ = '\0';
+
+    char *end;
+    long id = strtol(line, &end, 10);
+    if (end == line || *end != '\0' || id < 0 || id > UINT32_MAX)
+    {
+        return false;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE)
+    {
+        return false;
+    }
+
+    row->id = (uint32_t)id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+    return true;
+}
+
+int compare_rows_by_id(const void *a, const void *b)
+{
+    uint32_t id_a = ((const Row *)a)->id;
+    uint32_t id_b = ((const Row *)b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/*
+ * Stream a CSV file into the table. Rows are read and sorted in batches of
+ * IMPORT_BATCH_ROWS, and each batch is one commit. Rows past the current
+ * largest key are appended to the rightmost leaf; everything else takes
+ * the normal insert path.
+ */
+void execute_import(Table *table, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("Unable to open '%s'\n", filename);
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Row *batch = malloc(IMPORT_BATCH_ROWS * sizeof(Row));
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    uint64_t bytes_read = 0, imported = 0, duplicates = 0, skipped = 0;
+    uint32_t pages_before = table->pager->num_pages;
+
+    uint32_t rightmost_leaf = table_rightmost_leaf(table);
+    void *leaf = get_page(table->pager, rightmost_leaf);
+    bool table_empty = *leaf_node_num_cells(leaf) == 0;
+    uint32_t max_key = table_empty ? 0 : get_node_max_key(table->pager, leaf);
+    unpin_page(table->pager, rightmost_leaf, false);
+
+    bool done = false;
+    while (!done)
+    {
+        uint32_t batch_size = 0;
+        while (batch_size < IMPORT_BATCH_ROWS)
+        {
+            line_length = getline(&line, &line_capacity, file);
+            if (line_length == -1)
+            {
+                done = true;
+                break;
+            }
+            bytes_read += line_length;
+            if (parse_csv_row(line, &batch[batch_size]))
+            {
+                batch_size++;
+            }
+            else
+            {
+                skipped++;
+            }
+        }
+
+        qsort(batch, batch_size, sizeof(Row), compare_rows_by_id);
+        for (uint32_t i = 0; i < batch_size; i++)
+        {
+            Row *row = &batch[i];
+            if (table_empty || row->id > max_key)
+            {
+                if (rightmost_leaf == INVALID_PAGE_NUM)
+                {
+                    rightmost_leaf = table_rightmost_leaf(table);
+                }
+                rightmost_leaf = leaf_node_append(table, rightmost_leaf, row);
+                index_insert_row(table, row);
+                max_key = row->id;
+                table_empty = false;
+                imported++;
+            }
+            else if (table_insert(table, row) == EXECUTE_SUCCESS)
+            {
+                // A split may have moved the rightmost leaf; look it up again.
+                rightmost_leaf = INVALID_PAGE_NUM;
+                imported++;
+            }
+            else
+            {
+                duplicates++;
+            }
+        }
+        pager_commit(table->pager);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0)
+    {
+        seconds = 1e-9;
+    }
+
+    printf("Imported %llu rows (%llu duplicates, %llu bad lines) into %u new pages in %.3f s\n",
+           (unsigned long long)imported, (unsigned long long)duplicates, (unsigned long long)skipped,
+           table->pager->num_pages - pages_before, seconds);
+    printf("%.0f rows/s, %.2f MB/s\n", imported / seconds, bytes_read / seconds / (1024.0 * 1024.0));
+
+    free(line);
+    free(batch);
+    fclose(file);
+}
+
+/*
+ * Rewrite a format 1 file with fixed-size rows as a format 2 file. The rows
+ * are streamed in key order from the old leaves into <file>-upgrade, indexes
+ * are rebuilt, and the new file is renamed over the old one. Until the
+ * rename the old file is untouched, so an interrupted upgrade starts over.
+ */
+void db_upgrade(Table *old_table, const char *filename, uint32_t num_frames)
+{
+    Pager *old_pager = old_table->pager;
+    char *upgrade_filename = malloc(strlen(filename) + sizeof("-upgrade-wal"));
+    sprintf(upgrade_filename, "%s-upgrade-wal", filename);
+    unlink(upgrade_filename);
+    sprintf(upgrade_filename, "%s-upgrade", filename);
+    unlink(upgrade_filename);
+
+    void *header = get_page(old_pager, 0);
+    uint32_t page_num = *(uint32_t *)(header + HEADER_ROOT_PAGE_OFFSET);
+    uint32_t index_root[NUM_INDEXES];
+    memcpy(index_root, header + HEADER_INDEX_ROOTS_OFFSET, sizeof(index_root));
+    unpin_page(old_pager, 0, false);
+
+    void *node = get_page(old_pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t child_page_num = *internal_node_child(node, 0);
+        unpin_page(old_pager, page_num, false);
+        page_num = child_page_num;
+        node = get_page(old_pager, page_num);
+    }
+    unpin_page(old_pager, page_num, false);
+
+    Table *table = db_open(upgrade_filename, num_frames, false);
+    uint32_t rightmost_leaf = table_rightmost_leaf(table);
+    uint32_t num_rows = 0;
+    while (page_num != 0)
+    {
+        node = get_page(old_pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++)
+        {
+            Row row;
+            deserialize_row(node + V1_LEAF_NODE_HEADER_SIZE + i * V1_LEAF_NODE_CELL_SIZE + LEAF_NODE_KEY_SIZE, &row);
+            row.username[COLUMN_USERNAME_SIZE] = '\0';
+            row.email[COLUMN_EMAIL_SIZE] = '\0';
+            rightmost_leaf = leaf_node_append(table, rightmost_leaf, &row);
+            if (++num_rows % IMPORT_BATCH_ROWS == 0)
+            {
+                pager_commit(table->pager);
+            }
+        }
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        unpin_page(old_pager, page_num, false);
+        page_num = next_page_num;
+    }
+    pager_commit(table->pager);
+
+    for (uint32_t column = 0; column < NUM_INDEXES; column++)
+    {
+        if (index_root[column] != 0)
+        {
+            table_create_index(table, column);
+        }
+    }
+
+    db_close(table);
+    db_close(old_table);
+    if (rename(upgrade_filename, filename) == -1)
+    {
+        printf("Error replacing %s: %d\n", filename, errno);
+        exit(EXIT_FAILURE);
+    }
+    printf("Upgraded %s to format version %d (%u rows)\n", filename, DB_FORMAT_VERSION, num_rows);
+    free(upgrade_filename);
+}
+
+static Row *format0_rows;
+
+int compare_format0_rows(const void *a, const void *b)
+{
+    uint32_t position_a = *(const uint32_t *)a;
+    uint32_t position_b = *(const uint32_t *)b;
+    uint32_t id_a = format0_rows[position_a].id;
+    uint32_t id_b = format0_rows[position_b].id;
+    if (id_a != id_b)
+    {
+        return (id_a > id_b) - (id_a < id_b);
+    }
+    return (position_a > position_b) - (position_a < position_b);
+}
+
+/*
+ * A format 0 file is not empty, has no log next to it, does not start with
+ * the magic string and ends on a whole row.
+ */
+bool db_is_format0(const char *filename)
+{
+    struct stat st;
+    if (stat(filename, &st) == -1 || st.st_size == 0 || st.st_size % PAGE_SIZE % ROW_SIZE != 0)
+    {
+        return false;
+    }
+    char *wal_filename = malloc(strlen(filename) + 5);
+    sprintf(wal_filename, "%s-wal", filename);
+    bool has_wal = access(wal_filename, F_OK) == 0;
+    free(wal_filename);
+    if (has_wal)
+    {
+        return false;
+    }
+
+    char magic[HEADER_MAGIC_SIZE];
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    ssize_t bytes_read = read(fd, magic, HEADER_MAGIC_SIZE);
+    close(fd);
+    return bytes_read == (ssize_t)HEADER_MAGIC_SIZE && memcmp(magic, DB_FILE_MAGIC, HEADER_MAGIC_SIZE) != 0;
+}
+
+/*
+ * Rewrite a format 0 file as a format 2 file. Its rows are in insertion order
+ * and may repeat an id, so they are read whole, sorted, and the first row of
+ * each id is appended to a new tree in <file>-upgrade, which is then renamed
+ * over the old file. Format 0 tables held at most a few thousand rows.
+ */
+void db_upgrade_format0(const char *filename, uint32_t num_frames)
+{
+    int fd = open(filename, O_RDONLY);
+    off_t file_length = fd == -1 ? -1 : lseek(fd, 0, SEEK_END);
+    if (file_length == -1)
+    {
+        printf("Unable to read %s: %d\n", filename, errno);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t num_rows = file_length / PAGE_SIZE * V0_ROWS_PER_PAGE + file_length % PAGE_SIZE / ROW_SIZE;
+    Row *rows = malloc((num_rows + 1) * sizeof(Row));
+    void *page = malloc(PAGE_SIZE);
+    for (uint32_t i = 0; i < num_rows; i++)
+    {
+        if (i % V0_ROWS_PER_PAGE == 0 &&
+            pread(fd, page, PAGE_SIZE, (off_t)(i / V0_ROWS_PER_PAGE) * PAGE_SIZE) == -1)
+        {
+            printf("Unable to read %s: %d\n", filename, errno);
+            exit(EXIT_FAILURE);
+        }
+        deserialize_row(page + i % V0_ROWS_PER_PAGE * ROW_SIZE, &rows[i]);
+        rows[i].username[COLUMN_USERNAME_SIZE] = '\0';
+        rows[i].email[COLUMN_EMAIL_SIZE] = '\0';
+    }
+    free(page);
+    close(fd);
+
+    // qsort is not stable, so sort positions on (id, position) to keep the first row of each id
+    uint32_t *order = malloc((num_rows + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_rows; i++)
+    {
+        order[i] = i;
+    }
+    format0_rows = rows;
+    qsort(order, num_rows, sizeof(uint32_t), compare_format0_rows);
+
+    char *upgrade_filename = malloc(strlen(filename) + sizeof("-upgrade-wal"));
+    sprintf(upgrade_filename, "%s-upgrade-wal", filename);
+    unlink(upgrade_filename);
+    sprintf(upgrade_filename, "%s-upgrade", filename);
+    unlink(upgrade_filename);
+
+    Table *table = db_open(upgrade_filename, num_frames, false);
+    uint32_t rightmost_leaf = table_rightmost_leaf(table);
+    uint32_t num_kept = 0;
+    for (uint32_t i = 0; i < num_rows; i++)
+    {
+        Row *row = &rows[order[i]];
+        if (i > 0 && row->id == rows[order[i - 1]].id)
+        {
+            continue;
+        }
+        rightmost_leaf = leaf_node_append(table, rightmost_leaf, row);
+        if (++num_kept % IMPORT_BATCH_ROWS == 0)
+        {
+            pager_commit(table->pager);
+        }
+    }
+    pager_commit(table->pager);
+    db_close(table);
+
+    if (rename(upgrade_filename, filename) == -1)
+    {
+        printf("Error replacing %s: %d\n", filename, errno);
+        exit(EXIT_FAILURE);
+    }
+    printf("Upgraded %s from the headerless format to format version %d (%u rows, %u duplicate ids dropped)\n",
+           filename, DB_FORMAT_VERSION, num_kept, num_rows - num_kept);
+    free(order);
+    free(rows);
+    free(upgrade_filename);
 }
 
+#ifndef DB_NO_MAIN
 int main(int argc, char *argv[])
 {
     if (argc < 2)
@@ -485,7 +3561,38 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     char *filename = argv[1];
-    Table *table = db_open(filename);
+    uint32_t num_frames = DEFAULT_POOL_FRAMES;
+    bool use_mmap = false;
+    bool async_commit = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            num_frames = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            use_mmap = true;
+        }
+        else if (strcmp(argv[i], "--async-commit") == 0)
+        {
+            async_commit = true;
+        }
+        else
+        {
+            printf("Usage: %s <filename> [--frames N] [--mmap] [--async-commit]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_frames < MIN_POOL_FRAMES)
+    {
+        printf("Buffer pool needs at least %d frames\n", MIN_POOL_FRAMES);
+        exit(EXIT_FAILURE);
+    }
+
+    Table *table = db_open(filename, num_frames, use_mmap);
+    table->pager->async_commit = async_commit;
 
     InputBuffer *input_buffer = new_input_buffer();
 
@@ -513,6 +3620,7 @@ int main(int argc, char *argv[])
             break;
         case (PREPARE_NEGATIVE_ID):
             printf("ID must be positive\n");
+            continue;
         case (PREPARE_STRING_TOO_LONG):
             printf("String is too long\n");
             continue;
@@ -529,8 +3637,8 @@ int main(int argc, char *argv[])
         case EXECUTE_SUCCESS:
             printf("Executed.\n");
             break;
-        case EXECUTE_TABLE_FULL:
-            printf("Error: Table full.\n");
+        case EXECUTE_DUPLICATE_KEY:
+            printf("Error: Duplicate key.\n");
             break;
         }
     }
@@ -538,4 +3646,5 @@ int main(int argc, char *argv[])
     free_table(table);
     close_input_buffer(input_buffer);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -3,7 +3,7 @@
 SRC="orbiting_planets.c"
 OUT="orbiting_planets"
 
-CFLAGS="-Wall -O2"
+CFLAGS="-Wall -O2 -march=native -fno-math-errno"
 LDFLAGS="`sdl2-config --cflags --libs` -lm"
 
 echo "Compiling $SRC..."
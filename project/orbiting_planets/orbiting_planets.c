@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include <math.h>
+#include "../3_body_problem/nbody.h"
 
 #define WIDTH 900
 #define HEIGHT 600
@@ -10,6 +12,7 @@
 #define G 10000
 #define EPSILON 1e-1
 #define MAX_TRAIL_POINTS 500
+#define FIXED_DT 0.001
 
 struct Point {
     int x1, y1;
@@ -38,47 +41,19 @@ void FillCircle(SDL_Surface *surface, struct Planet Planet, Uint32 color) {
     }
 }
 
-void calculate_distance(struct Planet *p1, struct Planet *p2, double dt, SDL_Surface *surface) {
-    double dx = p2->x - p1->x;
-    double dy = p2->y - p1->y;
-    double r = sqrt(dx * dx + dy * dy + EPSILON);
-
-    double F = (G * p1->mass * p2->mass) / (r * r);
-
-    double ax1 = F * dx / r / p1->mass;
-    double ay1 = F * dy / r / p1->mass;
-    double ax2 = -F * dx / r / p2->mass;
-    double ay2 = -F * dy / r / p2->mass;
-
-    p1->vx += ax1 * dt;
-    p1->vy += ay1 * dt;
-    p2->vx += ax2 * dt;
-    p2->vy += ay2 * dt;
-
-    p1->x += p1->vx * dt;
-    p1->y += p1->vy * dt;
-    p2->x += p2->vx * dt;
-    p2->y += p2->vy * dt;
-}
-
-int main(void) {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        fprintf(stderr, "SDL_Init error: %s\n", SDL_GetError());
-        return 1;
-    }
-
-    SDL_Window *window = SDL_CreateWindow(
-        "Orbiting planets simulation",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        WIDTH, HEIGHT,
-        SDL_WINDOW_SHOWN);
-
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
-    if (!surface) {
-        fprintf(stderr, "SDL_GetWindowSurface error: %s\n", SDL_GetError());
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-        return 1;
+int main(int argc, char *argv[]) {
+    Integrator integrator = INTEGRATOR_LEAPFROG;
+    RunOptions run;
+    run_options_default(&run);
+    for (int a = 1; a < argc; a++) {
+        if (run_options_parse(&run, argc, argv, &a)) {
+            continue;
+        } else if (strcmp(argv[a], "--integrator") == 0 && a + 1 < argc && nbody_parse_integrator(argv[a + 1], &integrator)) {
+            a++;
+        } else {
+            fprintf(stderr, "Usage: %s [--integrator leapfrog|yoshida4|rk4]\n" RUN_OPTIONS_USAGE, argv[0]);
+            return 1;
+        }
     }
 
     int running = 1;
@@ -111,7 +86,57 @@ int main(void) {
     planet1.vx = -dy / distance * speed;
     planet1.vy =  dx / distance * speed;
 
+    NBodySystem system;
+    nbody_init(&system, 2, G, EPSILON);
+    nbody_add(&system, planet1.x, planet1.y, planet1.vx, planet1.vy, planet1.mass);
+    nbody_add(&system, planet2.x, planet2.y, planet2.vx, planet2.vy, planet2.mass);
+
+    if (run.headless) {
+        int status = nbody_run_headless(&system, integrator, FIXED_DT, &run);
+        nbody_free(&system);
+        return status;
+    }
+
+    FILE *replay = NULL;
+    if (run.replay) {
+        double replay_dt;
+        long long step;
+        double time;
+        nbody_free(&system);
+        replay = nbody_checkpoint_open(run.replay, &system, &replay_dt);
+        if (!replay)
+            return 1;
+        if (system.count != 2 || !nbody_checkpoint_read(replay, &system, &step, &time)) {
+            fprintf(stderr, "%s does not hold a two-body run\n", run.replay);
+            fclose(replay);
+            nbody_free(&system);
+            return 1;
+        }
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init error: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SDL_Window *window = SDL_CreateWindow(
+        "Orbiting planets simulation",
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        WIDTH, HEIGHT,
+        SDL_WINDOW_SHOWN);
+
+    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    if (!surface) {
+        fprintf(stderr, "SDL_GetWindowSurface error: %s\n", SDL_GetError());
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
+
+    // A replay holds its last checkpoint on screen once the file runs out
+    int replaying = replay != NULL;
     Uint32 prev_ticks = SDL_GetTicks();
+    double accumulator = 0.0;
 
     while (running) {
         Uint32 now = SDL_GetTicks();
@@ -124,7 +149,25 @@ int main(void) {
             }
         }
 
-        calculate_distance(&planet1, &planet2, dt, surface);
+        if (replay) {
+            long long step;
+            double time;
+            if (!nbody_checkpoint_read(replay, &system, &step, &time)) {
+                printf("End of replay\n");
+                fclose(replay);
+                replay = NULL;
+            }
+        }
+
+        accumulator += dt > 0.05 ? 0.05 : dt;
+        while (!replaying && accumulator >= FIXED_DT) {
+            nbody_step(&system, integrator, FIXED_DT);
+            accumulator -= FIXED_DT;
+        }
+        planet1.x = system.x[0];
+        planet1.y = system.y[0];
+        planet2.x = system.x[1];
+        planet2.y = system.y[1];
 
         if (trail_index < MAX_TRAIL_POINTS) {
             trail[trail_index].x1 = (int)planet1.x;
@@ -157,6 +200,9 @@ int main(void) {
         SDL_Delay(16);
     }
 
+    if (replay)
+        fclose(replay);
+    nbody_free(&system);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;